@@ -0,0 +1,304 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+
+/*
+ * A cell holding the current version of a tree, shared between threads: readers take snapshots without locks,
+ * and writers publish new versions.
+ *
+ * The cell points at a Slot holding the root handle and a version number; publishing swaps in a new Slot. Old
+ * Slots are kept alive by hazard pointers: each Reader owns a record (on its own cache line) naming the Slot it
+ * is looking at, and a retired Slot is only deleted once no record names it.
+ *
+ * A Reader keeps its Slot until the version changes, so while it doesn't, get() is a load of the cell plus a
+ * compare - nothing is written, and in particular no refcount, so readers on many cores don't contend. When the
+ * version has changed, get() writes only the Reader's own record. The root it returns is the Slot's own handle,
+ * so reading never touches the tree's refcounts either (as long as the caller doesn't copy the TreePtr).
+ *
+ * Writers publish with update(func) or store(). By default any number of threads may publish: a writer protects
+ * the Slot it starts from like a reader does, and retries func on the newer root if its compare-and-swap loses.
+ * A cell made with single_writer = true skips all that (its one writing thread can't be raced), so publishing
+ * is just a store. Retired Slots, and so the last handle to an old version, are dropped by writers, never by
+ * readers.
+ */
+template<typename TreeType>
+class AtomicRoot {
+    private:
+        struct Slot;
+        struct HazardRecord;
+
+    public:
+        typedef typename TreeType::TreePtr TreePtr;
+
+        // With single_writer, only one thread (at a time) may call store() or update().
+        explicit AtomicRoot(TreePtr root = TreePtr(), bool single_writer = false);
+        ~AtomicRoot();
+
+        AtomicRoot(const AtomicRoot&) = delete;
+        AtomicRoot& operator=(const AtomicRoot&) = delete;
+
+        /*
+         * A thread's view of the cell. Not thread-safe itself: each reading thread should have its own.
+         * Must not outlive the cell.
+         */
+        class Reader {
+            public:
+                explicit Reader(AtomicRoot& cell);
+                ~Reader() { record->release(); }
+
+                Reader(const Reader&) = delete;
+                Reader& operator=(const Reader&) = delete;
+
+                // The current root. Stays valid (and the version stays alive) until the next get() or ~Reader().
+                const TreePtr& get() { return get_slot()->root; }
+
+                // The version number of the root last returned by get() (0 for the root the cell started with).
+                std::uint64_t get_version() const { return slot->version; }
+
+            private:
+                const Slot* get_slot();
+
+                AtomicRoot& cell;
+                HazardRecord* record;
+                const Slot* slot;
+        };
+
+        // A copy of the current root, for occasional reads. Costs a refcount increment; hot paths should use a Reader.
+        TreePtr load() const;
+
+        std::uint64_t get_version() const;
+
+        // Publishes root as the current version, whatever it was. Returns its version number.
+        std::uint64_t store(const TreePtr& root) {
+            return update([&root](const TreePtr&) { return root; });
+        }
+
+        /*
+         * Publishes func(current root) as the current version, calling func again on the newer root whenever
+         * another writer published first. func should have no side effects. Returns the new version number.
+         */
+        template<typename Func>
+        std::uint64_t update(Func&& func, TreePtr* new_root = nullptr); // If non-null, will be set to the published root.
+
+    private:
+        struct Slot {
+            TreePtr root;
+            std::uint64_t version;
+            Slot* next_retired;
+        };
+
+        // Padded on both sides, so that readers don't write to each other's cache lines (in C++11, new won't
+        // align to a cache line).
+        struct HazardRecord {
+            char padding_before[64];
+            std::atomic<const Slot*> hazard;
+            std::atomic<bool> in_use;
+            HazardRecord* next;
+            char padding_after[64];
+
+            void release() {
+                hazard.store(nullptr, std::memory_order_release);
+                in_use.store(false, std::memory_order_release);
+            }
+        };
+
+        HazardRecord* acquire_record() const;
+
+        // Sets record's hazard to the current Slot and returns it.
+        const Slot* protect(HazardRecord* record) const;
+
+        // Hands over a Slot that is no longer current, and deletes every retired Slot that no record names.
+        void retire(Slot* slot);
+
+        const bool single_writer;
+        std::atomic<Slot*> current;
+        mutable std::atomic<HazardRecord*> records; // Never shrinks; records are reused once released.
+        std::atomic<Slot*> retired;
+};
+
+
+// Class method implementations defined here:
+// --------------------------------------------------
+
+#define AtomicRootX AtomicRoot<TreeType>
+
+// (constructor)
+template<typename TreeType>
+AtomicRootX::AtomicRoot(TreePtr root /* = TreePtr() */, bool single_writer /* = false */):
+    single_writer(single_writer),
+    current(new Slot{std::move(root), 0, nullptr}),
+    records(nullptr),
+    retired(nullptr)
+{}
+
+// (destructor)
+template<typename TreeType>
+AtomicRootX::~AtomicRoot() {
+    delete current.load();
+    Slot* slot = retired.load();
+    while (slot != nullptr) {
+        Slot* next = slot->next_retired;
+        delete slot;
+        slot = next;
+    }
+    HazardRecord* record = records.load();
+    while (record != nullptr) {
+        assert(!record->in_use.load()); // A Reader outlived the cell.
+        HazardRecord* next = record->next;
+        delete record;
+        record = next;
+    }
+}
+
+// (constructor)
+template<typename TreeType>
+AtomicRootX::Reader::Reader(AtomicRoot& cell):
+    cell(cell),
+    record(cell.acquire_record()),
+    slot(nullptr)
+{
+    slot = cell.protect(record);
+}
+
+// (instance method)
+template<typename TreeType>
+const typename AtomicRootX::Slot* AtomicRootX::Reader::get_slot() {
+    // The record still names slot, so it can't have been deleted and its address reused: equal means unchanged.
+    if (cell.current.load(std::memory_order_acquire) != slot) {
+        slot = cell.protect(record);
+    }
+    return slot;
+}
+
+// (instance method)
+template<typename TreeType>
+typename AtomicRootX::TreePtr AtomicRootX::load() const {
+    HazardRecord* record = acquire_record();
+    TreePtr root = protect(record)->root;
+    record->release();
+    return root;
+}
+
+// (instance method)
+template<typename TreeType>
+std::uint64_t AtomicRootX::get_version() const {
+    HazardRecord* record = acquire_record();
+    const std::uint64_t version = protect(record)->version;
+    record->release();
+    return version;
+}
+
+// (instance method)
+template<typename TreeType>
+template<typename Func>
+std::uint64_t AtomicRootX::update(Func&& func, TreePtr* new_root /* = nullptr */) {
+    std::unique_ptr<Slot> new_slot(new Slot{TreePtr(), 0, nullptr});
+    if (single_writer) {
+        // Only this thread replaces (and so retires) the current Slot.
+        Slot* old_slot = current.load(std::memory_order_relaxed);
+        new_slot->root = func(old_slot->root);
+        new_slot->version = old_slot->version + 1;
+        if (new_root != nullptr) {
+            *new_root = new_slot->root;
+        }
+        const std::uint64_t version = new_slot->version;
+        current.store(new_slot.release());
+        retire(old_slot);
+        return version;
+    }
+
+    HazardRecord* record = acquire_record();
+    try {
+        while (true) {
+            Slot* old_slot = const_cast<Slot*>(protect(record));
+            new_slot->root = func(old_slot->root);
+            new_slot->version = old_slot->version + 1;
+            // Once published, new_slot may be replaced and deleted by another writer at any time.
+            if (new_root != nullptr) {
+                *new_root = new_slot->root;
+            }
+            const std::uint64_t version = new_slot->version;
+            if (current.compare_exchange_strong(old_slot, new_slot.get())) {
+                new_slot.release();
+                record->release();
+                retire(old_slot);
+                return version;
+            }
+        }
+    } catch (...) {
+        record->release();
+        throw;
+    }
+}
+
+// (instance method)
+template<typename TreeType>
+typename AtomicRootX::HazardRecord* AtomicRootX::acquire_record() const {
+    for (HazardRecord* record = records.load(std::memory_order_acquire); record != nullptr; record = record->next) {
+        bool expected = false;
+        if (!record->in_use.load(std::memory_order_relaxed)
+            && record->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire)
+        ) {
+            return record;
+        }
+    }
+    HazardRecord* record = new HazardRecord();
+    record->hazard.store(nullptr, std::memory_order_relaxed);
+    record->in_use.store(true, std::memory_order_relaxed);
+    record->next = records.load(std::memory_order_relaxed);
+    while (!records.compare_exchange_weak(record->next, record, std::memory_order_release, std::memory_order_relaxed)) {}
+    return record;
+}
+
+// (instance method)
+template<typename TreeType>
+const typename AtomicRootX::Slot* AtomicRootX::protect(HazardRecord* record) const {
+    // Sequentially consistent, so that a writer scanning the records after replacing the Slot sees this hazard.
+    const Slot* slot = current.load();
+    while (true) {
+        record->hazard.store(slot);
+        const Slot* again = current.load();
+        if (again == slot) {
+            return slot;
+        }
+        slot = again;
+    }
+}
+
+// (instance method)
+template<typename TreeType>
+void AtomicRootX::retire(Slot* slot) {
+    // Take the whole retired list, so that no other writer is looking at it.
+    slot->next_retired = retired.exchange(nullptr);
+    Slot* keep = nullptr;
+    while (slot != nullptr) {
+        Slot* next = slot->next_retired;
+        bool named = false;
+        for (HazardRecord* record = records.load(); record != nullptr && !named; record = record->next) {
+            named = (record->hazard.load() == slot);
+        }
+        if (named) {
+            slot->next_retired = keep;
+            keep = slot;
+        } else {
+            delete slot;
+        }
+        slot = next;
+    }
+
+    // Put back the ones still in use, to be tried again by the next writer.
+    while (keep != nullptr) {
+        Slot* next = keep->next_retired;
+        keep->next_retired = retired.load();
+        while (!retired.compare_exchange_weak(keep->next_retired, keep)) {}
+        keep = next;
+    }
+}
+
+#undef AtomicRootX
@@ -0,0 +1,355 @@
+#pragma once
+
+#include "node_handles.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+
+/*
+ * Epoch-based reclamation: readers inside an EpochGuard may follow raw pointers to nodes with no refcount
+ * traffic at all, because nothing they could reach is freed until they leave.
+ *
+ * There is one global epoch. Entering a guard announces the current epoch in the thread's own record (on its
+ * own cache line); that's the only write a reader makes, once per guard, however much it reads. An object that
+ * is retired (e.g. a node whose last handle was dropped) is tagged with the epoch at the time, and is freed only
+ * once the global epoch is two ahead of that tag. The epoch only moves forward when every thread in a guard has
+ * announced the current one, so by then no guard that could have seen the object is still open.
+ *
+ *     EpochDomain   -- The global epoch, the threads' records and their lists of retired objects.
+ *     EpochGuard    -- Announces this thread as reading, for its lifetime.
+ *     EpochHandles  -- A handle policy whose dropped nodes are retired instead of deleted.
+ *     EpochRoot     -- A cell holding the current version of a tree, read inside a guard without any writes.
+ *
+ * Each thread frees what it has retired itself, a batch at a time, from retire() or reclaim(). Freeing a node
+ * only releases its children, which retire in turn if that was their last handle, so even a big version is freed
+ * iteratively and never recursively. What a thread still holds when it exits is freed by the next thread to
+ * reclaim.
+ */
+class EpochDomain {
+    public:
+        // A thread tries to free its retired objects once it has at least this many (and twice as many as last time).
+        static constexpr std::size_t RECLAIM_THRESHOLD = 256;
+
+        static void enter();
+        static void exit();
+        static bool in_guard() { return get_thread_state().depth > 0; }
+
+        // Frees deleter(object) once no guard that was open at the time of this call is still open.
+        static void retire(void* object, void (*deleter)(void*));
+
+        /*
+         * Moves the epoch forward as far as the open guards allow, freeing whatever this thread (and exited
+         * threads) retired before it. With no other guard open, frees everything, including what that frees.
+         */
+        static void reclaim();
+
+        static std::uint64_t get_epoch() { return get_shared().epoch.load(std::memory_order_acquire); }
+
+        // How many objects this thread has retired that aren't freed yet.
+        static std::size_t get_num_pending() { return get_thread_state().retired.size(); }
+
+    private:
+        static constexpr std::uint64_t QUIESCENT = 0; // A record's epoch while its thread is not in a guard.
+
+        // Padded on both sides, so that readers don't write to each other's cache lines.
+        struct Record {
+            char padding_before[64];
+            std::atomic<std::uint64_t> epoch;
+            std::atomic<bool> in_use;
+            Record* next;
+            char padding_after[64];
+        };
+
+        struct Retired {
+            void* object;
+            void (*deleter)(void*);
+            std::uint64_t epoch;
+        };
+
+        struct Shared {
+            std::atomic<std::uint64_t> epoch{1};
+            std::atomic<Record*> records{nullptr}; // Never shrinks; records are reused once their thread exits.
+            std::mutex mutex;
+            std::vector<Retired> orphans; // Retired by threads that have exited.
+            std::atomic<bool> has_orphans{false};
+        };
+
+        struct ThreadState {
+            Record* record = nullptr;
+            int depth = 0;
+            bool reclaiming = false;
+            std::size_t next_reclaim_at = RECLAIM_THRESHOLD;
+            std::vector<Retired> retired;
+
+            ThreadState();
+            ~ThreadState();
+        };
+
+        static Shared& get_shared() {
+            // Never destroyed: objects may still be retired by other static objects' destructors.
+            static Shared* shared = new Shared();
+            return *shared;
+        }
+
+        static ThreadState& get_thread_state() {
+            thread_local ThreadState state;
+            return state;
+        }
+
+        // Moves the epoch forward by one, if every thread in a guard has announced the current one.
+        static bool try_advance();
+};
+
+
+/*
+ * Keeps this thread inside the current epoch for its lifetime. Guards nest; only the outermost one counts.
+ */
+class EpochGuard {
+    public:
+        EpochGuard() { EpochDomain::enter(); }
+        ~EpochGuard() { EpochDomain::exit(); }
+
+        EpochGuard(const EpochGuard&) = delete;
+        EpochGuard& operator=(const EpochGuard&) = delete;
+};
+
+
+/*
+ * Nodes carry their own atomic refcount (like IntrusiveHandles<true>), and the last handle to a node retires it
+ * to the EpochDomain instead of deleting it. So inside an EpochGuard, a raw pointer to a node of any version
+ * that was alive when the guard was entered stays valid until the guard ends, e.g. from find_node(), whoever
+ * drops that version meanwhile.
+ */
+struct EpochHandles {
+    template<typename Node>
+    using Ptr = IntrusivePtr<Node>;
+
+    template<typename Node>
+    class NodeBase : public IntrusiveRefCount<true> {
+        public:
+            static void intrusive_destroy(Node* node) { EpochDomain::retire(node, &destroy); }
+
+        private:
+            static void destroy(void* node) { delete static_cast<Node*>(node); }
+    };
+
+    static constexpr bool thread_safe = true;
+    static constexpr bool concurrent_make = true;
+
+    template<typename Node, typename... Args>
+    static Ptr<Node> make(Args&&... args) {
+        return Ptr<Node>(new Node(std::forward<Args>(args)...));
+    }
+};
+
+
+/*
+ * A cell holding the current version of a tree, like AtomicRoot (see atomic_root.h), but whose replaced Slots
+ * are retired to the EpochDomain instead of being guarded by hazard pointers. So a reader needs no record of its
+ * own: inside an EpochGuard, get() is a single load, and the root it returns stays valid until the guard ends.
+ *
+ * Works with any handle policy; with EpochHandles, raw pointers into the tree stay valid as long as the guard too.
+ */
+template<typename TreeType>
+class EpochRoot {
+    public:
+        typedef typename TreeType::TreePtr TreePtr;
+
+        explicit EpochRoot(TreePtr root = TreePtr()): current(new Slot{std::move(root), 0}) {}
+        ~EpochRoot() { delete current.load(); }
+
+        EpochRoot(const EpochRoot&) = delete;
+        EpochRoot& operator=(const EpochRoot&) = delete;
+
+        // The current root. Only inside an EpochGuard, and only valid until it ends.
+        const TreePtr& get() const { return get_slot()->root; }
+
+        // The version number of the current root (0 for the root the cell started with). Only inside an EpochGuard.
+        std::uint64_t get_version() const { return get_slot()->version; }
+
+        // A copy of the current root, usable outside a guard. Costs a refcount increment.
+        TreePtr load() const {
+            EpochGuard guard;
+            return get();
+        }
+
+        // Publishes root as the current version, whatever it was. Returns its version number.
+        std::uint64_t store(const TreePtr& root) {
+            return update([&root](const TreePtr&) { return root; });
+        }
+
+        /*
+         * Publishes func(current root) as the current version, calling func again on the newer root whenever
+         * another writer published first. func should have no side effects. Returns the new version number.
+         */
+        template<typename Func>
+        std::uint64_t update(Func&& func, TreePtr* new_root = nullptr); // If non-null, will be set to the published root.
+
+    private:
+        struct Slot {
+            TreePtr root;
+            std::uint64_t version;
+        };
+
+        const Slot* get_slot() const {
+            assert(EpochDomain::in_guard());
+            return current.load(std::memory_order_acquire);
+        }
+
+        static void delete_slot(void* slot) { delete static_cast<Slot*>(slot); }
+
+        std::atomic<Slot*> current;
+};
+
+
+// Class method implementations defined here:
+// --------------------------------------------------
+
+// (constructor)
+inline EpochDomain::ThreadState::ThreadState() {
+    Shared& shared = get_shared();
+    for (Record* r = shared.records.load(std::memory_order_acquire); r != nullptr; r = r->next) {
+        bool expected = false;
+        if (!r->in_use.load(std::memory_order_relaxed)
+            && r->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire)
+        ) {
+            record = r;
+            return;
+        }
+    }
+    record = new Record();
+    record->epoch.store(QUIESCENT, std::memory_order_relaxed);
+    record->in_use.store(true, std::memory_order_relaxed);
+    record->next = shared.records.load(std::memory_order_relaxed);
+    while (!shared.records.compare_exchange_weak(record->next, record, std::memory_order_release, std::memory_order_relaxed)) {}
+}
+
+// (destructor)
+inline EpochDomain::ThreadState::~ThreadState() {
+    assert(depth == 0);
+    Shared& shared = get_shared();
+    if (!retired.empty()) {
+        // Hand everything this thread hasn't freed yet over to the other threads.
+        std::lock_guard<std::mutex> lock(shared.mutex);
+        shared.orphans.insert(shared.orphans.end(), retired.begin(), retired.end());
+        shared.has_orphans.store(true, std::memory_order_release);
+    }
+    record->epoch.store(QUIESCENT, std::memory_order_release);
+    record->in_use.store(false, std::memory_order_release);
+}
+
+// (static method)
+inline void EpochDomain::enter() {
+    ThreadState& state = get_thread_state();
+    if (state.depth++ > 0) {
+        return;
+    }
+    // Sequentially consistent, so that a thread moving the epoch forward either sees this record, or finished
+    // before this thread reads anything (and so anything it frees was already out of reach).
+    state.record->epoch.store(get_shared().epoch.load());
+}
+
+// (static method)
+inline void EpochDomain::exit() {
+    ThreadState& state = get_thread_state();
+    assert(state.depth > 0);
+    if (--state.depth == 0) {
+        state.record->epoch.store(QUIESCENT, std::memory_order_release);
+    }
+}
+
+// (static method)
+inline void EpochDomain::retire(void* object, void (*deleter)(void*)) {
+    ThreadState& state = get_thread_state();
+    state.retired.push_back(Retired{object, deleter, get_shared().epoch.load()});
+    if (state.retired.size() >= state.next_reclaim_at && !state.reclaiming) {
+        reclaim();
+        state.next_reclaim_at = std::max(std::size_t(RECLAIM_THRESHOLD), 2 * state.retired.size());
+    }
+}
+
+// (static method)
+inline void EpochDomain::reclaim() {
+    ThreadState& state = get_thread_state();
+    if (state.reclaiming) {
+        return; // Called from a deleter: the loop below will get to whatever that retired.
+    }
+    state.reclaiming = true;
+
+    Shared& shared = get_shared();
+    if (shared.has_orphans.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> lock(shared.mutex);
+        state.retired.insert(state.retired.end(), shared.orphans.begin(), shared.orphans.end());
+        shared.orphans.clear();
+        shared.has_orphans.store(false, std::memory_order_relaxed);
+    }
+
+    std::vector<Retired> ready;
+    while (!state.retired.empty()) {
+        const bool advanced = try_advance();
+        const std::uint64_t epoch = shared.epoch.load();
+        // Take out everything two epochs old, since freeing it may retire more.
+        const auto is_pending = [epoch](const Retired& r) { return r.epoch + 2 > epoch; };
+        const auto first_ready = std::stable_partition(state.retired.begin(), state.retired.end(), is_pending);
+        ready.assign(first_ready, state.retired.end());
+        state.retired.erase(first_ready, state.retired.end());
+        for (const Retired& r : ready) {
+            r.deleter(r.object);
+        }
+        if (!advanced) {
+            break;
+        }
+    }
+    state.reclaiming = false;
+}
+
+// (static method)
+inline bool EpochDomain::try_advance() {
+    Shared& shared = get_shared();
+    std::uint64_t epoch = shared.epoch.load();
+    for (Record* r = shared.records.load(std::memory_order_acquire); r != nullptr; r = r->next) {
+        const std::uint64_t announced = r->epoch.load();
+        if (announced != QUIESCENT && announced != epoch) {
+            return false;
+        }
+    }
+    // Someone else may have moved it forward already, which is just as good.
+    shared.epoch.compare_exchange_strong(epoch, epoch + 1);
+    return true;
+}
+
+
+#define EpochRootX EpochRoot<TreeType>
+
+// (instance method)
+template<typename TreeType>
+template<typename Func>
+std::uint64_t EpochRootX::update(Func&& func, TreePtr* new_root /* = nullptr */) {
+    EpochGuard guard; // Keeps old_slot alive, even if another writer replaces it.
+    std::unique_ptr<Slot> new_slot(new Slot{TreePtr(), 0});
+    Slot* old_slot = current.load(std::memory_order_acquire);
+    while (true) {
+        new_slot->root = func(old_slot->root);
+        new_slot->version = old_slot->version + 1;
+        // Once published, new_slot may be replaced and retired by another writer at any time.
+        if (new_root != nullptr) {
+            *new_root = new_slot->root;
+        }
+        const std::uint64_t version = new_slot->version;
+        if (current.compare_exchange_strong(old_slot, new_slot.get())) {
+            new_slot.release();
+            EpochDomain::retire(old_slot, &delete_slot);
+            return version;
+        }
+    }
+}
+
+#undef EpochRootX
@@ -0,0 +1,363 @@
+#pragma once
+
+#include "node_handles.h"
+#include "persistent_avl_tree.h"
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+/*
+ * A read-only tree file that is mmap()ed and queried in place, with no deserialization.
+ *
+ * The file holds the nodes exactly as they are laid out in memory, so it only works with MappedHandles: its
+ * handles are self-relative offsets (so they stay valid wherever the file is mapped), and its mapped nodes are
+ * marked as such so that handles to them never touch their refcounts (the mapping is read-only). Everything
+ * else - find(), the finders, iterators, inserts and removes - works on a mapped tree as on any other, and new
+ * versions are made of ordinary heap nodes that point into the mapping.
+ *
+ * Because it's a memory image, a file can only be read by a build with the same tree type and ABI (the node
+ * size and a format version are checked), and NodeContent must be trivially copyable (no pointers to the heap).
+ */
+
+
+/*
+ * IntrusiveRefCount, plus a flag for nodes in a mapped file: they are never counted (or destroyed).
+ */
+template<bool ThreadSafe>
+class MappableRefCount : public IntrusiveRefCount<ThreadSafe> {
+    public:
+        MappableRefCount(): mapped(false) {}
+        MappableRefCount(const MappableRefCount& other): IntrusiveRefCount<ThreadSafe>(other), mapped(false) {}
+
+        void intrusive_add_ref() const {
+            if (!mapped) { IntrusiveRefCount<ThreadSafe>::intrusive_add_ref(); }
+        }
+
+        bool intrusive_release() const {
+            return !mapped && IntrusiveRefCount<ThreadSafe>::intrusive_release();
+        }
+
+        bool is_mapped() const { return mapped; }
+
+    protected:
+        // Only while writing a file, before any handle to the node exists.
+        void set_mapped() { mapped = true; }
+
+    private:
+        bool mapped;
+};
+
+
+/*
+ * A handle that stores the distance from itself to the node, rather than an address.
+ * So a node and its handles to its children can be written to a file and mapped back at any address.
+ * Otherwise like IntrusivePtr (copying one recomputes the distance from the copy).
+ */
+template<typename Node>
+class RelativePtr {
+    public:
+        typedef Node element_type;
+
+        RelativePtr(): offset(0) {}
+        RelativePtr(std::nullptr_t): offset(0) {}
+
+        explicit RelativePtr(Node* ptr) {
+            set(ptr);
+            if (ptr) { ptr->intrusive_add_ref(); }
+        }
+
+        RelativePtr(const RelativePtr& other) {
+            Node* ptr = other.get();
+            set(ptr);
+            if (ptr) { ptr->intrusive_add_ref(); }
+        }
+
+        RelativePtr(RelativePtr&& other) {
+            set(other.get());
+            other.offset = 0;
+        }
+
+        ~RelativePtr() { release(); }
+
+        RelativePtr& operator=(const RelativePtr& other) {
+            RelativePtr(other).swap(*this);
+            return *this;
+        }
+
+        RelativePtr& operator=(RelativePtr&& other) {
+            RelativePtr(std::move(other)).swap(*this);
+            return *this;
+        }
+
+        RelativePtr& operator=(std::nullptr_t) {
+            reset();
+            return *this;
+        }
+
+        Node* get() const {
+            return offset ? reinterpret_cast<Node*>(reinterpret_cast<std::uintptr_t>(this) + offset) : nullptr;
+        }
+        Node& operator*() const { assert(offset); return *get(); }
+        Node* operator->() const { assert(offset); return get(); }
+        explicit operator bool() const { return offset != 0; }
+
+        long use_count() const { return offset ? get()->intrusive_use_count() : 0; }
+
+        void reset() { RelativePtr().swap(*this); }
+
+        // Swaps what the handles point to (not their offsets, which are relative to where each handle is).
+        void swap(RelativePtr& other) {
+            Node* ptr = get();
+            set(other.get());
+            other.set(ptr);
+        }
+
+    private:
+        void set(Node* ptr) {
+            // Unsigned, so the subtraction wraps instead of overflowing; 0 is never a node (it's this handle).
+            offset = ptr ? reinterpret_cast<std::uintptr_t>(ptr) - reinterpret_cast<std::uintptr_t>(this) : 0;
+        }
+
+        void release() {
+            Node* ptr = get();
+            if (ptr && ptr->intrusive_release()) {
+                Node::intrusive_destroy(ptr);
+            }
+        }
+
+        std::uintptr_t offset;
+};
+
+template<typename Node>
+bool operator==(const RelativePtr<Node>& a, const RelativePtr<Node>& b) { return a.get() == b.get(); }
+template<typename Node>
+bool operator!=(const RelativePtr<Node>& a, const RelativePtr<Node>& b) { return a.get() != b.get(); }
+template<typename Node>
+bool operator==(const RelativePtr<Node>& a, std::nullptr_t) { return !a; }
+template<typename Node>
+bool operator!=(const RelativePtr<Node>& a, std::nullptr_t) { return bool(a); }
+template<typename Node>
+bool operator==(std::nullptr_t, const RelativePtr<Node>& b) { return !b; }
+template<typename Node>
+bool operator!=(std::nullptr_t, const RelativePtr<Node>& b) { return bool(b); }
+
+
+/*
+ * Like IntrusiveHandles, but with RelativePtr handles, so trees can be written to and mapped from a file
+ * (see MappedTreeFile). Nodes made at run time are ordinary heap nodes.
+ */
+template<bool ThreadSafe = true>
+struct MappedHandles {
+    template<typename Node>
+    using Ptr = RelativePtr<Node>;
+
+    template<typename Node>
+    class NodeBase : public MappableRefCount<ThreadSafe> {
+        public:
+            static void intrusive_destroy(Node* node) { delete node; }
+
+        private:
+            template<typename TreeType>
+            friend class MappedTreeFile;
+    };
+
+    static constexpr bool thread_safe = ThreadSafe;
+    static constexpr bool concurrent_make = true;
+
+    template<typename Node, typename... Args>
+    static Ptr<Node> make(Args&&... args) {
+        return Ptr<Node>(new Node(std::forward<Args>(args)...));
+    }
+};
+
+
+/*
+ * One version of a tree, written to a file by write() and mapped back (read-only) by the constructor.
+ *
+ * Handles into the mapping (get_root(), and any version made from it) must all be dropped before the
+ * MappedTreeFile is destroyed.
+ */
+template<typename TreeType>
+class MappedTreeFile {
+    public:
+        typedef typename TreeType::TreePtr TreePtr;
+
+        // Throws if the file can't be read, or wasn't written by write() for this TreeType.
+        explicit MappedTreeFile(const std::string& path);
+        ~MappedTreeFile();
+
+        MappedTreeFile(const MappedTreeFile&) = delete;
+        MappedTreeFile& operator=(const MappedTreeFile&) = delete;
+
+        const TreePtr& get_root() const { return root; }
+        std::uint64_t get_num_nodes() const { return header()->num_nodes; }
+
+        // Writes root's version to path. Nodes shared within it are written once.
+        static void write(const std::string& path, const TreePtr& root);
+
+    private:
+        struct Header {
+            char magic[8];
+            std::uint32_t format_version;
+            std::uint32_t node_size; // sizeof(TreeType)
+            std::uint64_t num_nodes;
+            std::uint64_t root_index; // 1-based, or 0 for an empty tree.
+        };
+
+        // Nodes start here, so they're aligned wherever the mapping is (mmap() gives page alignment).
+        static constexpr std::size_t NODES_OFFSET = 64;
+        static constexpr std::uint32_t FORMAT_VERSION = 1;
+
+        static_assert(sizeof(Header) <= NODES_OFFSET && alignof(TreeType) <= NODES_OFFSET, "MappedTreeFile: Bad layout.");
+        static_assert(
+            std::is_trivially_copyable<typename TreeType::NodeContentT>::value,
+            "MappedTreeFile: NodeContent must be trivially copyable."
+        );
+
+        static const char* magic() { return "PAVLMAP1"; }
+
+        const Header* header() const { return static_cast<const Header*>(mapping); }
+
+        // Post-order, so each node's children are laid out before it. Returns node's 1-based index (0 for none).
+        static std::uint64_t lay_out(
+            TreeType* node,
+            std::vector<TreeType*>* order,
+            std::unordered_map<TreeType*, std::uint64_t>* indexes
+        );
+
+        int fd;
+        void* mapping;
+        std::size_t mapping_size;
+        TreePtr root;
+};
+
+
+// Class method implementations defined here:
+// --------------------------------------------------
+
+// (constructor)
+template<typename TreeType>
+MappedTreeFile<TreeType>::MappedTreeFile(const std::string& path): fd(-1), mapping(nullptr), mapping_size(0) {
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("MappedTreeFile(): Could not open file.");
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || std::size_t(st.st_size) < NODES_OFFSET) {
+        close(fd);
+        throw std::runtime_error("MappedTreeFile(): Not a mapped tree file.");
+    }
+    mapping_size = std::size_t(st.st_size);
+    mapping = mmap(nullptr, mapping_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        close(fd);
+        throw std::runtime_error("MappedTreeFile(): Could not map file.");
+    }
+
+    const Header* h = header();
+    const char* error = nullptr;
+    if (memcmp(h->magic, magic(), sizeof(h->magic)) != 0) {
+        error = "MappedTreeFile(): Not a mapped tree file.";
+    } else if (h->format_version != FORMAT_VERSION || h->node_size != sizeof(TreeType)) {
+        error = "MappedTreeFile(): File was written for a different tree type or build.";
+    } else if (h->root_index > h->num_nodes || mapping_size < NODES_OFFSET + h->num_nodes * sizeof(TreeType)) {
+        error = "MappedTreeFile(): File is truncated.";
+    }
+    if (error != nullptr) {
+        munmap(mapping, mapping_size);
+        close(fd);
+        throw std::runtime_error(error);
+    }
+
+    if (h->root_index != 0) {
+        TreeType* nodes = reinterpret_cast<TreeType*>(static_cast<char*>(mapping) + NODES_OFFSET);
+        root = TreePtr(&nodes[h->root_index - 1]);
+    }
+}
+
+// (destructor)
+template<typename TreeType>
+MappedTreeFile<TreeType>::~MappedTreeFile() {
+    root = nullptr;
+    munmap(mapping, mapping_size);
+    close(fd);
+}
+
+// (static method)
+template<typename TreeType>
+std::uint64_t MappedTreeFile<TreeType>::lay_out(
+    TreeType* node,
+    std::vector<TreeType*>* order,
+    std::unordered_map<TreeType*, std::uint64_t>* indexes
+) {
+    if (node == nullptr) {
+        return 0;
+    }
+    const typename std::unordered_map<TreeType*, std::uint64_t>::const_iterator found = indexes->find(node);
+    if (found != indexes->end()) {
+        return found->second;
+    }
+    lay_out(node->get_left().get(), order, indexes);
+    lay_out(node->get_right().get(), order, indexes);
+    order->push_back(node);
+    return (*indexes)[node] = order->size();
+}
+
+// (static method)
+template<typename TreeType>
+void MappedTreeFile<TreeType>::write(const std::string& path, const TreePtr& root) {
+    std::vector<TreeType*> order;
+    std::unordered_map<TreeType*, std::uint64_t> indexes;
+    const std::uint64_t root_index = lay_out(root.get(), &order, &indexes);
+
+    // Build the image in memory: every node made in place, as a mapped node, with handles to the nodes before it.
+    const std::size_t image_size = NODES_OFFSET + order.size() * sizeof(TreeType);
+    std::unique_ptr<std::max_align_t[]> image(new std::max_align_t[image_size / sizeof(std::max_align_t) + 1]);
+    char* bytes = reinterpret_cast<char*>(image.get());
+    memset(bytes, 0, image_size);
+
+    Header* h = reinterpret_cast<Header*>(bytes);
+    memcpy(h->magic, magic(), sizeof(h->magic));
+    h->format_version = FORMAT_VERSION;
+    h->node_size = sizeof(TreeType);
+    h->num_nodes = order.size();
+    h->root_index = root_index;
+
+    TreeType* nodes = reinterpret_cast<TreeType*>(bytes + NODES_OFFSET);
+    auto image_node = [&](TreeType* node) {
+        return (node != nullptr) ? TreePtr(&nodes[indexes[node] - 1]) : TreePtr();
+    };
+    for (std::size_t i = 0; i < order.size(); i++) {
+        TreeType* node = order[i];
+        TreeType* copy = new (&nodes[i]) TreeType(
+            node->get_content(),
+            image_node(node->get_left().get()),
+            image_node(node->get_right().get())
+        );
+        copy->set_mapped();
+        // Never destroyed: its handles are to mapped nodes, so there is nothing to release.
+    }
+
+    std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+    out.write(bytes, image_size);
+    out.close();
+    if (!out) {
+        throw std::runtime_error("write(): Could not write file.");
+    }
+}
@@ -0,0 +1,188 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <stdexcept>
+#include <thread>
+
+
+/*
+ * Augmentation policies decide what else AvlTree keeps per subtree, besides its height.
+ *
+ * An augmentation policy provides:
+ *     typedef ... Summary               -- A monoid summarising a run of nodes, e.g. a sum or a min. void for none.
+ *     static Summary identity()         -- The summary of no nodes.
+ *     static Summary of(const NodeContent& content) -- The summary of one node.
+ *     static Summary combine(const Summary& a, const Summary& b) -- The summary of a's nodes followed by b's.
+ *                                          Must be associative (not necessarily commutative).
+ *     static constexpr bool keeps_size  -- Whether nodes keep the size of their subtree. Without sizes, anything
+ *                                          by index (index_finder(), erase_range(), rank_of(), TreeIterator, ...)
+ *                                          throws, but each node is 4 bytes smaller.
+ *
+ * Summaries are recomputed whenever a node is made (or changed by a TransientTree), so rotations, balancing
+ * and path copies keep them up to date. Summary must be default-constructible and copy-assignable.
+ *
+ * Optionally, for lazy range updates (see AvlTree::apply_to_range()), it also provides:
+ *     typedef ... Tag                   -- An update to apply to a whole range of nodes, e.g. "add 5".
+ *     static NodeContent apply_to_content(const Tag& tag, const NodeContent& content)
+ *     static Summary apply_to_summary(const Tag& tag, const Summary& summary) -- The summary after tagging every node.
+ *     static Tag compose(const Tag& first, const Tag& second) -- The same as applying first, then second.
+ *
+ * A tagged node holds its updated content and summary, and a pending tag for its children. The first time
+ * anyone asks for its children, it swaps in tagged copies of them (and clears the tag). That changes nothing
+ * any version can see, so it's safe on shared nodes, and it is done under a per-node spinlock.
+ */
+
+
+// The Tag of an augmentation without one.
+struct NoTag {};
+
+// Just sizes, no summary. The default.
+struct NoAugmentation {
+    typedef void Summary;
+    static constexpr bool keeps_size = true;
+};
+
+// Any augmentation, without sizes.
+template<typename Augmentation = NoAugmentation>
+struct WithoutSize : Augmentation {
+    static constexpr bool keeps_size = false;
+};
+
+
+// Bases of AvlTree that hold the size and the summary, or nothing (so they cost no space) if there are none.
+namespace AugmentationDetail {
+
+    template<typename T>
+    struct Void { typedef void type; };
+
+    template<bool KeepsSize>
+    class SizeField {
+        public:
+            int get_size() { return size; } // Number of nodes in this tree.
+
+        protected:
+            void set_size(int new_size) { size = new_size; }
+
+        private:
+            int size;
+    };
+
+    template<>
+    class SizeField<false> {
+        public:
+            int get_size() {
+                throw std::runtime_error("get_size(): This tree type doesn't keep sizes (see keeps_size).");
+            }
+
+        protected:
+            void set_size(int) {}
+    };
+
+    template<typename Augmentation, typename Summary = typename Augmentation::Summary>
+    class SummaryField {
+        public:
+            const Summary& get_summary() { return summary; } // Summary of every node in this tree, in order.
+
+        protected:
+            template<typename NodeContent, typename TreePtr>
+            void update_summary(const NodeContent& content, const TreePtr& left, const TreePtr& right) {
+                summary = Augmentation::combine(
+                    Augmentation::combine(summary_of(left), Augmentation::of(content)),
+                    summary_of(right)
+                );
+            }
+
+            // Sets this node's summary to that of other with tag applied to every node.
+            template<typename Tag, typename Node>
+            void set_tagged_summary(const Tag& tag, Node* other) {
+                summary = Augmentation::apply_to_summary(tag, other->get_summary());
+            }
+
+        private:
+            template<typename TreePtr>
+            static Summary summary_of(const TreePtr& tree) {
+                return (tree != nullptr) ? tree->get_summary() : Augmentation::identity();
+            }
+
+            Summary summary;
+    };
+
+    template<typename Augmentation>
+    class SummaryField<Augmentation, void> {
+        protected:
+            template<typename NodeContent, typename TreePtr>
+            void update_summary(const NodeContent&, const TreePtr&, const TreePtr&) {}
+
+            template<typename Tag, typename Node>
+            void set_tagged_summary(const Tag&, Node*) {}
+    };
+
+
+    template<typename Augmentation, typename = void>
+    struct TagOf { typedef NoTag type; };
+
+    template<typename Augmentation>
+    struct TagOf<Augmentation, typename Void<typename Augmentation::Tag>::type> { typedef typename Augmentation::Tag type; };
+
+    /*
+     * A pending tag, and the lock that guards it (and the node's children) while it is pushed down.
+     * States only go PENDING -> LOCKED -> PENDING or CLEAN, so once CLEAN a node's children never change again.
+     */
+    template<typename Augmentation, typename Tag = typename TagOf<Augmentation>::type>
+    class TagField {
+        protected:
+            TagField(): state(CLEAN) {}
+            TagField(const TagField& other): tag(other.tag), state(other.state.load(std::memory_order_acquire)) {
+                assert(state != LOCKED);
+            }
+
+            static constexpr bool is_lazy = true;
+
+            // Only on a new node, before anyone else can see it.
+            void set_tag(const Tag& new_tag) {
+                tag = new_tag;
+                state.store(PENDING, std::memory_order_relaxed);
+            }
+
+            const Tag& get_tag() const { return tag; }
+
+            // Returns false straight away if there is no pending tag. Otherwise locks it and returns true.
+            bool lock_tag() const {
+                while (true) {
+                    unsigned char current = state.load(std::memory_order_acquire);
+                    if (current == CLEAN) {
+                        return false;
+                    }
+                    if (current == PENDING
+                        && state.compare_exchange_weak(current, LOCKED, std::memory_order_acquire, std::memory_order_relaxed)
+                    ) {
+                        return true;
+                    }
+                    std::this_thread::yield();
+                }
+            }
+
+            void unlock_tag(bool still_pending) const {
+                state.store(still_pending ? PENDING : CLEAN, std::memory_order_release);
+            }
+
+        private:
+            enum : unsigned char { CLEAN, PENDING, LOCKED };
+
+            Tag tag;
+            mutable std::atomic<unsigned char> state;
+    };
+
+    template<typename Augmentation>
+    class TagField<Augmentation, NoTag> {
+        protected:
+            static constexpr bool is_lazy = false;
+
+            void set_tag(const NoTag&) {}
+            const NoTag& get_tag() const { static const NoTag tag; return tag; }
+            bool lock_tag() const { return false; }
+            void unlock_tag(bool) const {}
+    };
+
+}
@@ -0,0 +1,187 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+
+/*
+ * Handle policies decide how AvlTree nodes hold on to each other (and how users hold on to versions).
+ *
+ * A handle policy provides:
+ *     template<typename Node> using Ptr    -- The handle type, e.g. std::shared_ptr<Node>.
+ *     template<typename Node> class NodeBase -- A base class of every node, e.g. to embed a refcount.
+ *     template<typename Node, typename... Args> static Ptr<Node> make(Args&&... args)
+ *     static constexpr bool thread_safe    -- Whether handles to one node may be copied/dropped from several threads at once.
+ *     static constexpr bool concurrent_make -- Whether make() may be called from several threads at once.
+ */
+
+
+/*
+ * The default policy: every node is owned through a std::shared_ptr.
+ */
+struct SharedHandles {
+    template<typename Node>
+    using Ptr = std::shared_ptr<Node>;
+
+    template<typename Node>
+    class NodeBase {};
+
+    static constexpr bool thread_safe = true;
+    static constexpr bool concurrent_make = true;
+
+    template<typename Node, typename... Args>
+    static Ptr<Node> make(Args&&... args) {
+        return std::make_shared<Node>(std::forward<Args>(args)...);
+    }
+};
+
+
+/*
+ * A refcount that lives inside the object it counts.
+ * The atomic flavour is safe to share between threads; the plain one is cheaper but single-threaded only.
+ */
+template<bool ThreadSafe>
+class IntrusiveRefCount;
+
+template<>
+class IntrusiveRefCount<false> {
+    public:
+        IntrusiveRefCount(): refs(0) {}
+        IntrusiveRefCount(const IntrusiveRefCount&): refs(0) {} // A copy is a new object, with no handles yet.
+        IntrusiveRefCount& operator=(const IntrusiveRefCount&) = delete;
+
+        void intrusive_add_ref() const { refs++; }
+        bool intrusive_release() const { return --refs == 0; } // Returns true if that was the last handle.
+        long intrusive_use_count() const { return refs; }
+
+    private:
+        mutable int refs;
+};
+
+template<>
+class IntrusiveRefCount<true> {
+    public:
+        IntrusiveRefCount(): refs(0) {}
+        IntrusiveRefCount(const IntrusiveRefCount&): refs(0) {} // A copy is a new object, with no handles yet.
+        IntrusiveRefCount& operator=(const IntrusiveRefCount&) = delete;
+
+        void intrusive_add_ref() const { refs.fetch_add(1, std::memory_order_relaxed); }
+
+        bool intrusive_release() const { // Returns true if that was the last handle.
+            if (refs.fetch_sub(1, std::memory_order_release) == 1) {
+                std::atomic_thread_fence(std::memory_order_acquire);
+                return true;
+            }
+            return false;
+        }
+
+        long intrusive_use_count() const { return refs.load(std::memory_order_relaxed); }
+
+    private:
+        mutable std::atomic<int> refs;
+};
+
+
+/*
+ * A smart pointer to an object that embeds its own refcount (see IntrusiveRefCount).
+ * Same size as a raw pointer, and no separate control block.
+ * When the last handle goes away, Node::intrusive_destroy(node) is called.
+ */
+template<typename Node>
+class IntrusivePtr {
+    public:
+        typedef Node element_type;
+
+        IntrusivePtr(): ptr(nullptr) {}
+        IntrusivePtr(std::nullptr_t): ptr(nullptr) {}
+
+        explicit IntrusivePtr(Node* ptr): ptr(ptr) {
+            if (ptr) { ptr->intrusive_add_ref(); }
+        }
+
+        IntrusivePtr(const IntrusivePtr& other): ptr(other.ptr) {
+            if (ptr) { ptr->intrusive_add_ref(); }
+        }
+
+        IntrusivePtr(IntrusivePtr&& other): ptr(other.ptr) {
+            other.ptr = nullptr;
+        }
+
+        ~IntrusivePtr() { release(); }
+
+        IntrusivePtr& operator=(const IntrusivePtr& other) {
+            IntrusivePtr(other).swap(*this);
+            return *this;
+        }
+
+        IntrusivePtr& operator=(IntrusivePtr&& other) {
+            IntrusivePtr(std::move(other)).swap(*this);
+            return *this;
+        }
+
+        IntrusivePtr& operator=(std::nullptr_t) {
+            reset();
+            return *this;
+        }
+
+        Node* get() const { return ptr; }
+        Node& operator*() const { assert(ptr); return *ptr; }
+        Node* operator->() const { assert(ptr); return ptr; }
+        explicit operator bool() const { return ptr != nullptr; }
+
+        long use_count() const { return ptr ? ptr->intrusive_use_count() : 0; }
+
+        void reset() { IntrusivePtr().swap(*this); }
+        void swap(IntrusivePtr& other) { std::swap(ptr, other.ptr); }
+
+    private:
+        void release() {
+            if (ptr && ptr->intrusive_release()) {
+                Node::intrusive_destroy(ptr);
+            }
+        }
+
+        Node* ptr;
+};
+
+template<typename Node>
+bool operator==(const IntrusivePtr<Node>& a, const IntrusivePtr<Node>& b) { return a.get() == b.get(); }
+template<typename Node>
+bool operator!=(const IntrusivePtr<Node>& a, const IntrusivePtr<Node>& b) { return a.get() != b.get(); }
+template<typename Node>
+bool operator==(const IntrusivePtr<Node>& a, std::nullptr_t) { return a.get() == nullptr; }
+template<typename Node>
+bool operator!=(const IntrusivePtr<Node>& a, std::nullptr_t) { return a.get() != nullptr; }
+template<typename Node>
+bool operator==(std::nullptr_t, const IntrusivePtr<Node>& b) { return b.get() == nullptr; }
+template<typename Node>
+bool operator!=(std::nullptr_t, const IntrusivePtr<Node>& b) { return b.get() != nullptr; }
+
+
+/*
+ * Nodes carry their own refcount and are held through IntrusivePtr.
+ * Use IntrusiveHandles<false> when every version of a tree stays on one thread:
+ * path copies then cost plain increments instead of atomic read-modify-writes.
+ */
+template<bool ThreadSafe = true>
+struct IntrusiveHandles {
+    template<typename Node>
+    using Ptr = IntrusivePtr<Node>;
+
+    template<typename Node>
+    class NodeBase : public IntrusiveRefCount<ThreadSafe> {
+        public:
+            static void intrusive_destroy(Node* node) { delete node; }
+    };
+
+    static constexpr bool thread_safe = ThreadSafe;
+    static constexpr bool concurrent_make = true;
+
+    template<typename Node, typename... Args>
+    static Ptr<Node> make(Args&&... args) {
+        return Ptr<Node>(new Node(std::forward<Args>(args)...));
+    }
+};
@@ -0,0 +1,662 @@
+#pragma once
+
+#include "node_handles.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+
+/*
+ * Handle policies that take node memory from slabs instead of one global-heap allocation per node.
+ * Both hold nodes through IntrusivePtr (see node_handles.h).
+ *
+ *     PooledHandles<ThreadSafe> -- Per-thread slabs of same-sized blocks, recycled through free lists.
+ *     ArenaHandles<ThreadSafe>  -- Nodes are carved out of the current NodeArena and freed all at once with it.
+ *     CompactHandles<ThreadSafe> -- Like PooledHandles, but handles are 32-bit block indices instead of pointers.
+ */
+
+
+/*
+ * A pool of same-sized blocks, carved out of large slabs.
+ *
+ * Each thread has its own free list and its own slab to carve from, so allocate() and deallocate()
+ * take no locks and make no allocator calls in the common case. Every slab belongs to one thread's Owner
+ * (named in the slab's header; slabs are aligned to their size, so that's one mask away from any block).
+ * A block freed on its owner's thread joins that thread's free list; a block freed on another thread is
+ * pushed onto its Owner's lock-free remote stack, which the owner takes whole before carving a new slab.
+ * So blocks always go back to the thread that carves from their slab, e.g. when one thread builds versions
+ * and another drops them.
+ *
+ * When a thread exits, its Owner (with its free list and what's left of its slab) is parked, and the next
+ * new thread takes it over. The shared mutex is only taken for that, to get a new slab, or to take blocks
+ * from parked Owners.
+ *
+ * Slabs are never returned to the global heap; freed blocks are reused by later allocations.
+ */
+template<std::size_t BlockSize, std::size_t BlockAlign>
+class NodePool {
+    public:
+        static constexpr std::size_t SLAB_BYTES = 64 * 1024;
+
+        static void* allocate() {
+            ThreadCache& cache = get_thread_cache();
+            if (cache.free_list == nullptr && cache.bump == cache.bump_end) {
+                refill(&cache);
+            }
+            if (cache.free_list != nullptr) {
+                FreeBlock* block = cache.free_list;
+                cache.free_list = block->next;
+                return block;
+            }
+            void* block = cache.bump;
+            cache.bump += block_size();
+            return block;
+        }
+
+        static void deallocate(void* ptr) {
+            assert(ptr);
+            ThreadCache& cache = get_thread_cache();
+            FreeBlock* block = static_cast<FreeBlock*>(ptr);
+            Owner* owner = get_owner(ptr);
+            if (owner == cache.owner) {
+                block->next = cache.free_list;
+                cache.free_list = block;
+                return;
+            }
+            block->next = owner->remote_free.load(std::memory_order_relaxed);
+            while (!owner->remote_free.compare_exchange_weak(block->next, block, std::memory_order_release, std::memory_order_relaxed)) {}
+        }
+
+        static int num_slabs() {
+            Shared& shared = get_shared();
+            std::lock_guard<std::mutex> lock(shared.mutex);
+            return int(shared.slabs.size());
+        }
+
+    private:
+        static_assert(BlockAlign <= alignof(std::max_align_t), "NodePool: over-aligned nodes are not supported.");
+
+        struct FreeBlock {
+            FreeBlock* next;
+        };
+
+        // The blocks of one thread's slabs. Never destroyed: parked when its thread exits, for the next one.
+        struct Owner {
+            std::atomic<FreeBlock*> remote_free{nullptr}; // Freed by other threads; pushed by them, taken whole.
+
+            // Only while parked: what its last thread had left.
+            FreeBlock* free_list = nullptr;
+            char* bump = nullptr;
+            char* bump_end = nullptr;
+        };
+
+        static constexpr std::size_t block_size() {
+            return (std::max(BlockSize, sizeof(FreeBlock)) + alignof(std::max_align_t) - 1)
+                / alignof(std::max_align_t) * alignof(std::max_align_t);
+        }
+
+        // Room for the Owner pointer at the start of a slab, keeping the blocks after it aligned.
+        static constexpr std::size_t header_size() {
+            return (sizeof(Owner*) + alignof(std::max_align_t) - 1) / alignof(std::max_align_t) * alignof(std::max_align_t);
+        }
+
+        static constexpr std::size_t round_up_to_power_of_2(std::size_t n, std::size_t power = 1) {
+            return (power >= n) ? power : round_up_to_power_of_2(n, 2 * power);
+        }
+
+        // A power of 2 (slabs are aligned to it), with room for at least one block.
+        static constexpr std::size_t slab_size() {
+            return round_up_to_power_of_2(std::max(std::size_t(SLAB_BYTES), header_size() + block_size()));
+        }
+
+        static Owner* get_owner(void* block) {
+            const std::uintptr_t slab = reinterpret_cast<std::uintptr_t>(block) & ~std::uintptr_t(slab_size() - 1);
+            return *reinterpret_cast<Owner**>(slab);
+        }
+
+        struct Shared {
+            std::mutex mutex;
+            std::vector<Owner*> parked_owners; // Of threads that have exited.
+            std::vector<void*> slabs;
+        };
+
+        struct ThreadCache {
+            Owner* owner = nullptr;
+            FreeBlock* free_list = nullptr;
+            char* bump = nullptr;
+            char* bump_end = nullptr;
+
+            ThreadCache() {
+                Shared& shared = get_shared();
+                std::lock_guard<std::mutex> lock(shared.mutex);
+                if (shared.parked_owners.empty()) {
+                    owner = new Owner();
+                    return;
+                }
+                owner = shared.parked_owners.back();
+                shared.parked_owners.pop_back();
+                free_list = owner->free_list;
+                bump = owner->bump;
+                bump_end = owner->bump_end;
+            }
+
+            ~ThreadCache() {
+                // Park everything this thread still holds with its Owner, for the next thread.
+                Shared& shared = get_shared();
+                std::lock_guard<std::mutex> lock(shared.mutex);
+                owner->free_list = free_list;
+                owner->bump = bump;
+                owner->bump_end = bump_end;
+                shared.parked_owners.push_back(owner);
+            }
+        };
+
+        static Shared& get_shared() {
+            // Never destroyed: blocks may still be freed by other static objects' destructors.
+            static Shared* shared = new Shared();
+            return *shared;
+        }
+
+        static ThreadCache& get_thread_cache() {
+            thread_local ThreadCache cache;
+            return cache;
+        }
+
+        static void refill(ThreadCache* cache) {
+            // First, the blocks of this thread's slabs that other threads have freed.
+            cache->free_list = cache->owner->remote_free.exchange(nullptr, std::memory_order_acquire);
+            if (cache->free_list != nullptr) {
+                return;
+            }
+
+            Shared& shared = get_shared();
+            std::lock_guard<std::mutex> lock(shared.mutex);
+            // Then whatever parked Owners have (their blocks stay theirs: freeing them here sends them back).
+            for (Owner* parked : shared.parked_owners) {
+                cache->free_list = parked->remote_free.exchange(nullptr, std::memory_order_acquire);
+                if (cache->free_list == nullptr) {
+                    std::swap(cache->free_list, parked->free_list);
+                }
+                if (cache->free_list != nullptr) {
+                    return;
+                }
+            }
+
+            const std::size_t num_blocks = (slab_size() - header_size()) / block_size();
+            void* slab = nullptr;
+            if (posix_memalign(&slab, slab_size(), slab_size()) != 0) {
+                throw std::bad_alloc();
+            }
+            *static_cast<Owner**>(slab) = cache->owner;
+            shared.slabs.push_back(slab);
+            cache->bump = static_cast<char*>(slab) + header_size();
+            cache->bump_end = cache->bump + num_blocks * block_size();
+        }
+};
+
+
+/*
+ * Nodes carry their own refcount (like IntrusiveHandles) and live in NodePool slabs.
+ */
+template<bool ThreadSafe = true>
+struct PooledHandles {
+    template<typename Node>
+    using Ptr = IntrusivePtr<Node>;
+
+    template<typename Node>
+    using Pool = NodePool<sizeof(Node), alignof(Node)>;
+
+    template<typename Node>
+    class NodeBase : public IntrusiveRefCount<ThreadSafe> {
+        public:
+            static void intrusive_destroy(Node* node) {
+                node->~Node();
+                Pool<Node>::deallocate(node);
+            }
+    };
+
+    static constexpr bool thread_safe = ThreadSafe;
+    static constexpr bool concurrent_make = true;
+
+    template<typename Node, typename... Args>
+    static Ptr<Node> make(Args&&... args) {
+        void* memory = Pool<Node>::allocate();
+        try {
+            return Ptr<Node>(new (memory) Node(std::forward<Args>(args)...));
+        } catch (...) {
+            Pool<Node>::deallocate(memory);
+            throw;
+        }
+    }
+};
+
+
+/*
+ * Owns the memory of a batch of nodes, and frees it all at once when destroyed (or release()d).
+ *
+ * Nodes are allocated from the arena that is current on the calling thread (see NodeArena::Scope).
+ * Dropping a node runs its destructor but doesn't free its memory; that only happens with the arena.
+ * So every version built in an arena must be dropped before the arena is released.
+ *
+ * Allocating is not thread-safe: a given arena should be current on one thread at a time.
+ */
+class NodeArena {
+    public:
+        explicit NodeArena(std::size_t slab_bytes = 64 * 1024):
+            slab_bytes(slab_bytes),
+            bump(nullptr),
+            bump_end(nullptr),
+            num_live(0)
+        {}
+
+        NodeArena(const NodeArena&) = delete;
+        NodeArena& operator=(const NodeArena&) = delete;
+
+        ~NodeArena() { release(); }
+
+        void* allocate(std::size_t size) {
+            size = (size + alignof(std::max_align_t) - 1) / alignof(std::max_align_t) * alignof(std::max_align_t);
+            if (std::size_t(bump_end - bump) < size) {
+                const std::size_t new_slab_bytes = std::max(slab_bytes, size);
+                bump = static_cast<char*>(::operator new(new_slab_bytes));
+                bump_end = bump + new_slab_bytes;
+                slabs.push_back(bump);
+            }
+            void* ret = bump;
+            bump += size;
+            return ret;
+        }
+
+        // Frees every node allocated in this arena. The arena can then be reused. No node of it may be alive.
+        void release() {
+            assert(num_live.load(std::memory_order_acquire) == 0); // A version built in this arena is still alive.
+            for (void* slab : slabs) {
+                ::operator delete(slab);
+            }
+            slabs.clear();
+            bump = nullptr;
+            bump_end = nullptr;
+        }
+
+        int num_slabs() const { return int(slabs.size()); }
+
+        // Nodes made in this arena (by ArenaHandles) and not yet destroyed.
+        long get_num_live() const { return num_live.load(std::memory_order_relaxed); }
+
+        static NodeArena* current() { return current_arena(); }
+
+        /*
+         * Makes an arena current on this thread for the lifetime of the Scope.
+         * Scopes nest; the previous arena becomes current again afterwards.
+         */
+        class Scope {
+            public:
+                explicit Scope(NodeArena& arena): previous(current_arena()) { current_arena() = &arena; }
+                ~Scope() { current_arena() = previous; }
+
+                Scope(const Scope&) = delete;
+                Scope& operator=(const Scope&) = delete;
+
+            private:
+                NodeArena* previous;
+        };
+
+    private:
+        static NodeArena*& current_arena() {
+            thread_local NodeArena* arena = nullptr;
+            return arena;
+        }
+
+        template<bool ThreadSafe>
+        friend struct ArenaHandles;
+
+        const std::size_t slab_bytes;
+        std::vector<void*> slabs;
+        char* bump;
+        char* bump_end;
+        std::atomic<long> num_live; // Atomic: nodes may be dropped on other threads (ArenaHandles<true>).
+};
+
+
+/*
+ * Nodes carry their own refcount (like IntrusiveHandles) and live in the current NodeArena.
+ * Throws if no arena is current when a node is made.
+ *
+ * Each node also points back to its arena, which counts its live nodes so that release() can check that none
+ * are left. Dropping a version still runs the destructor of every node only it held (to release the children's
+ * refcounts); only the freeing of their memory is left to the arena.
+ */
+template<bool ThreadSafe = false>
+struct ArenaHandles {
+    template<typename Node>
+    using Ptr = IntrusivePtr<Node>;
+
+    template<typename Node>
+    class NodeBase : public IntrusiveRefCount<ThreadSafe> {
+        public:
+            // Only ever constructed by make(), so in the current arena.
+            NodeBase(): arena(NodeArena::current()) { arena->num_live.fetch_add(1, std::memory_order_relaxed); }
+            NodeBase(const NodeBase& other): IntrusiveRefCount<ThreadSafe>(other), arena(NodeArena::current()) {
+                arena->num_live.fetch_add(1, std::memory_order_relaxed);
+            }
+            ~NodeBase() { arena->num_live.fetch_sub(1, std::memory_order_release); }
+
+            static void intrusive_destroy(Node* node) { node->~Node(); }
+
+        private:
+            NodeArena* arena;
+    };
+
+    static constexpr bool thread_safe = ThreadSafe;
+    static constexpr bool concurrent_make = false; // A NodeArena is only current on one thread.
+
+    template<typename Node, typename... Args>
+    static Ptr<Node> make(Args&&... args) {
+        NodeArena* arena = NodeArena::current();
+        if (arena == nullptr) {
+            throw std::runtime_error("ArenaHandles::make(): No NodeArena is current on this thread.");
+        }
+        return Ptr<Node>(new (arena->allocate(sizeof(Node))) Node(std::forward<Args>(args)...));
+    }
+};
+
+
+/*
+ * A pool of blocks for one Node type, where each block is named by a 32-bit index instead of a pointer.
+ * Index 0 is never handed out, so it can stand for nullptr.
+ *
+ * Blocks are only rounded up to alignof(Node), and slabs are found through a fixed table indexed by the
+ * top bits of the index, so get() is two loads. Otherwise it works like NodePool: per-thread free lists
+ * and slabs, blocks freed on another thread go back to their slab's Owner through its lock-free remote
+ * stack (Owners are found through a second table), and an exited thread's Owner is parked for the next one.
+ *
+ * Slabs are never returned to the global heap; freed blocks are reused by later allocations.
+ */
+template<typename Node>
+class IndexedNodePool {
+    public:
+        static constexpr int SLAB_BITS = 12;
+        static constexpr std::uint64_t BLOCKS_PER_SLAB = std::uint64_t(1) << SLAB_BITS;
+        static constexpr std::uint64_t MAX_SLABS = std::uint64_t(1) << (32 - SLAB_BITS);
+
+        static void* get(std::uint32_t index) {
+            assert(index != 0);
+            char* slab = slab_table()[index >> SLAB_BITS].load(std::memory_order_acquire);
+            assert(slab != nullptr);
+            return slab + (index & (BLOCKS_PER_SLAB - 1)) * block_size();
+        }
+
+        static std::uint32_t allocate() {
+            ThreadCache& cache = get_thread_cache();
+            if (cache.free_list == 0 && cache.bump == cache.bump_end) {
+                refill(&cache);
+            }
+            if (cache.free_list != 0) {
+                const std::uint32_t index = cache.free_list;
+                cache.free_list = get_next(index);
+                return index;
+            }
+            return std::uint32_t(cache.bump++);
+        }
+
+        static void deallocate(std::uint32_t index) {
+            assert(index != 0);
+            ThreadCache& cache = get_thread_cache();
+            Owner* owner = owner_table()[index >> SLAB_BITS].load(std::memory_order_acquire);
+            if (owner == cache.owner) {
+                set_next(index, cache.free_list);
+                cache.free_list = index;
+                return;
+            }
+            std::uint32_t head = owner->remote_free.load(std::memory_order_relaxed);
+            do {
+                set_next(index, head);
+            } while (!owner->remote_free.compare_exchange_weak(head, index, std::memory_order_release, std::memory_order_relaxed));
+        }
+
+        static int num_slabs() {
+            Shared& shared = get_shared();
+            std::lock_guard<std::mutex> lock(shared.mutex);
+            return shared.num_slabs;
+        }
+
+    private:
+        static constexpr std::size_t block_size() {
+            return (std::max(sizeof(Node), sizeof(std::uint32_t)) + alignof(Node) - 1) / alignof(Node) * alignof(Node);
+        }
+
+        // A free block holds the index of the next free block (0 at the end of the list).
+        static std::uint32_t get_next(std::uint32_t index) {
+            std::uint32_t next;
+            std::memcpy(&next, get(index), sizeof(next));
+            return next;
+        }
+
+        static void set_next(std::uint32_t index, std::uint32_t next) {
+            std::memcpy(get(index), &next, sizeof(next));
+        }
+
+        // The blocks of one thread's slabs. Never destroyed: parked when its thread exits, for the next one.
+        struct Owner {
+            std::atomic<std::uint32_t> remote_free{0}; // Freed by other threads; pushed by them, taken whole.
+
+            // Only while parked: what its last thread had left.
+            std::uint32_t free_list = 0;
+            std::uint64_t bump = 0;
+            std::uint64_t bump_end = 0;
+        };
+
+        struct Shared {
+            std::mutex mutex;
+            std::vector<Owner*> parked_owners; // Of threads that have exited.
+            int num_slabs = 0;
+        };
+
+        struct ThreadCache {
+            Owner* owner = nullptr;
+            std::uint32_t free_list = 0;
+            std::uint64_t bump = 0;
+            std::uint64_t bump_end = 0;
+
+            ThreadCache() {
+                Shared& shared = get_shared();
+                std::lock_guard<std::mutex> lock(shared.mutex);
+                if (shared.parked_owners.empty()) {
+                    owner = new Owner();
+                    return;
+                }
+                owner = shared.parked_owners.back();
+                shared.parked_owners.pop_back();
+                free_list = owner->free_list;
+                bump = owner->bump;
+                bump_end = owner->bump_end;
+            }
+
+            ~ThreadCache() {
+                // Park everything this thread still holds with its Owner, for the next thread.
+                Shared& shared = get_shared();
+                std::lock_guard<std::mutex> lock(shared.mutex);
+                owner->free_list = free_list;
+                owner->bump = bump;
+                owner->bump_end = bump_end;
+                shared.parked_owners.push_back(owner);
+            }
+        };
+
+        static std::atomic<char*>* slab_table() {
+            // Zero-initialized static storage: untouched entries cost no memory.
+            static std::atomic<char*> table[MAX_SLABS];
+            return table;
+        }
+
+        static std::atomic<Owner*>* owner_table() {
+            static std::atomic<Owner*> table[MAX_SLABS];
+            return table;
+        }
+
+        static Shared& get_shared() {
+            // Never destroyed: blocks may still be freed by other static objects' destructors.
+            static Shared* shared = new Shared();
+            return *shared;
+        }
+
+        static ThreadCache& get_thread_cache() {
+            thread_local ThreadCache cache;
+            return cache;
+        }
+
+        static void refill(ThreadCache* cache) {
+            // First, the blocks of this thread's slabs that other threads have freed.
+            cache->free_list = cache->owner->remote_free.exchange(0, std::memory_order_acquire);
+            if (cache->free_list != 0) {
+                return;
+            }
+
+            Shared& shared = get_shared();
+            std::lock_guard<std::mutex> lock(shared.mutex);
+            // Then whatever parked Owners have (their blocks stay theirs: freeing them here sends them back).
+            for (Owner* parked : shared.parked_owners) {
+                cache->free_list = parked->remote_free.exchange(0, std::memory_order_acquire);
+                if (cache->free_list == 0) {
+                    std::swap(cache->free_list, parked->free_list);
+                }
+                if (cache->free_list != 0) {
+                    return;
+                }
+            }
+
+            if (std::uint64_t(shared.num_slabs) == MAX_SLABS) {
+                throw std::runtime_error("IndexedNodePool::allocate(): Out of 32-bit node indices.");
+            }
+            const std::uint64_t slab_index = shared.num_slabs++;
+            owner_table()[slab_index].store(cache->owner, std::memory_order_release);
+            slab_table()[slab_index].store(
+                static_cast<char*>(::operator new(BLOCKS_PER_SLAB * block_size())),
+                std::memory_order_release
+            );
+            cache->bump = std::max<std::uint64_t>(1, slab_index << SLAB_BITS); // Skip index 0.
+            cache->bump_end = (slab_index + 1) << SLAB_BITS;
+        }
+};
+
+
+/*
+ * A handle to a node in its IndexedNodePool: just a 32-bit index, so half the size of a raw pointer.
+ * Otherwise like IntrusivePtr. When the last handle goes away, Node::intrusive_destroy(index) is called.
+ */
+template<typename Node>
+class IndexPtr {
+    public:
+        typedef Node element_type;
+
+        IndexPtr(): index(0) {}
+        IndexPtr(std::nullptr_t): index(0) {}
+
+        explicit IndexPtr(std::uint32_t index): index(index) {
+            if (index) { get()->intrusive_add_ref(); }
+        }
+
+        IndexPtr(const IndexPtr& other): index(other.index) {
+            if (index) { get()->intrusive_add_ref(); }
+        }
+
+        IndexPtr(IndexPtr&& other): index(other.index) {
+            other.index = 0;
+        }
+
+        ~IndexPtr() { release(); }
+
+        IndexPtr& operator=(const IndexPtr& other) {
+            IndexPtr(other).swap(*this);
+            return *this;
+        }
+
+        IndexPtr& operator=(IndexPtr&& other) {
+            IndexPtr(std::move(other)).swap(*this);
+            return *this;
+        }
+
+        IndexPtr& operator=(std::nullptr_t) {
+            reset();
+            return *this;
+        }
+
+        Node* get() const { return index ? static_cast<Node*>(IndexedNodePool<Node>::get(index)) : nullptr; }
+        Node& operator*() const { assert(index); return *get(); }
+        Node* operator->() const { assert(index); return get(); }
+        explicit operator bool() const { return index != 0; }
+
+        std::uint32_t get_index() const { return index; }
+        long use_count() const { return index ? get()->intrusive_use_count() : 0; }
+
+        void reset() { IndexPtr().swap(*this); }
+        void swap(IndexPtr& other) { std::swap(index, other.index); }
+
+    private:
+        void release() {
+            if (index && get()->intrusive_release()) {
+                Node::intrusive_destroy(index);
+            }
+        }
+
+        std::uint32_t index;
+};
+
+template<typename Node>
+bool operator==(const IndexPtr<Node>& a, const IndexPtr<Node>& b) { return a.get_index() == b.get_index(); }
+template<typename Node>
+bool operator!=(const IndexPtr<Node>& a, const IndexPtr<Node>& b) { return a.get_index() != b.get_index(); }
+template<typename Node>
+bool operator==(const IndexPtr<Node>& a, std::nullptr_t) { return a.get_index() == 0; }
+template<typename Node>
+bool operator!=(const IndexPtr<Node>& a, std::nullptr_t) { return a.get_index() != 0; }
+template<typename Node>
+bool operator==(std::nullptr_t, const IndexPtr<Node>& b) { return b.get_index() == 0; }
+template<typename Node>
+bool operator!=(std::nullptr_t, const IndexPtr<Node>& b) { return b.get_index() != 0; }
+
+
+/*
+ * Nodes carry their own refcount and live in an IndexedNodePool; children are 32-bit indices.
+ * With small NodeContent a node is 24 bytes (refcount, content, two indices, size, height).
+ * Each Node type can have at most about 2^32 nodes alive at once.
+ */
+template<bool ThreadSafe = true>
+struct CompactHandles {
+    template<typename Node>
+    using Ptr = IndexPtr<Node>;
+
+    template<typename Node>
+    class NodeBase : public IntrusiveRefCount<ThreadSafe> {
+        public:
+            static void intrusive_destroy(std::uint32_t index) {
+                static_cast<Node*>(IndexedNodePool<Node>::get(index))->~Node();
+                IndexedNodePool<Node>::deallocate(index);
+            }
+    };
+
+    static constexpr bool thread_safe = ThreadSafe;
+    static constexpr bool concurrent_make = true;
+
+    template<typename Node, typename... Args>
+    static Ptr<Node> make(Args&&... args) {
+        const std::uint32_t index = IndexedNodePool<Node>::allocate();
+        try {
+            new (IndexedNodePool<Node>::get(index)) Node(std::forward<Args>(args)...);
+        } catch (...) {
+            IndexedNodePool<Node>::deallocate(index);
+            throw;
+        }
+        return Ptr<Node>(index);
+    }
+};
@@ -1,6 +1,9 @@
 #pragma once
 
 #include "linked_list.h"
+#include "node_augmentations.h"
+#include "node_handles.h"
+#include "node_pools.h"
 
 #include <algorithm>
 #include <cassert>
@@ -12,6 +15,7 @@
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
@@ -25,14 +29,59 @@ enum InsertOrReplaceMode {
 };
 
 
+/*
+ * The default comparator for cmp_finder(): returns -1, 0 or 1, using only operator<.
+ * Compares any two types that have operator<, so it is transparent (see PersistentMap).
+ */
+struct ThreeWayLess {
+    typedef void is_transparent;
+
+    template<typename A, typename B>
+    int operator()(const A& a, const B& b) const {
+        if (a < b) { return -1; }
+        if (b < a) { return 1; }
+        return 0;
+    }
+};
+
+
+namespace TreeOps {
+    template<typename TreePtr>
+    int get_size(const TreePtr& tree);
+
+    template<typename TreePtr>
+    int get_height(const TreePtr& tree);
+}
+
+template<typename TreeType>
+class TransientTree;
+
+
 /*
  * A self-balancing, persistent, immutable, binary search tree.
+ * HandlePolicy decides how nodes are allocated, referenced and refcounted (see node_handles.h, node_pools.h).
+ * Augmentation decides what each node keeps about its subtree besides its height (see node_augmentations.h).
+ *
+ * Fully static CRTP: there is no vtable and no RTTI. Nodes are always created and destroyed as DerivedTree,
+ * and DerivedTree can customise get_label() by simply hiding it (no `virtual` needed).
  */
-template<typename NodeContent, typename DerivedTree>
-class AvlTree {
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy = SharedHandles, typename Augmentation = NoAugmentation>
+class AvlTree :
+    public HandlePolicy::template NodeBase<DerivedTree>,
+    public AugmentationDetail::SizeField<Augmentation::keeps_size>,
+    public AugmentationDetail::SummaryField<Augmentation>,
+    public AugmentationDetail::TagField<Augmentation>
+{
     public:
-        typedef std::shared_ptr<DerivedTree> TreePtr;
+        typedef typename HandlePolicy::template Ptr<DerivedTree> TreePtr;
         typedef NodeContent NodeContentT;
+        typedef HandlePolicy HandlePolicyT;
+        typedef Augmentation AugmentationT;
+        typedef typename Augmentation::Summary SummaryT;
+        typedef typename AugmentationDetail::TagOf<Augmentation>::type TagT; // NoTag if Augmentation has no Tag.
+
+        static constexpr bool keeps_size = Augmentation::keeps_size;
+        static constexpr bool is_lazy = AugmentationDetail::TagField<Augmentation>::is_lazy; // Whether TagT is a real tag.
 
         AvlTree(
             const NodeContent& content,
@@ -40,29 +89,32 @@ class AvlTree {
             const TreePtr& right
         );
 
-        virtual ~AvlTree() {}
+        AvlTree(
+            NodeContent&& content,
+            const TreePtr& left,
+            const TreePtr& right
+        );
+
+        AvlTree(const AvlTree& other) = default;
+        AvlTree& operator=(const AvlTree& other) = delete; // Nodes are immutable.
 
         const NodeContent& get_content() { return content; }
-        const TreePtr& get_left() { return left; }
-        const TreePtr& get_right() { return right; }
-        int get_size() { return size; } // Number of nodes in this tree.
+        const TreePtr& get_left() { push_tag(); return left; }
+        const TreePtr& get_right() { push_tag(); return right; }
         int get_height() { return height; } // Number of levels in this tree, i.e. length of the longest path from the root.
 
         const TreePtr& get_child(int left_or_right) {
             assert(left_or_right != 0);
+            push_tag();
             if (left_or_right < 0) { return left; }
             else                   { return right; }
         }
 
-        int get_num_children() { return int(bool(left)) + int(bool(right)); }
+        int get_num_children() { return int(bool(get_left())) + int(bool(get_right())); }
 
-        DerivedTree* get_derived() {
-            DerivedTree* derived_tree = dynamic_cast<DerivedTree*>(this);
-            assert(derived_tree);
-            return derived_tree;
-        }
+        DerivedTree* get_derived() { return static_cast<DerivedTree*>(this); }
 
-        virtual std::string get_label() { return "x"; }
+        std::string get_label() { return "x"; }
 
         std::string draw_as_text();
 
@@ -81,43 +133,306 @@ class AvlTree {
          */
         typedef std::function<int (const TreePtr& current_node)> FinderFunc;
 
+        /*
+         * Every function below that takes a finder_func accepts any callable with FinderFunc's signature:
+         * a FinderFunc, a lambda, or one of the finder functors below. With the latter two, the whole descent
+         * can be inlined. Stateful finders (like index_finder) are used up by the call, so pass a fresh one each time.
+         */
+        struct IndexFinder {
+            int index;
+            int from_left_or_right;
+
+            int operator()(const TreePtr& current_node) {
+                assert(current_node != nullptr);
+                const int left_size = TreeOps::get_size(current_node->get_child(from_left_or_right));
+                if (index < left_size) {
+                    return from_left_or_right;
+                }
+                else if (index == left_size) {
+                    return 0;
+                }
+                else { // index > left_size
+                    index -= (left_size + 1);
+                    return -from_left_or_right;
+                }
+            }
+        };
+
+        struct FurthestInserter {
+            int left_or_right;
+
+            int operator()(const TreePtr& current_node) const {
+                assert(current_node != nullptr);
+                return left_or_right;
+            }
+        };
+
+        struct FurthestFinder {
+            int left_or_right;
+
+            int operator()(const TreePtr& current_node) const {
+                assert(current_node != nullptr);
+                if (current_node->get_child(left_or_right) == nullptr) {
+                    return 0;
+                } else {
+                    return left_or_right;
+                }
+            }
+        };
+
+        // cmp(to_find, content) returns <0, 0 or >0, like strcmp().
+        template<typename Compare>
+        struct CmpFinder {
+            NodeContent to_find;
+            Compare cmp;
+
+            int operator()(const TreePtr& current_node) const {
+                assert(current_node != nullptr);
+                const int c = cmp(to_find, current_node->get_content());
+                return (c < 0) ? -1 : (c > 0) ? 1 : 0;
+            }
+        };
+
         /*
          * Returns the node of the tree found by finder_func,
          * or nullptr if finder_func ended at an empty spot.
          */
+        template<typename Finder>
         static TreePtr find(
             const TreePtr& self,
-            FinderFunc&& finder_func,
+            Finder&& finder_func,
             int* num_to_left = nullptr // Make sure to initialize num_to_left to 0 before passing.
         );
 
-        static FinderFunc index_finder(int index, int from_left_or_right = -1);
-        static FinderFunc furthest_inserter(int left_or_right);
-        static FinderFunc furthest_finder(int left_or_right);
+        /*
+         * Like find(), but returns a raw pointer to the node, so no handle is copied and no refcount touched.
+         * The node is only kept alive by whatever keeps self alive (e.g. an EpochGuard, see epoch_reclamation.h).
+         */
+        template<typename Finder>
+        static DerivedTree* find_node(
+            const TreePtr& self,
+            Finder&& finder_func,
+            int* num_to_left = nullptr // Make sure to initialize num_to_left to 0 before passing.
+        );
+
+        static IndexFinder index_finder(int index, int from_left_or_right = -1);
+        static FurthestInserter furthest_inserter(int left_or_right);
+        static FurthestFinder furthest_finder(int left_or_right);
+
+        template<typename Compare>
+        static CmpFinder<Compare> cmp_finder(const NodeContent& to_find, Compare cmp);
+        static CmpFinder<ThreeWayLess> cmp_finder(const NodeContent& to_find);
+
+        /*
+         * Key queries on a tree sorted by cmp. cmp(key, content) returns <0, 0 or >0, as for cmp_finder(),
+         * and key may be of any type cmp accepts. Equal nodes are allowed. Each is one O(log n) descent.
+         */
+
+        // The first node not less than key, or nullptr if there is none.
+        template<typename Key, typename Compare = ThreeWayLess>
+        static TreePtr lower_bound(
+            const TreePtr& self,
+            const Key& key,
+            int* index = nullptr, // If non-null, will be set to the index of that node (or the size of the tree).
+            Compare cmp = Compare()
+        );
+
+        // The first node greater than key, or nullptr if there is none.
+        template<typename Key, typename Compare = ThreeWayLess>
+        static TreePtr upper_bound(
+            const TreePtr& self,
+            const Key& key,
+            int* index = nullptr, // If non-null, will be set to the index of that node (or the size of the tree).
+            Compare cmp = Compare()
+        );
+
+        // The indexes [first, second) of the nodes equal to key.
+        template<typename Key, typename Compare = ThreeWayLess>
+        static std::pair<int, int> equal_range(const TreePtr& self, const Key& key, Compare cmp = Compare());
+
+        // The number of nodes not less than lo and less than hi.
+        template<typename Key, typename Compare = ThreeWayLess>
+        static int count_range(const TreePtr& self, const Key& lo, const Key& hi, Compare cmp = Compare());
+
+        // The number of nodes less than key, i.e. the index key would be inserted at.
+        template<typename Key, typename Compare = ThreeWayLess>
+        static int rank_of(const TreePtr& self, const Key& key, Compare cmp = Compare());
+
+        /*
+         * Range folds: the summary (see Augmentation) of a range of nodes, in order. Each is O(log n).
+         */
+
+        // Nodes at indexes [start_index, end_index). Throws if the range is out of bounds.
+        static SummaryT fold_range(const TreePtr& self, int start_index, int end_index);
+
+        // Nodes not less than lo and less than hi, in a tree sorted by cmp (as for lower_bound()).
+        template<typename Key, typename Compare = ThreeWayLess>
+        static SummaryT fold_keys(const TreePtr& self, const Key& lo, const Key& hi, Compare cmp = Compare());
+
+        /*
+         * Lazy range updates: apply tag (see Augmentation) to every node in a range. Each is O(log n), and copies
+         * only O(log n) nodes: whole subtrees in the range just get a new root with a pending tag, which is pushed
+         * down to their children the first time anyone walks into them.
+         */
+
+        // Nodes at indexes [start_index, end_index). Throws if the range is out of bounds.
+        static TreePtr apply_to_range(const TreePtr& self, int start_index, int end_index, const TagT& tag);
 
-        static std::shared_ptr<DerivedTree> null() { return nullptr; }
+        // Nodes not less than lo and less than hi, as for fold_keys(). tag must keep the tree sorted.
+        template<typename Key, typename Compare = ThreeWayLess>
+        static TreePtr apply_to_keys(const TreePtr& self, const Key& lo, const Key& hi, const TagT& tag, Compare cmp = Compare());
+
+        static TreePtr null() { return nullptr; }
 
         TreePtr rotate(int left_or_right);
         TreePtr double_rotate(int left_or_right);
         static TreePtr balance(const TreePtr& self);
 
+        template<typename Finder>
         static TreePtr insert_or_replace(
             const TreePtr& self,
-            FinderFunc&& finder_func,
+            Finder&& finder_func,
             const NodeContent& new_content,
             InsertOrReplaceMode mode = REPLACE_IF_FOUND
         );
 
+        /*
+         * Replaces the content of the node found by finder_func with update_func(old_content), moved into a new node.
+         * The shape doesn't change, so only the path to the node is copied. Throws if item does not exist.
+         */
+        template<typename Finder, typename UpdateFunc>
+        static TreePtr update(const TreePtr& self, Finder&& finder_func, UpdateFunc&& update_func);
+
         /*
          * Throws if item does not exist.
          */
+        template<typename Finder>
         static TreePtr remove(
             const TreePtr& self,
-            FinderFunc&& finder_func,
+            Finder&& finder_func,
             TreePtr* removed_node = nullptr // If non-null, will be set to the node that was found and removed.
         );
 
+        /*
+         * Joins and splits. Each costs O(log n) and shares every subtree off its path with the inputs.
+         */
+
+        // All of left must come before pivot, and pivot before all of right.
+        static TreePtr join(const TreePtr& left, const NodeContent& pivot, const TreePtr& right);
+        static TreePtr join2(const TreePtr& left, const TreePtr& right);
+
+        /*
+         * Splits the tree at the node or empty spot found by finder_func, into the parts before and after it.
+         * put_found_node says where a found node goes:
+         *     -1 into the left part, 1 into the right part, or 0 into neither (see found_node).
+         */
+        template<typename Finder>
+        static std::pair<TreePtr, TreePtr> split(
+            const TreePtr& self,
+            Finder&& finder_func,
+            int put_found_node = 0,
+            TreePtr* found_node = nullptr // If non-null, will be set to the node that was found (or nullptr).
+        );
+
+        /*
+         * Removes the nodes at indexes [start_index, end_index).
+         * Throws if the range is out of bounds.
+         */
+        static TreePtr erase_range(
+            const TreePtr& self,
+            int start_index,
+            int end_index, // Exclusive of end_index.
+            TreePtr* erased_range = nullptr // If non-null, will be set to a tree of the nodes that were removed.
+        );
+
+        // Returns a tree of just the nodes at indexes [start_index, end_index). Throws if the range is out of bounds.
+        static TreePtr extract_range(const TreePtr& self, int start_index, int end_index);
+
+        /*
+         * One update in a batch (see apply_batch()). For a remove, content is only used to find the node.
+         */
+        struct BatchOp {
+            NodeContent content;
+            InsertOrReplaceMode mode; // Ignored for a remove.
+            bool remove;
+        };
+
+        static BatchOp insert_or_replace_op(const NodeContent& content, InsertOrReplaceMode mode = REPLACE_IF_FOUND) {
+            return BatchOp{content, mode, false};
+        }
+
+        static BatchOp remove_op(const NodeContent& content) {
+            return BatchOp{content, REPLACE_IF_FOUND, true};
+        }
+
+        /*
+         * Applies a batch of updates in one pass over a tree sorted by cmp (a three-way comparator, as for cmp_finder()).
+         * Each op behaves like insert_or_replace() or remove() with cmp_finder(op.content, cmp).
+         * ops must be sorted by cmp, with at most one op per key; throws otherwise.
+         * Subtrees that no op touches are shared as-is, so each node on the way to any op is copied only once.
+         */
+        template<typename Compare = ThreeWayLess>
+        static TreePtr apply_batch(const TreePtr& self, const std::vector<BatchOp>& ops, Compare cmp = Compare());
+
+        /*
+         * find(), insert_or_replace() and remove() keep the path from the root in a fixed-size array on the stack.
+         * An AVL tree of n nodes is at most ~1.44 * log2(n) levels tall, so 64 covers any balanced tree whose
+         * size fits in an int. They throw if given a (hand-built, unbalanced) tree that is taller than that.
+         */
+        static constexpr int MAX_PATH_LENGTH = 64;
+
+    protected:
+        ~AvlTree() {} // Not virtual: nodes are only ever destroyed as DerivedTree.
+
     private:
+        // One step of a path: the node we passed through, and which of its children we went to.
+        struct PathStep {
+            const TreePtr* node;
+            int direction;
+        };
+
+        // The handle find() stops at: the found node's, or the empty one finder_func ended at.
+        template<typename Finder>
+        static const TreePtr* find_handle(const TreePtr& self, Finder&& finder_func, int* num_to_left);
+
+        template<typename Compare>
+        static TreePtr apply_batch(const TreePtr& self, const BatchOp* ops, int num_ops, Compare& cmp);
+
+        // Folds of one side of a subtree: its first count nodes, or its nodes from index on.
+        static SummaryT fold_first(const TreePtr& self, int count);
+        static SummaryT fold_from(const TreePtr& self, int index);
+
+        // Folds of one side of a subtree: its nodes less than hi, or its nodes not less than lo.
+        template<typename Key, typename Compare>
+        static SummaryT fold_less(const TreePtr& self, const Key& hi, Compare& cmp);
+        template<typename Key, typename Compare>
+        static SummaryT fold_not_less(const TreePtr& self, const Key& lo, Compare& cmp);
+
+        // apply_to_keys() of a subtree, where all_not_less / all_less say whether we already know it is all >= lo / < hi.
+        template<typename Key, typename Compare>
+        static TreePtr apply_to_keys_below(
+            const TreePtr& self,
+            const Key& lo,
+            const Key& hi,
+            const TagT& tag,
+            bool all_not_less,
+            bool all_less,
+            Compare& cmp
+        );
+
+        // lower_bound() if !or_equal, upper_bound() if or_equal. Adds the number of nodes before it to *num_before, if non-null.
+        template<typename Key, typename Compare>
+        static TreePtr bound(const TreePtr& self, const Key& key, bool or_equal, int* num_before, Compare& cmp);
+
+        // Rebuilds the path bottom-up, with new_subtree in place of the child the last step went to.
+        static TreePtr rebuild_path(
+            const PathStep* path,
+            int path_length,
+            TreePtr new_subtree,
+            int replaced_content_index = -1, // If set, the node at this index of the path gets replaced_content.
+            const NodeContent* replaced_content = nullptr
+        );
+
         struct DrawDimensions {
             int width                  = 0;
             int height                 = 0;
@@ -140,11 +455,54 @@ class AvlTree {
         );
 
     private:
-        const NodeContent content;
-        const TreePtr left;
-        const TreePtr right;
-        const int size;
-        const int height;
+        // Only a TransientTree may change a node, and only one that nobody else can see yet.
+        template<typename TreeType>
+        friend class TransientTree;
+
+        TreePtr& get_mutable_child(int left_or_right) {
+            assert(left_or_right != 0);
+            push_tag();
+            if (left_or_right < 0) { return left; }
+            else                   { return right; }
+        }
+
+        // Recomputes everything kept about this subtree from the children (size, height, summary).
+        void update_augmentation() {
+            push_tag();
+            if (keeps_size) {
+                this->set_size(TreeOps::get_size(left) + 1 + TreeOps::get_size(right));
+            }
+            height = combined_height(left, right);
+            this->update_summary(content, left, right);
+        }
+
+        // If this node has a pending tag, replaces its children with tagged copies (once; see TagField).
+        void push_tag() { push_tag(std::integral_constant<bool, is_lazy>()); }
+        void push_tag(std::false_type) {}
+        void push_tag(std::true_type);
+
+        // A copy of the root of tree, with tag applied to it and pending for its children (composed with any pending tag).
+        static TreePtr apply_tag(const TreePtr& tree, const TagT& tag);
+
+        // 1 if the right subtree is the bigger one, else -1. By size, or by height if sizes aren't kept.
+        static int bigger_side(const TreePtr& node) {
+            if (keeps_size) {
+                return (TreeOps::get_size(node->get_right()) > TreeOps::get_size(node->get_left())) ? 1 : -1;
+            }
+            return (TreeOps::get_height(node->get_right()) > TreeOps::get_height(node->get_left())) ? 1 : -1;
+        }
+
+        // Saturates at 255, which is still far taller than anything find() etc. will walk (MAX_PATH_LENGTH).
+        static unsigned char combined_height(const TreePtr& left, const TreePtr& right) {
+            return (unsigned char)std::min(255, 1 + std::max(TreeOps::get_height(left), TreeOps::get_height(right)));
+        }
+
+    private:
+        unsigned char height; // Packed into a byte (see combined_height()), ahead of content so it can share its padding.
+        unsigned char edit_token; // Nonzero only while a TransientTree owns this node (see TransientTree). Also shares the padding.
+        NodeContent content;
+        TreePtr left;
+        TreePtr right;
 };
 
 
@@ -153,22 +511,37 @@ class AvlTree {
 
 namespace TreeOps {
 
-    template<typename TreeType>
-    std::shared_ptr<TreeType> make_tree(
-        const typename TreeType::NodeContentT& content,
-        std::shared_ptr<TreeType> child1,
-        std::shared_ptr<TreeType> child2,
+    namespace detail {
+        // The tree type make_tree() should build: either given explicitly, or taken from whichever child is not nullptr.
+        template<typename TreeType, typename Child1, typename Child2>
+        struct MakeTreeType { typedef TreeType type; };
+
+        template<typename Child1, typename Child2>
+        struct MakeTreeType<void, Child1, Child2> { typedef typename Child1::element_type type; };
+
+        template<typename Child2>
+        struct MakeTreeType<void, std::nullptr_t, Child2> { typedef typename Child2::element_type type; };
+    }
+
+    template<typename TreeType = void, typename Child1, typename Child2>
+    typename detail::MakeTreeType<TreeType, Child1, Child2>::type::TreePtr make_tree(
+        const typename detail::MakeTreeType<TreeType, Child1, Child2>::type::NodeContentT& content,
+        const Child1& child1,
+        const Child2& child2,
         int child2_left_or_right = 1
     ) {
+        typedef typename detail::MakeTreeType<TreeType, Child1, Child2>::type Tree;
+        typedef typename Tree::HandlePolicyT Handles;
+
         assert(child2_left_or_right != 0);
         if (child2_left_or_right < 0) {
-            return std::make_shared<TreeType>(
+            return Handles::template make<Tree>(
                 content,
                 child2,
                 child1
             );
         } else {
-            return std::make_shared<TreeType>(
+            return Handles::template make<Tree>(
                 content,
                 child1,
                 child2
@@ -176,49 +549,126 @@ namespace TreeOps {
         }
     }
 
-    template<typename TreeType>
-    std::string draw_as_text(const std::shared_ptr<TreeType>& tree) {
+    // The functions below take any TreePtr type (std::shared_ptr, IntrusivePtr, ...), see node_handles.h.
+
+    template<typename TreePtr>
+    std::string draw_as_text(const TreePtr& tree) {
         if (tree == nullptr) {
             return "NULL TREE";
         }
         return tree->get_derived()->draw_as_text();
     }
 
-    template<typename TreeType>
-    std::string get_label(const std::shared_ptr<TreeType>& tree) {
+    template<typename TreePtr>
+    std::string get_label(const TreePtr& tree) {
         if (tree == nullptr) {
             return "NULL TREE";
         }
         return tree->get_derived()->get_label();
     }
 
-    template<typename TreeType>
-    int get_size(const std::shared_ptr<TreeType>& tree) {
+    template<typename TreePtr>
+    int get_size(const TreePtr& tree) {
         if (tree == nullptr) {
             return 0;
         }
-        return tree->get_derived()->get_size();
+        return tree->get_size();
     }
 
-    template<typename TreeType>
-    int get_height(const std::shared_ptr<TreeType>& tree) {
+    template<typename TreePtr>
+    int get_height(const TreePtr& tree) {
         if (tree == nullptr) {
             return 0;
         }
-        return tree->get_derived()->get_height();
+        return tree->get_height();
     }
 
-    template<typename TreeType>
-    std::shared_ptr<TreeType> find(
-        const std::shared_ptr<TreeType>& self,
-        typename TreeType::FinderFunc&& finder_func,
+    template<typename TreePtr, typename Finder>
+    TreePtr find(
+        const TreePtr& self,
+        Finder&& finder_func,
         int* num_to_left = nullptr // Make sure to initialize num_to_left to 0 before passing.
     ) {
-        return TreeType::find(self, std::move(finder_func), num_to_left);
+        return TreePtr::element_type::find(self, std::forward<Finder>(finder_func), num_to_left);
+    }
+
+    template<typename TreePtr, typename Finder>
+    typename TreePtr::element_type* find_node(
+        const TreePtr& self,
+        Finder&& finder_func,
+        int* num_to_left = nullptr // Make sure to initialize num_to_left to 0 before passing.
+    ) {
+        return TreePtr::element_type::find_node(self, std::forward<Finder>(finder_func), num_to_left);
+    }
+
+    template<typename TreePtr, typename Key, typename Compare = ThreeWayLess>
+    TreePtr lower_bound(
+        const TreePtr& self,
+        const Key& key,
+        int* index = nullptr, // If non-null, will be set to the index of that node (or the size of the tree).
+        Compare cmp = Compare()
+    ) {
+        return TreePtr::element_type::lower_bound(self, key, index, cmp);
+    }
+
+    template<typename TreePtr, typename Key, typename Compare = ThreeWayLess>
+    TreePtr upper_bound(
+        const TreePtr& self,
+        const Key& key,
+        int* index = nullptr, // If non-null, will be set to the index of that node (or the size of the tree).
+        Compare cmp = Compare()
+    ) {
+        return TreePtr::element_type::upper_bound(self, key, index, cmp);
+    }
+
+    template<typename TreePtr, typename Key, typename Compare = ThreeWayLess>
+    std::pair<int, int> equal_range(const TreePtr& self, const Key& key, Compare cmp = Compare()) {
+        return TreePtr::element_type::equal_range(self, key, cmp);
+    }
+
+    template<typename TreePtr, typename Key, typename Compare = ThreeWayLess>
+    int count_range(const TreePtr& self, const Key& lo, const Key& hi, Compare cmp = Compare()) {
+        return TreePtr::element_type::count_range(self, lo, hi, cmp);
+    }
+
+    template<typename TreePtr, typename Key, typename Compare = ThreeWayLess>
+    int rank_of(const TreePtr& self, const Key& key, Compare cmp = Compare()) {
+        return TreePtr::element_type::rank_of(self, key, cmp);
+    }
+
+    // The summary of every node in tree (see node_augmentations.h).
+    template<typename TreePtr>
+    typename TreePtr::element_type::SummaryT get_summary(const TreePtr& tree) {
+        if (tree == nullptr) {
+            return TreePtr::element_type::AugmentationT::identity();
+        }
+        return tree->get_summary();
+    }
+
+    // Throws if the range is out of bounds.
+    template<typename TreePtr>
+    typename TreePtr::element_type::SummaryT fold_range(const TreePtr& self, int start_index, int end_index) {
+        return TreePtr::element_type::fold_range(self, start_index, end_index);
+    }
+
+    template<typename TreePtr, typename Key, typename Compare = ThreeWayLess>
+    typename TreePtr::element_type::SummaryT fold_keys(const TreePtr& self, const Key& lo, const Key& hi, Compare cmp = Compare()) {
+        return TreePtr::element_type::fold_keys(self, lo, hi, cmp);
+    }
+
+    // Throws if the range is out of bounds.
+    template<typename TreePtr>
+    TreePtr apply_to_range(const TreePtr& self, int start_index, int end_index, const typename TreePtr::element_type::TagT& tag) {
+        return TreePtr::element_type::apply_to_range(self, start_index, end_index, tag);
+    }
+
+    template<typename TreePtr, typename Key, typename Compare = ThreeWayLess>
+    TreePtr apply_to_keys(const TreePtr& self, const Key& lo, const Key& hi, const typename TreePtr::element_type::TagT& tag, Compare cmp = Compare()) {
+        return TreePtr::element_type::apply_to_keys(self, lo, hi, tag, cmp);
     }
 
-    template<typename TreeType>
-    int get_balance_factor(const std::shared_ptr<TreeType>& tree) {
+    template<typename TreePtr>
+    int get_balance_factor(const TreePtr& tree) {
         if (tree == nullptr) {
             return 0;
         }
@@ -227,13 +677,13 @@ namespace TreeOps {
         return rh - lh;
     }
 
-    template<typename TreeType>
-    bool is_balanced(const std::shared_ptr<TreeType>& tree) {
+    template<typename TreePtr>
+    bool is_balanced(const TreePtr& tree) {
         return abs(TreeOps::get_balance_factor(tree)) <= 1;
     }
 
-    template<typename TreeType>
-    bool is_balanced_recursively(const std::shared_ptr<TreeType>& tree) {
+    template<typename TreePtr>
+    bool is_balanced_recursively(const TreePtr& tree) {
         if (tree == nullptr) {
             return true;
         }
@@ -242,24 +692,81 @@ namespace TreeOps {
             && TreeOps::is_balanced_recursively(tree->get_right());
     }
 
-    template<typename TreeType>
-    std::shared_ptr<TreeType> insert_or_replace(
-        const std::shared_ptr<TreeType>& self,
-        typename TreeType::FinderFunc&& finder_func,
-        const typename TreeType::NodeContentT& new_content,
+    template<typename TreePtr, typename Finder>
+    TreePtr insert_or_replace(
+        const TreePtr& self,
+        Finder&& finder_func,
+        const typename TreePtr::element_type::NodeContentT& new_content,
         InsertOrReplaceMode mode = REPLACE_IF_FOUND
     ) {
-        return TreeType::insert_or_replace(self, std::move(finder_func), new_content, mode);
+        return TreePtr::element_type::insert_or_replace(self, std::forward<Finder>(finder_func), new_content, mode);
     }
 
     // Throws if item does not exist.
-    template<typename TreeType>
-    std::shared_ptr<TreeType> remove(
-        const std::shared_ptr<TreeType>& self,
-        typename TreeType::FinderFunc&& finder_func,
-        std::shared_ptr<TreeType>* removed_node = nullptr // If non-null, will be set to the node that was found and removed.
+    template<typename TreePtr, typename Finder>
+    TreePtr remove(
+        const TreePtr& self,
+        Finder&& finder_func,
+        TreePtr* removed_node = nullptr // If non-null, will be set to the node that was found and removed.
+    ) {
+        return TreePtr::element_type::remove(self, std::forward<Finder>(finder_func), removed_node);
+    }
+
+    // Throws if item does not exist.
+    template<typename TreePtr, typename Finder, typename UpdateFunc>
+    TreePtr update(const TreePtr& self, Finder&& finder_func, UpdateFunc&& update_func) {
+        return TreePtr::element_type::update(self, std::forward<Finder>(finder_func), std::forward<UpdateFunc>(update_func));
+    }
+
+    // ops must be sorted, with at most one op per key. Throws like insert_or_replace() and remove().
+    template<typename TreePtr, typename Compare = ThreeWayLess>
+    TreePtr apply_batch(
+        const TreePtr& self,
+        const std::vector<typename TreePtr::element_type::BatchOp>& ops,
+        Compare cmp = Compare()
+    ) {
+        return TreePtr::element_type::apply_batch(self, ops, cmp);
+    }
+
+    template<typename TreePtr>
+    TreePtr join(
+        const TreePtr& left,
+        const typename TreePtr::element_type::NodeContentT& pivot,
+        const TreePtr& right
+    ) {
+        return TreePtr::element_type::join(left, pivot, right);
+    }
+
+    template<typename TreePtr>
+    TreePtr join2(const TreePtr& left, const TreePtr& right) {
+        return TreePtr::element_type::join2(left, right);
+    }
+
+    template<typename TreePtr, typename Finder>
+    std::pair<TreePtr, TreePtr> split(
+        const TreePtr& self,
+        Finder&& finder_func,
+        int put_found_node = 0,
+        TreePtr* found_node = nullptr // If non-null, will be set to the node that was found (or nullptr).
     ) {
-        return TreeType::remove(self, std::move(finder_func), removed_node);
+        return TreePtr::element_type::split(self, std::forward<Finder>(finder_func), put_found_node, found_node);
+    }
+
+    // Throws if the range is out of bounds.
+    template<typename TreePtr>
+    TreePtr erase_range(
+        const TreePtr& self,
+        int start_index,
+        int end_index, // Exclusive of end_index.
+        TreePtr* erased_range = nullptr // If non-null, will be set to a tree of the nodes that were removed.
+    ) {
+        return TreePtr::element_type::erase_range(self, start_index, end_index, erased_range);
+    }
+
+    // Throws if the range is out of bounds.
+    template<typename TreePtr>
+    TreePtr extract_range(const TreePtr& self, int start_index, int end_index) {
+        return TreePtr::element_type::extract_range(self, start_index, end_index);
     }
 
 }
@@ -268,24 +775,40 @@ namespace TreeOps {
 // Class method implementations defined here:
 // --------------------------------------------------
 
-#define AvlTreeX AvlTree<NodeContent, DerivedTree>
+#define AvlTreeX AvlTree<NodeContent, DerivedTree, HandlePolicy, Augmentation>
 
 // (constructor)
-template<typename NodeContent, typename DerivedTree>
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
 AvlTreeX::AvlTree(
     const NodeContent& content,
     const TreePtr& left,
     const TreePtr& right
 ):
+    edit_token(0),
     content(content),
     left(left),
-    right(right),
-    size(TreeOps::get_size(left) + 1 + TreeOps::get_size(right)),
-    height(1 + std::max(TreeOps::get_height(left), TreeOps::get_height(right)))
-{}
+    right(right)
+{
+    update_augmentation();
+}
+
+// (constructor)
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
+AvlTreeX::AvlTree(
+    NodeContent&& content,
+    const TreePtr& left,
+    const TreePtr& right
+):
+    edit_token(0),
+    content(std::move(content)),
+    left(left),
+    right(right)
+{
+    update_augmentation();
+}
 
 // (static method)
-template<typename NodeContent, typename DerivedTree>
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
 typename AvlTreeX::DrawDimensions
 AvlTreeX::get_draw_dimensions(DerivedTree* self, DrawMemo* memo) {
     constexpr int MIN_SPACE_BETWEEN_SUBTREES = 2; // Should be greater than zero.
@@ -346,7 +869,7 @@ AvlTreeX::get_draw_dimensions(DerivedTree* self, DrawMemo* memo) {
 }
 
 // (static method)
-template<typename NodeContent, typename DerivedTree>
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
 void AvlTreeX::draw_to_text(
     DerivedTree* self,
     std::vector<std::string>* text,
@@ -430,7 +953,7 @@ void AvlTreeX::draw_to_text(
 }
 
 // (instance method)
-template<typename NodeContent, typename DerivedTree>
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
 std::string AvlTreeX::draw_as_text() {
 
     DerivedTree* derived_this = this->get_derived();
@@ -465,7 +988,7 @@ std::string AvlTreeX::draw_as_text() {
 }
 
 // (static method)
-template<typename NodeContent, typename DerivedTree>
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
 typename AvlTreeX::TreePtr
 AvlTreeX::construct_from_vector(
     const std::vector<NodeContent>& vec,
@@ -479,7 +1002,7 @@ AvlTreeX::construct_from_vector(
         return nullptr;
     }
     const int mid_index = (start_index + end_index) / 2;
-    return std::make_shared<DerivedTree>(
+    return HandlePolicy::template make<DerivedTree>(
         vec[mid_index],
         construct_from_vector(vec, start_index, mid_index),
         construct_from_vector(vec, mid_index + 1, end_index)
@@ -487,83 +1010,466 @@ AvlTreeX::construct_from_vector(
 }
 
 // (static method)
-template<typename NodeContent, typename DerivedTree>
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
+template<typename Finder>
 typename AvlTreeX::TreePtr
 AvlTreeX::find(
     const TreePtr& self,
-    FinderFunc&& finder_func,
+    Finder&& finder_func,
     int* num_to_left /* = nullptr */ // Make sure to initialize num_to_left to 0 before passing.
 ) {
-    if (self == nullptr) {
-        return nullptr;
-    }
-    const int direction = finder_func(self);
-    if (direction < 0) {
-        return find(self->get_left(), std::move(finder_func), num_to_left);
-    }
-    else if (direction == 0) {
-        if (num_to_left) {
-            *num_to_left += TreeOps::get_size(self->get_left());
+    return *find_handle(self, std::forward<Finder>(finder_func), num_to_left);
+}
+
+// (static method)
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
+template<typename Finder>
+DerivedTree*
+AvlTreeX::find_node(
+    const TreePtr& self,
+    Finder&& finder_func,
+    int* num_to_left /* = nullptr */ // Make sure to initialize num_to_left to 0 before passing.
+) {
+    return find_handle(self, std::forward<Finder>(finder_func), num_to_left)->get();
+}
+
+// (static method)
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
+template<typename Finder>
+const typename AvlTreeX::TreePtr*
+AvlTreeX::find_handle(
+    const TreePtr& self,
+    Finder&& finder_func,
+    int* num_to_left
+) {
+    const TreePtr* current = &self;
+    while (*current != nullptr) {
+        const int direction = finder_func(*current);
+        if (direction == 0) {
+            if (num_to_left) {
+                *num_to_left += TreeOps::get_size((*current)->get_left());
+            }
+            return current;
         }
-        return self;
-    }
-    else { // direction > 0
-        if (num_to_left) {
-            *num_to_left += TreeOps::get_size(self->get_left()) + 1;
+        if (direction > 0 && num_to_left) {
+            *num_to_left += TreeOps::get_size((*current)->get_left()) + 1;
         }
-        return find(self->get_right(), std::move(finder_func), num_to_left);
+        current = &(*current)->get_child(direction);
     }
+    return current; // The empty spot finder_func ended at.
 }
 
 // (static method)
-template<typename NodeContent, typename DerivedTree>
-typename AvlTreeX::FinderFunc
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
+typename AvlTreeX::IndexFinder
 AvlTreeX::index_finder(int index, int from_left_or_right /* = -1 */) {
     assert(from_left_or_right != 0);
-    return [index, from_left_or_right](const TreePtr& current_node) mutable {
-        assert(current_node != nullptr);
-        const int left_size = TreeOps::get_size(current_node->get_child(from_left_or_right));
-        if (index < left_size) {
-            return from_left_or_right;
-        }
-        else if (index == left_size) {
-            return 0;
-        }
-        else { // index > left_size
-            index -= (left_size + 1);
-            return -from_left_or_right;
-        }
-    };
+    return IndexFinder{index, from_left_or_right};
 }
 
 // (static method)
-template<typename NodeContent, typename DerivedTree>
-typename AvlTreeX::FinderFunc
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
+typename AvlTreeX::FurthestInserter
 AvlTreeX::furthest_inserter(int left_or_right) {
     assert(left_or_right != 0);
-    return [left_or_right](const TreePtr& current_node) {
-        assert(current_node != nullptr);
-        return left_or_right;
-    };
+    return FurthestInserter{left_or_right};
 }
 
 // (static method)
-template<typename NodeContent, typename DerivedTree>
-typename AvlTreeX::FinderFunc
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
+typename AvlTreeX::FurthestFinder
 AvlTreeX::furthest_finder(int left_or_right) {
     assert(left_or_right != 0);
-    return [left_or_right](const TreePtr& current_node) {
-        assert(current_node != nullptr);
-        if (current_node->get_child(left_or_right) == nullptr) {
-            return 0;
+    return FurthestFinder{left_or_right};
+}
+
+// (static method)
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
+template<typename Compare>
+typename AvlTreeX::template CmpFinder<Compare>
+AvlTreeX::cmp_finder(const NodeContent& to_find, Compare cmp) {
+    return CmpFinder<Compare>{to_find, cmp};
+}
+
+// (static method)
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
+typename AvlTreeX::template CmpFinder<ThreeWayLess>
+AvlTreeX::cmp_finder(const NodeContent& to_find) {
+    return CmpFinder<ThreeWayLess>{to_find, ThreeWayLess()};
+}
+
+// (static method)
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
+template<typename Key, typename Compare>
+typename AvlTreeX::TreePtr
+AvlTreeX::bound(const TreePtr& self, const Key& key, bool or_equal, int* num_before, Compare& cmp) {
+    const TreePtr* found = nullptr;
+    const TreePtr* current = &self;
+    while (*current != nullptr) {
+        const int c = cmp(key, (*current)->get_content());
+        if (c < 0 || (c == 0 && !or_equal)) {
+            // This node is a candidate; anything better is to its left.
+            found = current;
+            current = &(*current)->get_left();
         } else {
-            return left_or_right;
+            if (num_before) {
+                *num_before += TreeOps::get_size((*current)->get_left()) + 1;
+            }
+            current = &(*current)->get_right();
         }
-    };
+    }
+    return (found != nullptr) ? *found : nullptr;
+}
+
+// (static method)
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
+template<typename Key, typename Compare>
+typename AvlTreeX::TreePtr
+AvlTreeX::lower_bound(
+    const TreePtr& self,
+    const Key& key,
+    int* index /* = nullptr */, // If non-null, will be set to the index of that node (or the size of the tree).
+    Compare cmp /* = Compare() */
+) {
+    if (index) {
+        *index = 0;
+    }
+    return bound(self, key, false, index, cmp);
+}
+
+// (static method)
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
+template<typename Key, typename Compare>
+typename AvlTreeX::TreePtr
+AvlTreeX::upper_bound(
+    const TreePtr& self,
+    const Key& key,
+    int* index /* = nullptr */, // If non-null, will be set to the index of that node (or the size of the tree).
+    Compare cmp /* = Compare() */
+) {
+    if (index) {
+        *index = 0;
+    }
+    return bound(self, key, true, index, cmp);
+}
+
+// (static method)
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
+template<typename Key, typename Compare>
+std::pair<int, int>
+AvlTreeX::equal_range(const TreePtr& self, const Key& key, Compare cmp /* = Compare() */) {
+    // Go down to the first node equal to key, then finish the lower bound on its left and the upper bound on its right.
+    int num_to_left = 0;
+    const TreePtr* current = &self;
+    while (*current != nullptr) {
+        const int c = cmp(key, (*current)->get_content());
+        if (c == 0) {
+            break;
+        }
+        if (c > 0) {
+            num_to_left += TreeOps::get_size((*current)->get_left()) + 1;
+        }
+        current = &(*current)->get_child(c);
+    }
+    if (*current == nullptr) {
+        return std::make_pair(num_to_left, num_to_left);
+    }
+    int left_num_before = 0;
+    int right_num_before = 0;
+    bound((*current)->get_left(), key, false, &left_num_before, cmp);
+    bound((*current)->get_right(), key, true, &right_num_before, cmp);
+    return std::make_pair(
+        num_to_left + left_num_before,
+        num_to_left + TreeOps::get_size((*current)->get_left()) + 1 + right_num_before
+    );
+}
+
+// (static method)
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
+template<typename Key, typename Compare>
+int AvlTreeX::count_range(const TreePtr& self, const Key& lo, const Key& hi, Compare cmp /* = Compare() */) {
+    // Go down while the whole range is on one side, then count the two halves below the node where it splits.
+    const TreePtr* current = &self;
+    while (*current != nullptr) {
+        if (cmp(hi, (*current)->get_content()) <= 0) {
+            current = &(*current)->get_left();
+        } else if (cmp(lo, (*current)->get_content()) > 0) {
+            current = &(*current)->get_right();
+        } else {
+            break;
+        }
+    }
+    if (*current == nullptr) {
+        return 0;
+    }
+    int left_num_before = 0;
+    int right_num_before = 0;
+    bound((*current)->get_left(), lo, false, &left_num_before, cmp);
+    bound((*current)->get_right(), hi, false, &right_num_before, cmp);
+    return (TreeOps::get_size((*current)->get_left()) - left_num_before) + 1 + right_num_before;
+}
+
+// (static method)
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
+template<typename Key, typename Compare>
+int AvlTreeX::rank_of(const TreePtr& self, const Key& key, Compare cmp /* = Compare() */) {
+    int num_before = 0;
+    bound(self, key, false, &num_before, cmp);
+    return num_before;
+}
+
+// (static method)
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
+typename AvlTreeX::SummaryT
+AvlTreeX::fold_first(const TreePtr& self, int count) {
+    SummaryT ret = Augmentation::identity();
+    const TreePtr* current = &self;
+    while (*current != nullptr && count > 0) {
+        const int left_size = TreeOps::get_size((*current)->get_left());
+        if (count <= left_size) {
+            current = &(*current)->get_left();
+        } else {
+            ret = Augmentation::combine(
+                ret,
+                Augmentation::combine(TreeOps::get_summary((*current)->get_left()), Augmentation::of((*current)->get_content()))
+            );
+            count -= left_size + 1;
+            current = &(*current)->get_right();
+        }
+    }
+    return ret;
+}
+
+// (static method)
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
+typename AvlTreeX::SummaryT
+AvlTreeX::fold_from(const TreePtr& self, int index) {
+    SummaryT ret = Augmentation::identity();
+    const TreePtr* current = &self;
+    while (*current != nullptr) {
+        const int left_size = TreeOps::get_size((*current)->get_left());
+        if (index <= left_size) {
+            ret = Augmentation::combine(
+                Augmentation::combine(Augmentation::of((*current)->get_content()), TreeOps::get_summary((*current)->get_right())),
+                ret
+            );
+            current = &(*current)->get_left();
+        } else {
+            index -= left_size + 1;
+            current = &(*current)->get_right();
+        }
+    }
+    return ret;
+}
+
+// (static method)
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
+typename AvlTreeX::SummaryT
+AvlTreeX::fold_range(const TreePtr& self, int start_index, int end_index) {
+    if (start_index < 0 || end_index < start_index || TreeOps::get_size(self) < end_index) {
+        throw std::runtime_error("fold_range(): Range out of bounds.");
+    }
+    // Go down while the whole range is on one side, then fold the two halves below the node where it splits.
+    const TreePtr* current = &self;
+    while (*current != nullptr) {
+        const int left_size = TreeOps::get_size((*current)->get_left());
+        if (end_index <= left_size) {
+            current = &(*current)->get_left();
+        } else if (start_index > left_size) {
+            start_index -= left_size + 1;
+            end_index -= left_size + 1;
+            current = &(*current)->get_right();
+        } else {
+            return Augmentation::combine(
+                Augmentation::combine(fold_from((*current)->get_left(), start_index), Augmentation::of((*current)->get_content())),
+                fold_first((*current)->get_right(), end_index - left_size - 1)
+            );
+        }
+    }
+    return Augmentation::identity();
+}
+
+// (static method)
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
+template<typename Key, typename Compare>
+typename AvlTreeX::SummaryT
+AvlTreeX::fold_less(const TreePtr& self, const Key& hi, Compare& cmp) {
+    SummaryT ret = Augmentation::identity();
+    const TreePtr* current = &self;
+    while (*current != nullptr) {
+        if (cmp(hi, (*current)->get_content()) <= 0) {
+            current = &(*current)->get_left();
+        } else {
+            ret = Augmentation::combine(
+                ret,
+                Augmentation::combine(TreeOps::get_summary((*current)->get_left()), Augmentation::of((*current)->get_content()))
+            );
+            current = &(*current)->get_right();
+        }
+    }
+    return ret;
+}
+
+// (static method)
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
+template<typename Key, typename Compare>
+typename AvlTreeX::SummaryT
+AvlTreeX::fold_not_less(const TreePtr& self, const Key& lo, Compare& cmp) {
+    SummaryT ret = Augmentation::identity();
+    const TreePtr* current = &self;
+    while (*current != nullptr) {
+        if (cmp(lo, (*current)->get_content()) <= 0) {
+            ret = Augmentation::combine(
+                Augmentation::combine(Augmentation::of((*current)->get_content()), TreeOps::get_summary((*current)->get_right())),
+                ret
+            );
+            current = &(*current)->get_left();
+        } else {
+            current = &(*current)->get_right();
+        }
+    }
+    return ret;
+}
+
+// (static method)
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
+template<typename Key, typename Compare>
+typename AvlTreeX::SummaryT
+AvlTreeX::fold_keys(const TreePtr& self, const Key& lo, const Key& hi, Compare cmp /* = Compare() */) {
+    // Same descent as count_range().
+    const TreePtr* current = &self;
+    while (*current != nullptr) {
+        if (cmp(hi, (*current)->get_content()) <= 0) {
+            current = &(*current)->get_left();
+        } else if (cmp(lo, (*current)->get_content()) > 0) {
+            current = &(*current)->get_right();
+        } else {
+            return Augmentation::combine(
+                Augmentation::combine(fold_not_less((*current)->get_left(), lo, cmp), Augmentation::of((*current)->get_content())),
+                fold_less((*current)->get_right(), hi, cmp)
+            );
+        }
+    }
+    return Augmentation::identity();
 }
 
 // (instance method)
-template<typename NodeContent, typename DerivedTree>
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
+void AvlTreeX::push_tag(std::true_type) {
+    if (!this->lock_tag()) {
+        return;
+    }
+    // Swapping in tagged copies changes nothing anyone can see, so it is fine even if this node is shared.
+    left = apply_tag(left, this->get_tag());
+    right = apply_tag(right, this->get_tag());
+    this->unlock_tag(false);
+}
+
+// (static method)
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
+typename AvlTreeX::TreePtr
+AvlTreeX::apply_tag(const TreePtr& tree, const TagT& tag) {
+    if (tree == nullptr) {
+        return tree;
+    }
+    // Compose with tree's own pending tag rather than pushing it down first, which would cascade all the way down.
+    const bool has_pending_tag = tree->lock_tag();
+    TreePtr new_tree = HandlePolicy::template make<DerivedTree>(
+        Augmentation::apply_to_content(tag, tree->content),
+        tree->left,
+        tree->right
+    );
+    new_tree->set_tag(has_pending_tag ? Augmentation::compose(tree->get_tag(), tag) : tag);
+    if (has_pending_tag) {
+        tree->unlock_tag(true);
+    }
+    new_tree->set_tagged_summary(tag, tree.get());
+    return new_tree;
+}
+
+// (static method)
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
+typename AvlTreeX::TreePtr
+AvlTreeX::apply_to_range(const TreePtr& self, int start_index, int end_index, const TagT& tag) {
+    if (start_index < 0 || end_index < start_index || TreeOps::get_size(self) < end_index) {
+        throw std::runtime_error("apply_to_range(): Range out of bounds.");
+    }
+    if (start_index == end_index) {
+        return self;
+    }
+    if (start_index == 0 && end_index == self->get_size()) {
+        return apply_tag(self, tag);
+    }
+
+    const int left_size = TreeOps::get_size(self->get_left());
+    const TreePtr& left = (start_index < left_size)
+        ? apply_to_range(self->get_left(), start_index, std::min(end_index, left_size), tag)
+        : self->get_left();
+    const TreePtr& right = (end_index > left_size + 1)
+        ? apply_to_range(self->get_right(), std::max(start_index - left_size - 1, 0), end_index - left_size - 1, tag)
+        : self->get_right();
+    return HandlePolicy::template make<DerivedTree>(
+        (start_index <= left_size && left_size < end_index)
+            ? Augmentation::apply_to_content(tag, self->get_content())
+            : self->get_content(),
+        left,
+        right
+    );
+}
+
+// (static method)
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
+template<typename Key, typename Compare>
+typename AvlTreeX::TreePtr
+AvlTreeX::apply_to_keys(const TreePtr& self, const Key& lo, const Key& hi, const TagT& tag, Compare cmp /* = Compare() */) {
+    return apply_to_keys_below(self, lo, hi, tag, false, false, cmp);
+}
+
+// (static method)
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
+template<typename Key, typename Compare>
+typename AvlTreeX::TreePtr
+AvlTreeX::apply_to_keys_below(
+    const TreePtr& self,
+    const Key& lo,
+    const Key& hi,
+    const TagT& tag,
+    bool all_not_less,
+    bool all_less,
+    Compare& cmp
+) {
+    if (self == nullptr) {
+        return self;
+    }
+    if (all_not_less && all_less) {
+        return apply_tag(self, tag);
+    }
+    const bool not_less = all_not_less || cmp(lo, self->get_content()) <= 0;
+    const bool less = all_less || cmp(hi, self->get_content()) > 0;
+    if (!not_less) {
+        // Everything on the left is less than lo too.
+        return HandlePolicy::template make<DerivedTree>(
+            self->get_content(),
+            self->get_left(),
+            apply_to_keys_below(self->get_right(), lo, hi, tag, all_not_less, all_less, cmp)
+        );
+    }
+    if (!less) {
+        return HandlePolicy::template make<DerivedTree>(
+            self->get_content(),
+            apply_to_keys_below(self->get_left(), lo, hi, tag, all_not_less, all_less, cmp),
+            self->get_right()
+        );
+    }
+    return HandlePolicy::template make<DerivedTree>(
+        Augmentation::apply_to_content(tag, self->get_content()),
+        apply_to_keys_below(self->get_left(), lo, hi, tag, all_not_less, true, cmp),
+        apply_to_keys_below(self->get_right(), lo, hi, tag, true, all_less, cmp)
+    );
+}
+
+// (instance method)
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
 typename AvlTreeX::TreePtr
 AvlTreeX::rotate(int left_or_right) {
     assert(left_or_right != 0);
@@ -586,7 +1492,7 @@ AvlTreeX::rotate(int left_or_right) {
 }
 
 // (instance method)
-template<typename NodeContent, typename DerivedTree>
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
 typename AvlTreeX::TreePtr
 AvlTreeX::double_rotate(int left_or_right) {
     assert(left_or_right != 0);
@@ -606,7 +1512,7 @@ AvlTreeX::double_rotate(int left_or_right) {
 }
 
 // (static method)
-template<typename NodeContent, typename DerivedTree>
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
 typename AvlTreeX::TreePtr
 AvlTreeX::balance(const TreePtr& self) {
     if (self == nullptr) {
@@ -642,11 +1548,31 @@ AvlTreeX::balance(const TreePtr& self) {
 }
 
 // (static method)
-template<typename NodeContent, typename DerivedTree>
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
+typename AvlTreeX::TreePtr
+AvlTreeX::rebuild_path(
+    const PathStep* path,
+    int path_length,
+    TreePtr new_subtree,
+    int replaced_content_index /* = -1 */,
+    const NodeContent* replaced_content /* = nullptr */
+) {
+    for (int i = path_length - 1; i >= 0; i--) {
+        const TreePtr& node = *path[i].node;
+        const int direction = path[i].direction;
+        const NodeContent& content = (i == replaced_content_index) ? *replaced_content : node->get_content();
+        new_subtree = balance(TreeOps::make_tree(content, node->get_child(-direction), new_subtree, direction));
+    }
+    return new_subtree;
+}
+
+// (static method)
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
+template<typename Finder>
 typename AvlTreeX::TreePtr
 AvlTreeX::insert_or_replace(
     const TreePtr& self,
-    FinderFunc&& finder_func,
+    Finder&& finder_func,
     const NodeContent& new_content,
     InsertOrReplaceMode mode /* = REPLACE_IF_FOUND */
 ) {
@@ -657,95 +1583,374 @@ AvlTreeX::insert_or_replace(
         || mode == REPLACE_ONLY
     );
 
-    if (self == nullptr) {
-        // Return new node, unless mode == REPLACE_ONLY.
-        if (mode == REPLACE_ONLY) {
-            throw std::runtime_error("insert_or_replace(): Node not found (and mode is REPLACE_ONLY).");
-        } else {
-            return std::make_shared<DerivedTree>(new_content, nullptr, nullptr);
+    PathStep path[MAX_PATH_LENGTH];
+    int path_length = 0;
+
+    const TreePtr* current = &self;
+    TreePtr new_subtree;
+
+    // Once we have found a node and are inserting next to it, we keep going this way (like furthest_inserter()).
+    int furthest_direction = 0;
+
+    while (*current != nullptr) {
+        int direction = (furthest_direction != 0) ? furthest_direction : finder_func(*current);
+
+        if (direction == 0) {
+            // Node found.
+            if (mode == THROW_IF_FOUND) {
+                throw std::runtime_error("insert_or_replace(): Node found (and mode is THROW_IF_FOUND).");
+            } else if (mode == INSERT_LEFT_IF_FOUND || mode == INSERT_RIGHT_IF_FOUND) {
+                // Insert right next to the found node, i.e. at the near end of the subtree on that side.
+                direction = (mode == INSERT_LEFT_IF_FOUND) ? -1 : 1;
+                furthest_direction = -direction;
+            } else if (mode == REPLACE_IF_FOUND || mode == REPLACE_ONLY) {
+                new_subtree = HandlePolicy::template make<DerivedTree>(new_content, (*current)->get_left(), (*current)->get_right());
+                return rebuild_path(path, path_length, std::move(new_subtree));
+            } else {
+                assert(false); // Should not get here.
+            }
         }
+
+        if (path_length == MAX_PATH_LENGTH) {
+            throw std::runtime_error("insert_or_replace(): Tree is too tall.");
+        }
+        path[path_length++] = PathStep{current, direction};
+        current = &(*current)->get_child(direction);
     }
 
-    int direction = finder_func(self); // Note: We don't have a shared_ptr to `this`, so this function cannot be an instance method.
+    // Reached an empty spot: new node, unless mode == REPLACE_ONLY.
+    if (mode == REPLACE_ONLY) {
+        throw std::runtime_error("insert_or_replace(): Node not found (and mode is REPLACE_ONLY).");
+    }
+    new_subtree = HandlePolicy::template make<DerivedTree>(new_content, nullptr, nullptr);
+    return rebuild_path(path, path_length, std::move(new_subtree));
+}
 
-    if (direction == 0) {
-        // Node found.
-        if (mode == THROW_IF_FOUND) {
-            throw std::runtime_error("insert_or_replace(): Node found (and mode is THROW_IF_FOUND).");
-        } else if (mode == INSERT_LEFT_IF_FOUND) {
-            direction = -1;
-            finder_func = furthest_inserter(1);
-        } else if (mode == INSERT_RIGHT_IF_FOUND) {
-            direction = 1;
-            finder_func = furthest_inserter(-1);
-        } else if (mode == REPLACE_IF_FOUND || mode == REPLACE_ONLY) {
-            return std::make_shared<DerivedTree>(new_content, self->get_left(), self->get_right());
-        } else {
-            assert(false); // Should not get here.
+// (static method)
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
+template<typename Finder, typename UpdateFunc>
+typename AvlTreeX::TreePtr
+AvlTreeX::update(const TreePtr& self, Finder&& finder_func, UpdateFunc&& update_func) {
+    PathStep path[MAX_PATH_LENGTH];
+    int path_length = 0;
+
+    const TreePtr* current = &self;
+    while (true) {
+        if (*current == nullptr) {
+            throw std::runtime_error("update(): Node not found.");
         }
+        const int direction = finder_func(*current);
+        if (direction == 0) {
+            break;
+        }
+        if (path_length == MAX_PATH_LENGTH) {
+            throw std::runtime_error("update(): Tree is too tall.");
+        }
+        path[path_length++] = PathStep{current, direction};
+        current = &(*current)->get_child(direction);
     }
 
-    // Keep searching.
-    TreePtr new_child = insert_or_replace(
-        self->get_child(direction),
-        std::move(finder_func),
-        new_content,
-        mode
+    TreePtr new_node = HandlePolicy::template make<DerivedTree>(
+        update_func((*current)->get_content()),
+        (*current)->get_left(),
+        (*current)->get_right()
     );
-    TreePtr new_self = TreeOps::make_tree(self->get_content(), self->get_child(-direction), new_child, direction);
-    return balance(new_self);
+    return rebuild_path(path, path_length, std::move(new_node)); // Already balanced, so this only copies.
 }
 
 // (static method)
-template<typename NodeContent, typename DerivedTree>
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
+template<typename Finder>
 typename AvlTreeX::TreePtr
 AvlTreeX::remove(
     const TreePtr& self,
-    FinderFunc&& finder_func,
+    Finder&& finder_func,
     TreePtr* removed_node /* = nullptr */ // If non-null, will be set to the node that was found and removed.
 ) {
-    if (self == nullptr) {
-        throw std::runtime_error("remove(): Node not found.");
+    PathStep path[MAX_PATH_LENGTH];
+    int path_length = 0;
+
+    const TreePtr* current = &self;
+
+    while (true) {
+        if (*current == nullptr) {
+            throw std::runtime_error("remove(): Node not found.");
+        }
+        const int direction = finder_func(*current);
+        if (direction == 0) {
+            break;
+        }
+        if (path_length == MAX_PATH_LENGTH) {
+            throw std::runtime_error("remove(): Tree is too tall.");
+        }
+        path[path_length++] = PathStep{current, direction};
+        current = &(*current)->get_child(direction);
+    }
+
+    // Node found.
+    const TreePtr& found = *current;
+    if (removed_node != nullptr) {
+        *removed_node = found;
+    }
+
+    if (found->get_left() == nullptr) {
+        return rebuild_path(path, path_length, found->get_right());
+    } else if (found->get_right() == nullptr) {
+        return rebuild_path(path, path_length, found->get_left());
+    }
+
+    // Remove the rightmost node on the left or the leftmost node on the right. Then replace the found node content with that node content.
+    const int sub_direction = bigger_side(found);
+
+    const int found_index = path_length;
+    if (path_length == MAX_PATH_LENGTH) {
+        throw std::runtime_error("remove(): Tree is too tall.");
+    }
+    path[path_length++] = PathStep{current, sub_direction};
+    current = &found->get_child(sub_direction);
+
+    while ((*current)->get_child(-sub_direction) != nullptr) {
+        if (path_length == MAX_PATH_LENGTH) {
+            throw std::runtime_error("remove(): Tree is too tall.");
+        }
+        path[path_length++] = PathStep{current, -sub_direction};
+        current = &(*current)->get_child(-sub_direction);
     }
 
-    const int direction = finder_func(self);
+    const TreePtr& sub_removed_node = *current;
+    return rebuild_path(
+        path,
+        path_length,
+        sub_removed_node->get_child(sub_direction),
+        found_index,
+        &sub_removed_node->get_content()
+    );
+}
 
-    if (direction == 0) {
+// (static method)
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
+typename AvlTreeX::TreePtr
+AvlTreeX::join(const TreePtr& left, const NodeContent& pivot, const TreePtr& right) {
+    const int lh = TreeOps::get_height(left);
+    const int rh = TreeOps::get_height(right);
+
+    if (abs(lh - rh) <= 1) {
+        return TreeOps::make_tree<DerivedTree>(pivot, left, right);
+    }
+
+    // Go down the inner edge of the taller tree until we reach a subtree about as tall as the shorter tree.
+    // Hang the pivot there (with the shorter tree under it), then rebalance our way back up.
+    const int direction = (lh > rh) ? 1 : -1; // Direction we go down in, inside the taller tree.
+    const TreePtr& shorter = (lh > rh) ? right : left;
+    const int shorter_h = std::min(lh, rh);
+
+    PathStep path[MAX_PATH_LENGTH];
+    int path_length = 0;
+
+    const TreePtr* current = (lh > rh) ? &left : &right;
+    while (TreeOps::get_height(*current) > shorter_h + 1) {
+        if (path_length == MAX_PATH_LENGTH) {
+            throw std::runtime_error("join(): Tree is too tall.");
+        }
+        path[path_length++] = PathStep{current, direction};
+        current = &(*current)->get_child(direction);
+    }
+
+    TreePtr new_subtree = TreeOps::make_tree<DerivedTree>(pivot, *current, shorter, direction);
+    return rebuild_path(path, path_length, std::move(new_subtree));
+}
+
+// (static method)
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
+typename AvlTreeX::TreePtr
+AvlTreeX::join2(const TreePtr& left, const TreePtr& right) {
+    if (left == nullptr) {
+        return right;
+    }
+    if (right == nullptr) {
+        return left;
+    }
+    TreePtr last_node;
+    TreePtr new_left = remove(left, furthest_finder(1), &last_node);
+    return join(new_left, last_node->get_content(), right);
+}
+
+// (static method)
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
+template<typename Finder>
+std::pair<typename AvlTreeX::TreePtr, typename AvlTreeX::TreePtr>
+AvlTreeX::split(
+    const TreePtr& self,
+    Finder&& finder_func,
+    int put_found_node /* = 0 */,
+    TreePtr* found_node /* = nullptr */ // If non-null, will be set to the node that was found (or nullptr).
+) {
+    PathStep path[MAX_PATH_LENGTH];
+    int path_length = 0;
+
+    const TreePtr* current = &self;
+    while (*current != nullptr) {
+        const int direction = finder_func(*current);
+        if (direction == 0) {
+            break;
+        }
+        if (path_length == MAX_PATH_LENGTH) {
+            throw std::runtime_error("split(): Tree is too tall.");
+        }
+        path[path_length++] = PathStep{current, direction};
+        current = &(*current)->get_child(direction);
+    }
+
+    TreePtr left_part;
+    TreePtr right_part;
+    if (*current != nullptr) {
         // Node found.
-        if (removed_node != nullptr) {
-            *removed_node = self;
+        const TreePtr& found = *current;
+        if (found_node != nullptr) {
+            *found_node = found;
+        }
+        if (put_found_node < 0) {
+            left_part = join(found->get_left(), found->get_content(), nullptr);
+            right_part = found->get_right();
+        } else if (put_found_node > 0) {
+            left_part = found->get_left();
+            right_part = join(nullptr, found->get_content(), found->get_right());
+        } else {
+            left_part = found->get_left();
+            right_part = found->get_right();
         }
+    } else if (found_node != nullptr) {
+        *found_node = nullptr;
+    }
 
-        if (self->get_left() == nullptr) {
-            return self->get_right();
-        } else if (self->get_right() == nullptr) {
-            return self->get_left();
+    // Going back up, each node on the path joins (along with its other subtree) the part on its side.
+    // The joined trees get taller as we go, so this adds up to O(log n) in total.
+    for (int i = path_length - 1; i >= 0; i--) {
+        const TreePtr& node = *path[i].node;
+        if (path[i].direction < 0) {
+            right_part = join(right_part, node->get_content(), node->get_right());
         } else {
-            // Remove the rightmost node on the left or the leftmost node on the right. Then replace the current node content with that node content.
-            const int sub_direction = (
-                TreeOps::get_size(self->get_right()) > TreeOps::get_size(self->get_left())
-            ) ? 1 : -1;
-            TreePtr sub_removed_node;
-
-            TreePtr new_child = remove(
-                self->get_child(sub_direction),
-                furthest_finder(-sub_direction),
-                &sub_removed_node
-            );
-            assert(sub_removed_node != nullptr);
-            TreePtr new_self = TreeOps::make_tree(sub_removed_node->get_content(), self->get_child(-sub_direction), new_child, sub_direction);
-            return balance(new_self);
+            left_part = join(node->get_left(), node->get_content(), left_part);
         }
     }
 
-    // Keep searching.
-    TreePtr new_child = remove(
-        self->get_child(direction),
-        std::move(finder_func),
-        removed_node
-    );
-    TreePtr new_self = TreeOps::make_tree(self->get_content(), self->get_child(-direction), new_child, direction);
-    return balance(new_self);
+    return std::make_pair(left_part, right_part);
+}
+
+// (static method)
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
+typename AvlTreeX::TreePtr
+AvlTreeX::erase_range(
+    const TreePtr& self,
+    int start_index,
+    int end_index, // Exclusive of end_index.
+    TreePtr* erased_range /* = nullptr */ // If non-null, will be set to a tree of the nodes that were removed.
+) {
+    if (start_index < 0 || end_index < start_index || TreeOps::get_size(self) < end_index) {
+        throw std::runtime_error("erase_range(): Range out of bounds.");
+    }
+    const std::pair<TreePtr, TreePtr> before_and_rest = split(self, index_finder(start_index), 1);
+    const std::pair<TreePtr, TreePtr> range_and_after = split(before_and_rest.second, index_finder(end_index - start_index), 1);
+    if (erased_range != nullptr) {
+        *erased_range = range_and_after.first;
+    }
+    return join2(before_and_rest.first, range_and_after.second);
+}
+
+// (static method)
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
+typename AvlTreeX::TreePtr
+AvlTreeX::extract_range(const TreePtr& self, int start_index, int end_index) {
+    if (start_index < 0 || end_index < start_index || TreeOps::get_size(self) < end_index) {
+        throw std::runtime_error("extract_range(): Range out of bounds.");
+    }
+    const TreePtr rest = split(self, index_finder(start_index), 1).second;
+    return split(rest, index_finder(end_index - start_index), 1).first;
+}
+
+// (static method)
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
+template<typename Compare>
+typename AvlTreeX::TreePtr
+AvlTreeX::apply_batch(const TreePtr& self, const std::vector<BatchOp>& ops, Compare cmp /* = Compare() */) {
+    for (int i = 1; i < int(ops.size()); i++) {
+        if (cmp(ops[i - 1].content, ops[i].content) >= 0) {
+            throw std::runtime_error("apply_batch(): Ops must be sorted, with at most one op per key.");
+        }
+    }
+    return apply_batch(self, ops.data(), int(ops.size()), cmp);
+}
+
+// (static method)
+template<typename NodeContent, typename DerivedTree, typename HandlePolicy, typename Augmentation>
+template<typename Compare>
+typename AvlTreeX::TreePtr
+AvlTreeX::apply_batch(const TreePtr& self, const BatchOp* ops, int num_ops, Compare& cmp) {
+    if (num_ops == 0) {
+        return self;
+    }
+
+    if (self == nullptr) {
+        // Every op is an insert into an empty spot.
+        std::vector<NodeContent> new_contents;
+        new_contents.reserve(num_ops);
+        for (int i = 0; i < num_ops; i++) {
+            if (ops[i].remove) {
+                throw std::runtime_error("apply_batch(): Node not found (for a remove).");
+            }
+            if (ops[i].mode == REPLACE_ONLY) {
+                throw std::runtime_error("apply_batch(): Node not found (and mode is REPLACE_ONLY).");
+            }
+            new_contents.push_back(ops[i].content);
+        }
+        return construct_from_vector(new_contents);
+    }
+
+    // Ops before self are [0, mid_begin), the op for self (if any) is [mid_begin, mid_end), the rest are after.
+    int mid_begin = 0;
+    int mid_end = num_ops;
+    while (mid_begin < mid_end) {
+        const int i = (mid_begin + mid_end) / 2;
+        if (cmp(ops[i].content, self->get_content()) < 0) {
+            mid_begin = i + 1;
+        } else {
+            mid_end = i;
+        }
+    }
+    mid_end = mid_begin;
+    if (mid_end < num_ops && cmp(ops[mid_end].content, self->get_content()) == 0) {
+        mid_end++;
+    }
+
+    const TreePtr new_left = apply_batch(self->get_left(), ops, mid_begin, cmp);
+    const TreePtr new_right = apply_batch(self->get_right(), ops + mid_end, num_ops - mid_end, cmp);
+
+    if (mid_begin == mid_end) {
+        // No op for self.
+        if (new_left == self->get_left() && new_right == self->get_right()) {
+            return self;
+        }
+        return join(new_left, self->get_content(), new_right);
+    }
+
+    // Node found.
+    const BatchOp& op = ops[mid_begin];
+    if (op.remove) {
+        return join2(new_left, new_right);
+    }
+    switch (op.mode) {
+        case THROW_IF_FOUND:
+            throw std::runtime_error("apply_batch(): Node found (and mode is THROW_IF_FOUND).");
+        case INSERT_LEFT_IF_FOUND:
+            return join(join(new_left, op.content, nullptr), self->get_content(), new_right);
+        case INSERT_RIGHT_IF_FOUND:
+            return join(new_left, self->get_content(), join(nullptr, op.content, new_right));
+        case REPLACE_IF_FOUND:
+        case REPLACE_ONLY:
+            return join(new_left, op.content, new_right);
+    }
+    assert(false); // Should not get here.
+    return nullptr;
 }
 
 #undef AvlTreeX
@@ -790,17 +1995,23 @@ AvlTreeX::remove(
 
     // DONE: Implement static TreePtr remove(const TreePtr& self, FinderFunc&& finder_func, TreePtr* removed_node = nullptr) // Throws if item does not exist
 
+    // DONE: Can I re-balance a merged tree by just calling balance() repeatedly?
+    //   Yes, if the smaller tree is hung off the inner edge of the taller one at the right height. See join().
 
-// TODO
-// ----------
-    // TODO: Can I re-balance a merged tree by just calling balance() repeatedly?
+    // DONE: Implement some finder functions
+    // DONE: Implement cmp_finder(const NodeContent& to_find, std::function<int (const NodeContent& c1, const NodeContent& c2)> cmp)
+    // DONE: Implement cmp_finder(const NodeContent& to_find)
 
-    // TODO: Implement static LinkedList<TreePtr>::Ptr get_path(const TreePtr& self, FinderFunc&& finder_func, bool prefer_left_if_not_found = false, const LinkedList<TreePtr>::Ptr& base = nullptr)
-    // TODO: Implement static LinkedList<TreePtr>::Ptr get_next_path(const LinkedList<TreePtr>::Ptr& path, int shift_amount = 1)
+    // DONE: Implement get_path() / get_next_path() and a standard iterator
+    //   See TreeIterator (tree_iterator.h): seek() / at_index() build the path, ++ / -- move along it.
+    //   The path lives in a fixed-size array in the iterator rather than a LinkedList<TreePtr>.
 
-    // TODO: Implement some finder functions
-    // TODO: Implement cmp_finder(const NodeContent& to_find, std::function<int (const NodeContent& c1, const NodeContent& c2)> cmp)
-    // TODO: Implement cmp_finder(const NodeContent& to_find)
+    // DONE: Add a base class for a K,V ordered map
+    //   See PersistentMap (persistent_map.h). It wraps a tree of std::pair<K, V> rather than being a base class.
+
+
+// TODO
+// ----------
 
     // TODO: Implement static TreePtr insert(const TreePtr& self, FinderFunc&& finder_func, const NodeContent& new_content, int mode_if_found = 0) // mode is one of {-1 = insert_to_left, 1 = insert_to_right, 0 = throw_if_found}
     // TODO: Implement static TreePtr replace(const TreePtr& self, FinderFunc&& finder_func, const NodeContent& new_content) // Throws if item does not exist. Uses REPLACE_ONLY.
@@ -808,11 +2019,8 @@ AvlTreeX::remove(
     // TODO: Add sum_of_node_heights and get_average_node_height()
     // TODO: Test the average height after a bunch of insertions
 
-    // TODO: Implement a standard iterator?
-
     // TODO: Test that the destructor is called the right number of times
 
-    // TODO: Add a base class for a K,V ordered map. Take DerivedTree as a template param.
     // TODO: Add usable derived classes
     // TODO: Add examples
 
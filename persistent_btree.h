@@ -0,0 +1,601 @@
+#pragma once
+
+#include "persistent_avl_tree.h"
+
+#include <algorithm>
+#include <cassert>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+/*
+ * A persistent, immutable B+-tree: the same persistence model as AvlTree (immutable nodes, path copying,
+ * versions share every node they have in common), but each node holds many entries, so a lookup touches
+ * about log_FanOut(n) nodes instead of log2(n). Every node knows its size, so lookups by index work too.
+ *
+ * Entries are kept sorted by cmp (a three-way comparator, as for cmp_finder()) and are unique by it.
+ * Entries live in leaves; inner nodes hold the first entry of each child, to steer searches.
+ * For int entries compared with ThreeWayLess, in-node search uses SSE2 where available.
+ *
+ * NodeContent must be default-constructible and copy-assignable (nodes store fixed-size arrays).
+ */
+template<typename NodeContent, typename Compare = ThreeWayLess, int LeafCapacity = 64, int FanOut = 32>
+class PersistentBTree {
+    public:
+        static_assert(LeafCapacity >= 4 && FanOut >= 4, "PersistentBTree: nodes must hold at least 4 entries.");
+
+        struct Node {
+            bool is_leaf;
+            int count; // Number of entries (leaf) or children (inner node).
+            int size; // Number of entries in this subtree.
+        };
+
+        typedef std::shared_ptr<const Node> TreePtr;
+        typedef NodeContent NodeContentT;
+
+        static int get_size(const TreePtr& self) { return self ? self->size : 0; }
+        static int get_height(const TreePtr& self); // Number of levels.
+
+        // vec must be sorted and unique by cmp.
+        static TreePtr construct_from_vector(const std::vector<NodeContent>& vec);
+
+        /*
+         * Returns the entry equal to key, or nullptr if there is none.
+         * The pointer stays valid for as long as self does.
+         */
+        static const NodeContent* find(
+            const TreePtr& self,
+            const NodeContent& key,
+            int* num_to_left = nullptr, // Make sure to initialize num_to_left to 0 before passing.
+            const Compare& cmp = Compare()
+        );
+
+        // Throws if index is out of bounds.
+        static const NodeContent& at(const TreePtr& self, int index);
+
+        // Only THROW_IF_FOUND, REPLACE_IF_FOUND and REPLACE_ONLY make sense here (entries are unique); others throw.
+        static TreePtr insert_or_replace(
+            const TreePtr& self,
+            const NodeContent& new_content,
+            InsertOrReplaceMode mode = REPLACE_IF_FOUND,
+            const Compare& cmp = Compare()
+        );
+
+        // Throws if key does not exist.
+        static TreePtr remove(const TreePtr& self, const NodeContent& key, const Compare& cmp = Compare());
+
+        static std::vector<NodeContent> to_vector(const TreePtr& self);
+
+        // Checks order, fill, sizes and first entries throughout. For tests.
+        static bool is_valid(const TreePtr& self, const Compare& cmp = Compare());
+
+    private:
+        struct Leaf : Node {
+            NodeContent entries[LeafCapacity];
+        };
+
+        struct Inner : Node {
+            NodeContent first_entries[FanOut]; // first_entries[i] is the first entry of children[i].
+            int sizes[FanOut];
+            TreePtr children[FanOut];
+        };
+
+        static constexpr int MIN_LEAF_COUNT = LeafCapacity / 2;
+        static constexpr int MIN_INNER_COUNT = FanOut / 2;
+
+        static const Leaf* as_leaf(const TreePtr& node) { assert(node->is_leaf); return static_cast<const Leaf*>(node.get()); }
+        static const Inner* as_inner(const TreePtr& node) { assert(!node->is_leaf); return static_cast<const Inner*>(node.get()); }
+
+        static const NodeContent& first_entry(const TreePtr& node) {
+            return node->is_leaf ? as_leaf(node)->entries[0] : as_inner(node)->first_entries[0];
+        }
+
+        static bool is_underfull(const TreePtr& node) {
+            return node->count < (node->is_leaf ? MIN_LEAF_COUNT : MIN_INNER_COUNT);
+        }
+
+        static TreePtr make_leaf(const NodeContent* entries, int count);
+        static TreePtr make_inner(const TreePtr* children, int count);
+
+        // A node's worth of children, being edited before it is turned into one or two new nodes.
+        struct ChildList {
+            TreePtr children[FanOut + 1];
+            int count = 0;
+        };
+
+        static ChildList get_children(const Inner* inner);
+        static void replace_child(ChildList* list, int index, const TreePtr& new_child);
+        static void insert_child(ChildList* list, int index, const TreePtr& new_child);
+        static void merge_or_redistribute(ChildList* list, int index); // Children index and index + 1.
+
+        static int child_index(const Inner* inner, const NodeContent& key, const Compare& cmp);
+
+        struct InsertResult {
+            TreePtr node;
+            TreePtr split_off; // If non-null, the node overflowed and this is its right half.
+        };
+
+        static InsertResult insert_rec(const TreePtr& self, const NodeContent& new_content, InsertOrReplaceMode mode, const Compare& cmp);
+        static TreePtr remove_rec(const TreePtr& self, const NodeContent& key, const Compare& cmp);
+
+        static bool is_valid_rec(const TreePtr& self, bool is_root, int depth, int* leaf_depth, const Compare& cmp);
+};
+
+
+namespace BTreeSearch {
+
+    // Number of entries in sorted [entries, entries + count) that are less than key, i.e. the lower bound.
+    template<typename T, typename Compare>
+    int count_less(const T* entries, int count, const T& key, const Compare& cmp) {
+        int lo = 0;
+        int hi = count;
+        while (lo < hi) {
+            const int mid = (lo + hi) / 2;
+            if (cmp(entries[mid], key) < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+    // Number of entries in sorted [entries, entries + count) that are not greater than key, i.e. the upper bound.
+    template<typename T, typename Compare>
+    int count_not_greater(const T* entries, int count, const T& key, const Compare& cmp) {
+        int lo = 0;
+        int hi = count;
+        while (lo < hi) {
+            const int mid = (lo + hi) / 2;
+            if (cmp(entries[mid], key) <= 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+#ifdef __SSE2__
+    // For int entries, compare 4 at a time and count, instead of binary searching.
+
+    inline int count_set_bits_4(int mask) {
+        static const int counts[16] = {0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4};
+        return counts[mask & 15];
+    }
+
+    inline int count_less(const int* entries, int count, const int& key, const ThreeWayLess&) {
+        const __m128i keys = _mm_set1_epi32(key);
+        int ret = 0;
+        int i = 0;
+        for (; i + 4 <= count; i += 4) {
+            const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(entries + i));
+            ret += count_set_bits_4(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(block, keys))));
+        }
+        for (; i < count; i++) {
+            ret += int(entries[i] < key);
+        }
+        return ret;
+    }
+
+    inline int count_not_greater(const int* entries, int count, const int& key, const ThreeWayLess&) {
+        const __m128i keys = _mm_set1_epi32(key);
+        int num_greater = 0;
+        int i = 0;
+        for (; i + 4 <= count; i += 4) {
+            const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(entries + i));
+            num_greater += count_set_bits_4(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(block, keys))));
+        }
+        for (; i < count; i++) {
+            num_greater += int(entries[i] > key);
+        }
+        return count - num_greater;
+    }
+#endif
+
+}
+
+
+// Class method implementations defined here:
+// --------------------------------------------------
+
+#define PersistentBTreeX PersistentBTree<NodeContent, Compare, LeafCapacity, FanOut>
+
+// (static method)
+template<typename NodeContent, typename Compare, int LeafCapacity, int FanOut>
+int PersistentBTreeX::get_height(const TreePtr& self) {
+    int height = 0;
+    for (const Node* node = self.get(); node != nullptr; height++) {
+        node = node->is_leaf ? nullptr : static_cast<const Inner*>(node)->children[0].get();
+    }
+    return height;
+}
+
+// (static method)
+template<typename NodeContent, typename Compare, int LeafCapacity, int FanOut>
+typename PersistentBTreeX::TreePtr
+PersistentBTreeX::make_leaf(const NodeContent* entries, int count) {
+    assert(0 < count && count <= LeafCapacity);
+    std::shared_ptr<Leaf> leaf = std::make_shared<Leaf>();
+    leaf->is_leaf = true;
+    leaf->count = count;
+    leaf->size = count;
+    std::copy(entries, entries + count, leaf->entries);
+    return leaf;
+}
+
+// (static method)
+template<typename NodeContent, typename Compare, int LeafCapacity, int FanOut>
+typename PersistentBTreeX::TreePtr
+PersistentBTreeX::make_inner(const TreePtr* children, int count) {
+    assert(0 < count && count <= FanOut);
+    std::shared_ptr<Inner> inner = std::make_shared<Inner>();
+    inner->is_leaf = false;
+    inner->count = count;
+    inner->size = 0;
+    for (int i = 0; i < count; i++) {
+        inner->first_entries[i] = first_entry(children[i]);
+        inner->sizes[i] = children[i]->size;
+        inner->children[i] = children[i];
+        inner->size += children[i]->size;
+    }
+    return inner;
+}
+
+// (static method)
+template<typename NodeContent, typename Compare, int LeafCapacity, int FanOut>
+typename PersistentBTreeX::TreePtr
+PersistentBTreeX::construct_from_vector(const std::vector<NodeContent>& vec) {
+    if (vec.empty()) {
+        return nullptr;
+    }
+
+    // Spread the entries evenly over as few leaves as possible, then do the same for each level above.
+    std::vector<TreePtr> level;
+    const int num_leaves = (int(vec.size()) + LeafCapacity - 1) / LeafCapacity;
+    for (int i = 0; i < num_leaves; i++) {
+        const int start = int(long(vec.size()) * i / num_leaves);
+        const int end = int(long(vec.size()) * (i + 1) / num_leaves);
+        level.push_back(make_leaf(vec.data() + start, end - start));
+    }
+    while (level.size() > 1) {
+        std::vector<TreePtr> next_level;
+        const int num_nodes = (int(level.size()) + FanOut - 1) / FanOut;
+        for (int i = 0; i < num_nodes; i++) {
+            const int start = int(level.size()) * i / num_nodes;
+            const int end = int(level.size()) * (i + 1) / num_nodes;
+            next_level.push_back(make_inner(level.data() + start, end - start));
+        }
+        level.swap(next_level);
+    }
+    return level[0];
+}
+
+// (static method)
+template<typename NodeContent, typename Compare, int LeafCapacity, int FanOut>
+int PersistentBTreeX::child_index(const Inner* inner, const NodeContent& key, const Compare& cmp) {
+    // The last child whose first entry is not greater than key (or the first child).
+    return BTreeSearch::count_not_greater(inner->first_entries + 1, inner->count - 1, key, cmp);
+}
+
+// (static method)
+template<typename NodeContent, typename Compare, int LeafCapacity, int FanOut>
+const NodeContent*
+PersistentBTreeX::find(
+    const TreePtr& self,
+    const NodeContent& key,
+    int* num_to_left /* = nullptr */, // Make sure to initialize num_to_left to 0 before passing.
+    const Compare& cmp /* = Compare() */
+) {
+    if (self == nullptr) {
+        return nullptr;
+    }
+    const Node* node = self.get();
+    while (!node->is_leaf) {
+        const Inner* inner = static_cast<const Inner*>(node);
+        const int index = child_index(inner, key, cmp);
+        if (num_to_left) {
+            for (int i = 0; i < index; i++) {
+                *num_to_left += inner->sizes[i];
+            }
+        }
+        node = inner->children[index].get();
+    }
+    const Leaf* leaf = static_cast<const Leaf*>(node);
+    const int index = BTreeSearch::count_less(leaf->entries, leaf->count, key, cmp);
+    if (index == leaf->count || cmp(leaf->entries[index], key) != 0) {
+        return nullptr;
+    }
+    if (num_to_left) {
+        *num_to_left += index;
+    }
+    return &leaf->entries[index];
+}
+
+// (static method)
+template<typename NodeContent, typename Compare, int LeafCapacity, int FanOut>
+const NodeContent&
+PersistentBTreeX::at(const TreePtr& self, int index) {
+    if (index < 0 || get_size(self) <= index) {
+        throw std::runtime_error("at(): Index out of bounds.");
+    }
+    const Node* node = self.get();
+    while (!node->is_leaf) {
+        const Inner* inner = static_cast<const Inner*>(node);
+        int i = 0;
+        while (index >= inner->sizes[i]) {
+            index -= inner->sizes[i];
+            i++;
+        }
+        node = inner->children[i].get();
+    }
+    return static_cast<const Leaf*>(node)->entries[index];
+}
+
+// (static method)
+template<typename NodeContent, typename Compare, int LeafCapacity, int FanOut>
+typename PersistentBTreeX::ChildList
+PersistentBTreeX::get_children(const Inner* inner) {
+    ChildList list;
+    list.count = inner->count;
+    std::copy(inner->children, inner->children + inner->count, list.children);
+    return list;
+}
+
+// (static method)
+template<typename NodeContent, typename Compare, int LeafCapacity, int FanOut>
+void PersistentBTreeX::replace_child(ChildList* list, int index, const TreePtr& new_child) {
+    assert(0 <= index && index < list->count);
+    if (new_child == nullptr) {
+        std::move(list->children + index + 1, list->children + list->count, list->children + index);
+        list->count--;
+        list->children[list->count] = nullptr;
+    } else {
+        list->children[index] = new_child;
+    }
+}
+
+// (static method)
+template<typename NodeContent, typename Compare, int LeafCapacity, int FanOut>
+void PersistentBTreeX::insert_child(ChildList* list, int index, const TreePtr& new_child) {
+    assert(0 <= index && index <= list->count && list->count <= FanOut);
+    std::move_backward(list->children + index, list->children + list->count, list->children + list->count + 1);
+    list->children[index] = new_child;
+    list->count++;
+}
+
+// (static method)
+template<typename NodeContent, typename Compare, int LeafCapacity, int FanOut>
+void PersistentBTreeX::merge_or_redistribute(ChildList* list, int index) {
+    const TreePtr a = list->children[index];
+    const TreePtr b = list->children[index + 1];
+    assert(a->is_leaf == b->is_leaf);
+    const int total = a->count + b->count;
+    const int capacity = a->is_leaf ? LeafCapacity : FanOut;
+    const int left_count = (total <= capacity) ? total : total / 2;
+
+    TreePtr new_a;
+    TreePtr new_b;
+    if (a->is_leaf) {
+        NodeContent entries[2 * LeafCapacity];
+        std::copy(as_leaf(a)->entries, as_leaf(a)->entries + a->count, entries);
+        std::copy(as_leaf(b)->entries, as_leaf(b)->entries + b->count, entries + a->count);
+        new_a = make_leaf(entries, left_count);
+        if (left_count < total) {
+            new_b = make_leaf(entries + left_count, total - left_count);
+        }
+    } else {
+        TreePtr children[2 * FanOut];
+        std::copy(as_inner(a)->children, as_inner(a)->children + a->count, children);
+        std::copy(as_inner(b)->children, as_inner(b)->children + b->count, children + a->count);
+        new_a = make_inner(children, left_count);
+        if (left_count < total) {
+            new_b = make_inner(children + left_count, total - left_count);
+        }
+    }
+    list->children[index] = new_a;
+    replace_child(list, index + 1, new_b);
+}
+
+// (static method)
+template<typename NodeContent, typename Compare, int LeafCapacity, int FanOut>
+typename PersistentBTreeX::InsertResult
+PersistentBTreeX::insert_rec(const TreePtr& self, const NodeContent& new_content, InsertOrReplaceMode mode, const Compare& cmp) {
+    if (self->is_leaf) {
+        const Leaf* leaf = as_leaf(self);
+        const int index = BTreeSearch::count_less(leaf->entries, leaf->count, new_content, cmp);
+        NodeContent entries[LeafCapacity + 1];
+        std::copy(leaf->entries, leaf->entries + leaf->count, entries);
+
+        if (index < leaf->count && cmp(leaf->entries[index], new_content) == 0) {
+            // Node found.
+            if (mode == THROW_IF_FOUND) {
+                throw std::runtime_error("insert_or_replace(): Node found (and mode is THROW_IF_FOUND).");
+            }
+            entries[index] = new_content;
+            return InsertResult{make_leaf(entries, leaf->count), nullptr};
+        }
+
+        if (mode == REPLACE_ONLY) {
+            throw std::runtime_error("insert_or_replace(): Node not found (and mode is REPLACE_ONLY).");
+        }
+        std::move_backward(entries + index, entries + leaf->count, entries + leaf->count + 1);
+        entries[index] = new_content;
+        const int count = leaf->count + 1;
+        if (count <= LeafCapacity) {
+            return InsertResult{make_leaf(entries, count), nullptr};
+        }
+        return InsertResult{make_leaf(entries, count / 2), make_leaf(entries + count / 2, count - count / 2)};
+    }
+
+    const Inner* inner = as_inner(self);
+    const int index = child_index(inner, new_content, cmp);
+    const InsertResult child_result = insert_rec(inner->children[index], new_content, mode, cmp);
+
+    ChildList list = get_children(inner);
+    replace_child(&list, index, child_result.node);
+    if (child_result.split_off != nullptr) {
+        insert_child(&list, index + 1, child_result.split_off);
+    }
+    if (list.count <= FanOut) {
+        return InsertResult{make_inner(list.children, list.count), nullptr};
+    }
+    return InsertResult{
+        make_inner(list.children, list.count / 2),
+        make_inner(list.children + list.count / 2, list.count - list.count / 2)
+    };
+}
+
+// (static method)
+template<typename NodeContent, typename Compare, int LeafCapacity, int FanOut>
+typename PersistentBTreeX::TreePtr
+PersistentBTreeX::insert_or_replace(
+    const TreePtr& self,
+    const NodeContent& new_content,
+    InsertOrReplaceMode mode /* = REPLACE_IF_FOUND */,
+    const Compare& cmp /* = Compare() */
+) {
+    if (mode != THROW_IF_FOUND && mode != REPLACE_IF_FOUND && mode != REPLACE_ONLY) {
+        throw std::runtime_error("insert_or_replace(): Entries are unique, so mode must be THROW_IF_FOUND, REPLACE_IF_FOUND or REPLACE_ONLY.");
+    }
+    if (self == nullptr) {
+        if (mode == REPLACE_ONLY) {
+            throw std::runtime_error("insert_or_replace(): Node not found (and mode is REPLACE_ONLY).");
+        }
+        return make_leaf(&new_content, 1);
+    }
+    const InsertResult result = insert_rec(self, new_content, mode, cmp);
+    if (result.split_off == nullptr) {
+        return result.node;
+    }
+    const TreePtr children[2] = {result.node, result.split_off};
+    return make_inner(children, 2);
+}
+
+// (static method)
+template<typename NodeContent, typename Compare, int LeafCapacity, int FanOut>
+typename PersistentBTreeX::TreePtr
+PersistentBTreeX::remove_rec(const TreePtr& self, const NodeContent& key, const Compare& cmp) {
+    // Returns nullptr if self becomes empty.
+    if (self->is_leaf) {
+        const Leaf* leaf = as_leaf(self);
+        const int index = BTreeSearch::count_less(leaf->entries, leaf->count, key, cmp);
+        if (index == leaf->count || cmp(leaf->entries[index], key) != 0) {
+            throw std::runtime_error("remove(): Node not found.");
+        }
+        if (leaf->count == 1) {
+            return nullptr;
+        }
+        NodeContent entries[LeafCapacity];
+        std::copy(leaf->entries, leaf->entries + index, entries);
+        std::copy(leaf->entries + index + 1, leaf->entries + leaf->count, entries + index);
+        return make_leaf(entries, leaf->count - 1);
+    }
+
+    const Inner* inner = as_inner(self);
+    const int index = child_index(inner, key, cmp);
+    const TreePtr new_child = remove_rec(inner->children[index], key, cmp);
+
+    ChildList list = get_children(inner);
+    replace_child(&list, index, new_child);
+    if (list.count == 0) {
+        return nullptr;
+    }
+    if (new_child != nullptr && is_underfull(new_child) && list.count > 1) {
+        // Merge with a sibling, or even out with it if they don't fit in one node.
+        merge_or_redistribute(&list, (index > 0) ? index - 1 : index);
+    }
+    return make_inner(list.children, list.count);
+}
+
+// (static method)
+template<typename NodeContent, typename Compare, int LeafCapacity, int FanOut>
+typename PersistentBTreeX::TreePtr
+PersistentBTreeX::remove(const TreePtr& self, const NodeContent& key, const Compare& cmp /* = Compare() */) {
+    if (self == nullptr) {
+        throw std::runtime_error("remove(): Node not found.");
+    }
+    TreePtr new_root = remove_rec(self, key, cmp);
+    while (new_root != nullptr && !new_root->is_leaf && new_root->count == 1) {
+        new_root = as_inner(new_root)->children[0];
+    }
+    return new_root;
+}
+
+// (static method)
+template<typename NodeContent, typename Compare, int LeafCapacity, int FanOut>
+std::vector<NodeContent>
+PersistentBTreeX::to_vector(const TreePtr& self) {
+    std::vector<NodeContent> ret;
+    if (self == nullptr) {
+        return ret;
+    }
+    ret.reserve(self->size);
+    if (self->is_leaf) {
+        ret.insert(ret.end(), as_leaf(self)->entries, as_leaf(self)->entries + self->count);
+        return ret;
+    }
+    for (int i = 0; i < self->count; i++) {
+        const std::vector<NodeContent> child_vec = to_vector(as_inner(self)->children[i]);
+        ret.insert(ret.end(), child_vec.begin(), child_vec.end());
+    }
+    return ret;
+}
+
+// (static method)
+template<typename NodeContent, typename Compare, int LeafCapacity, int FanOut>
+bool PersistentBTreeX::is_valid_rec(const TreePtr& self, bool is_root, int depth, int* leaf_depth, const Compare& cmp) {
+    if (self->count <= 0 || (!is_root && is_underfull(self))) {
+        return false;
+    }
+    if (self->is_leaf) {
+        const Leaf* leaf = as_leaf(self);
+        if (*leaf_depth == -1) {
+            *leaf_depth = depth;
+        }
+        if (leaf->count > LeafCapacity || leaf->size != leaf->count || depth != *leaf_depth) {
+            return false;
+        }
+        for (int i = 1; i < leaf->count; i++) {
+            if (cmp(leaf->entries[i - 1], leaf->entries[i]) >= 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+    const Inner* inner = as_inner(self);
+    if (inner->count > FanOut || (is_root && inner->count < 2)) {
+        return false;
+    }
+    int size = 0;
+    for (int i = 0; i < inner->count; i++) {
+        const TreePtr& child = inner->children[i];
+        if (child == nullptr
+            || !is_valid_rec(child, false, depth + 1, leaf_depth, cmp)
+            || inner->sizes[i] != child->size
+            || cmp(inner->first_entries[i], first_entry(child)) != 0
+            || (i > 0 && cmp(inner->first_entries[i - 1], inner->first_entries[i]) >= 0)
+        ) {
+            return false;
+        }
+        size += child->size;
+    }
+    return size == inner->size;
+}
+
+// (static method)
+template<typename NodeContent, typename Compare, int LeafCapacity, int FanOut>
+bool PersistentBTreeX::is_valid(const TreePtr& self, const Compare& cmp /* = Compare() */) {
+    if (self == nullptr) {
+        return true;
+    }
+    int leaf_depth = -1;
+    return is_valid_rec(self, true, 0, &leaf_depth, cmp);
+}
+
+#undef PersistentBTreeX
@@ -0,0 +1,173 @@
+#pragma once
+
+#include "persistent_avl_tree.h"
+#include "tree_iterator.h"
+
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+
+namespace MapDetail {
+
+    template<typename T>
+    struct Void { typedef void type; };
+
+    // Whether Compare declares is_transparent, i.e. compares keys of other types directly (like std::less<>).
+    template<typename Compare, typename = void>
+    struct IsTransparent : std::false_type {};
+
+    template<typename Compare>
+    struct IsTransparent<Compare, typename Void<typename Compare::is_transparent>::type> : std::true_type {};
+
+}
+
+
+/*
+ * A persistent ordered map from K to V, on an AvlTree of std::pair<K, V>.
+ *
+ * A PersistentMap is a cheap handle to one version: copying it shares every node, and every "modifying"
+ * method returns a new map and leaves this one alone. cmp is a three-way comparator on keys, as for
+ * cmp_finder(). If Compare is transparent (declares is_transparent, as ThreeWayLess does), the lookup
+ * methods also take keys of any other type cmp accepts, without building a K.
+ */
+template<typename K, typename V, typename Compare = ThreeWayLess, typename HandlePolicy = SharedHandles>
+class PersistentMap {
+    public:
+        typedef std::pair<K, V> Entry;
+
+        class Tree : public AvlTree<Entry, Tree, HandlePolicy> {
+            public:
+                using AvlTree<Entry, Tree, HandlePolicy>::AvlTree;
+        };
+
+        typedef typename Tree::TreePtr TreePtr;
+        typedef TreeIterator<Tree> iterator;
+        typedef TreeIterator<Tree> const_iterator;
+
+        PersistentMap(): cmp() {}
+        explicit PersistentMap(const TreePtr& root, Compare cmp = Compare()): root(root), cmp(cmp) {}
+
+        const TreePtr& get_tree() const { return root; }
+        int size() const { return TreeOps::get_size(root); }
+        bool empty() const { return root == nullptr; }
+
+        iterator begin() const { return iterator::begin(root); }
+        iterator end() const { return iterator::end(root); }
+
+        // Returns the value for key, or nullptr. The pointer stays valid for as long as this version does.
+        const V* find(const K& key) const { return find_impl(key); }
+        bool contains(const K& key) const { return find_impl(key) != nullptr; }
+
+        // Throws if key does not exist.
+        const V& at(const K& key) const { return at_impl(key); }
+
+        // The first entry whose key is not less than key.
+        iterator lower_bound(const K& key) const { return lower_bound_impl(key); }
+
+        // Heterogeneous versions of the above, for a transparent Compare.
+        template<typename Key>
+        typename std::enable_if<MapDetail::IsTransparent<Compare>::value, const V*>::type
+        find(const Key& key) const { return find_impl(key); }
+
+        template<typename Key>
+        typename std::enable_if<MapDetail::IsTransparent<Compare>::value, bool>::type
+        contains(const Key& key) const { return find_impl(key) != nullptr; }
+
+        template<typename Key>
+        typename std::enable_if<MapDetail::IsTransparent<Compare>::value, const V&>::type
+        at(const Key& key) const { return at_impl(key); }
+
+        template<typename Key>
+        typename std::enable_if<MapDetail::IsTransparent<Compare>::value, iterator>::type
+        lower_bound(const Key& key) const { return lower_bound_impl(key); }
+
+        /*
+         * Only THROW_IF_FOUND, REPLACE_IF_FOUND and REPLACE_ONLY make sense here (keys are unique); others throw.
+         */
+        PersistentMap insert_or_replace(const K& key, const V& value, InsertOrReplaceMode mode = REPLACE_IF_FOUND) const;
+
+        /*
+         * Replaces the value for an existing key, moving value into the new node. The key is kept, and only the
+         * path to the entry is copied (no rebalancing). Throws if key does not exist.
+         */
+        PersistentMap update(const K& key, V value) const;
+
+        // Throws if key does not exist.
+        PersistentMap remove(const K& key) const;
+
+    private:
+        template<typename Key>
+        struct KeyFinder {
+            const Key* key;
+            const Compare* cmp;
+
+            int operator()(const TreePtr& current_node) const {
+                const int c = (*cmp)(*key, current_node->get_content().first);
+                return (c < 0) ? -1 : (c > 0) ? 1 : 0;
+            }
+        };
+
+        template<typename Key>
+        KeyFinder<Key> key_finder(const Key& key) const { return KeyFinder<Key>{&key, &cmp}; }
+
+        template<typename Key>
+        const V* find_impl(const Key& key) const {
+            const TreePtr found = Tree::find(root, key_finder(key));
+            return (found != nullptr) ? &found->get_content().second : nullptr;
+        }
+
+        template<typename Key>
+        const V& at_impl(const Key& key) const {
+            const V* value = find_impl(key);
+            if (value == nullptr) {
+                throw std::runtime_error("at(): Key not found.");
+            }
+            return *value;
+        }
+
+        template<typename Key>
+        iterator lower_bound_impl(const Key& key) const {
+            // Never stops at a node, so seek() ends at the spot just before the first key not less than key.
+            return iterator::seek(root, [&](const TreePtr& current_node) {
+                return (cmp(key, current_node->get_content().first) <= 0) ? -1 : 1;
+            });
+        }
+
+        TreePtr root;
+        Compare cmp;
+};
+
+
+// Class method implementations defined here:
+// --------------------------------------------------
+
+#define PersistentMapX PersistentMap<K, V, Compare, HandlePolicy>
+
+// (instance method)
+template<typename K, typename V, typename Compare, typename HandlePolicy>
+PersistentMapX PersistentMapX::insert_or_replace(const K& key, const V& value, InsertOrReplaceMode mode /* = REPLACE_IF_FOUND */) const {
+    if (mode != THROW_IF_FOUND && mode != REPLACE_IF_FOUND && mode != REPLACE_ONLY) {
+        throw std::runtime_error("insert_or_replace(): Keys are unique, so mode must be THROW_IF_FOUND, REPLACE_IF_FOUND or REPLACE_ONLY.");
+    }
+    return PersistentMap(Tree::insert_or_replace(root, key_finder(key), Entry(key, value), mode), cmp);
+}
+
+// (instance method)
+template<typename K, typename V, typename Compare, typename HandlePolicy>
+PersistentMapX PersistentMapX::update(const K& key, V value) const {
+    return PersistentMap(
+        Tree::update(root, key_finder(key), [&](const Entry& old_entry) {
+            return Entry(old_entry.first, std::move(value));
+        }),
+        cmp
+    );
+}
+
+// (instance method)
+template<typename K, typename V, typename Compare, typename HandlePolicy>
+PersistentMapX PersistentMapX::remove(const K& key) const {
+    return PersistentMap(Tree::remove(root, key_finder(key)), cmp);
+}
+
+#undef PersistentMapX
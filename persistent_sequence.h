@@ -0,0 +1,336 @@
+#pragma once
+
+#include "persistent_avl_tree.h"
+#include "tree_iterator.h"
+
+#include <algorithm>
+#include <cassert>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+/*
+ * A persistent sequence of T, on an AvlTree ordered by index (no keys).
+ *
+ * Like PersistentMap, a PersistentSequence is a cheap handle to one version: copying it shares every node,
+ * and every "modifying" method returns a new sequence and leaves this one alone. concat(), slice(),
+ * insert_range_at() and erase_range() are each O(log n) joins and splits, and share everything off their paths.
+ */
+template<typename T, typename HandlePolicy = SharedHandles>
+class PersistentSequence {
+    public:
+        class Tree : public AvlTree<T, Tree, HandlePolicy> {
+            public:
+                using AvlTree<T, Tree, HandlePolicy>::AvlTree;
+        };
+
+        typedef typename Tree::TreePtr TreePtr;
+        typedef TreeIterator<Tree> iterator;
+        typedef TreeIterator<Tree> const_iterator;
+
+        PersistentSequence() {}
+        explicit PersistentSequence(const TreePtr& root): root(root) {}
+        explicit PersistentSequence(const std::vector<T>& vec): root(Tree::construct_from_vector(vec)) {}
+
+        const TreePtr& get_tree() const { return root; }
+        int size() const { return TreeOps::get_size(root); }
+        bool empty() const { return root == nullptr; }
+
+        iterator begin() const { return iterator::begin(root); }
+        iterator end() const { return iterator::end(root); }
+
+        std::vector<T> to_vector() const { return std::vector<T>(begin(), end()); }
+
+        // Throws if index is out of bounds.
+        const T& at(int index) const;
+
+        // This sequence followed by other.
+        PersistentSequence concat(const PersistentSequence& other) const {
+            return PersistentSequence(Tree::join2(root, other.root));
+        }
+
+        // Elements [start_index, end_index). Throws if the range is out of bounds.
+        PersistentSequence slice(int start_index, int end_index) const {
+            return PersistentSequence(Tree::extract_range(root, start_index, end_index));
+        }
+
+        // Inserts all of seq before the element at index (or at the end, if index == size()). Throws if out of bounds.
+        PersistentSequence insert_range_at(int index, const PersistentSequence& seq) const;
+
+        PersistentSequence insert_at(int index, const T& value) const {
+            return insert_range_at(index, PersistentSequence(TreeOps::make_tree<Tree>(value, nullptr, nullptr)));
+        }
+
+        PersistentSequence push_back(const T& value) const { return insert_at(size(), value); }
+
+        // Removes elements [start_index, end_index). Throws if the range is out of bounds.
+        PersistentSequence erase_range(int start_index, int end_index) const {
+            return PersistentSequence(Tree::erase_range(root, start_index, end_index));
+        }
+
+    private:
+        TreePtr root;
+};
+
+
+namespace SequenceDetail {
+
+    // Up to Capacity characters, stored inline in the node.
+    template<typename CharT, int Capacity>
+    struct Chunk {
+        int length;
+        CharT chars[Capacity];
+    };
+
+    // Keeps the number of characters in each subtree.
+    template<typename CharT, int Capacity>
+    struct ChunkLength {
+        typedef int Summary;
+        static constexpr bool keeps_size = true;
+
+        static int identity() { return 0; }
+        static int of(const Chunk<CharT, Capacity>& chunk) { return chunk.length; }
+        static int combine(int a, int b) { return a + b; }
+    };
+
+}
+
+
+/*
+ * A persistent sequence of characters (or bytes), with up to ChunkCapacity of them inline in each node.
+ *
+ * Positions are character offsets, found through each subtree's character count (an Augmentation summary),
+ * so every operation is O(log n) in the number of chunks. A split in the middle of a chunk copies that chunk
+ * into two; chunks that would fit in one are merged where two ropes meet, so repeated small edits don't leave
+ * a trail of tiny chunks.
+ */
+template<typename CharT = char, int ChunkCapacity = 64, typename HandlePolicy = SharedHandles>
+class PersistentRope {
+    public:
+        typedef SequenceDetail::Chunk<CharT, ChunkCapacity> Chunk;
+        typedef SequenceDetail::ChunkLength<CharT, ChunkCapacity> ChunkLength;
+
+        class Tree : public AvlTree<Chunk, Tree, HandlePolicy, ChunkLength> {
+            public:
+                using AvlTree<Chunk, Tree, HandlePolicy, ChunkLength>::AvlTree;
+        };
+
+        typedef typename Tree::TreePtr TreePtr;
+        typedef std::basic_string<CharT> String;
+
+        PersistentRope() {}
+        explicit PersistentRope(const TreePtr& root): root(root) {}
+        explicit PersistentRope(const String& str): PersistentRope(str.data(), int(str.size())) {}
+        PersistentRope(const CharT* chars, int length);
+
+        const TreePtr& get_tree() const { return root; }
+        int length() const { return TreeOps::get_summary(root); }
+        bool empty() const { return root == nullptr; }
+        int num_chunks() const { return TreeOps::get_size(root); }
+
+        // The chunks in order, for range-for. Each has length (> 0) and chars.
+        TreeRange<Tree> chunks() const { return TreeRange<Tree>(root); }
+
+        String to_string() const;
+
+        // Throws if pos is out of bounds.
+        CharT at(int pos) const;
+
+        PersistentRope concat(const PersistentRope& other) const { return PersistentRope(concat_trees(root, other.root)); }
+
+        // The parts before and from pos. Throws if pos is out of bounds (0 <= pos <= length() is fine).
+        std::pair<PersistentRope, PersistentRope> split_at(int pos) const;
+
+        // Characters [start_pos, end_pos). Throws if the range is out of bounds.
+        PersistentRope slice(int start_pos, int end_pos) const;
+
+        // Inserts all of rope at pos. Throws if pos is out of bounds.
+        PersistentRope insert_range_at(int pos, const PersistentRope& rope) const;
+
+        // Removes characters [start_pos, end_pos). Throws if the range is out of bounds.
+        PersistentRope erase_range(int start_pos, int end_pos) const;
+
+    private:
+        // Finds the chunk holding character pos, and sets *pos_in_chunk to where it is in that chunk.
+        // Ends at the empty spot after the last chunk if pos == length().
+        struct PosFinder {
+            int pos;
+            int* pos_in_chunk;
+
+            int operator()(const TreePtr& current_node) {
+                const int left_length = TreeOps::get_summary(current_node->get_left());
+                if (pos < left_length) {
+                    return -1;
+                }
+                pos -= left_length;
+                if (pos < current_node->get_content().length) {
+                    *pos_in_chunk = pos;
+                    return 0;
+                }
+                pos -= current_node->get_content().length;
+                return 1;
+            }
+        };
+
+        static Chunk make_chunk(const CharT* chars, int length) {
+            assert(0 < length && length <= ChunkCapacity);
+            Chunk chunk;
+            chunk.length = length;
+            std::copy(chars, chars + length, chunk.chars);
+            return chunk;
+        }
+
+        static TreePtr concat_trees(const TreePtr& left, const TreePtr& right);
+        static std::pair<TreePtr, TreePtr> split_trees(const TreePtr& tree, int pos);
+
+        TreePtr root;
+};
+
+
+// Class method implementations defined here:
+// --------------------------------------------------
+
+#define PersistentSequenceX PersistentSequence<T, HandlePolicy>
+
+// (instance method)
+template<typename T, typename HandlePolicy>
+const T& PersistentSequenceX::at(int index) const {
+    if (index < 0 || size() <= index) {
+        throw std::runtime_error("at(): Index out of bounds.");
+    }
+    return Tree::find(root, Tree::index_finder(index))->get_content();
+}
+
+// (instance method)
+template<typename T, typename HandlePolicy>
+PersistentSequenceX PersistentSequenceX::insert_range_at(int index, const PersistentSequence& seq) const {
+    if (index < 0 || size() < index) {
+        throw std::runtime_error("insert_range_at(): Index out of bounds.");
+    }
+    const std::pair<TreePtr, TreePtr> parts = Tree::split(root, Tree::index_finder(index), 1);
+    return PersistentSequence(Tree::join2(Tree::join2(parts.first, seq.root), parts.second));
+}
+
+#undef PersistentSequenceX
+
+
+#define PersistentRopeX PersistentRope<CharT, ChunkCapacity, HandlePolicy>
+
+// (constructor)
+template<typename CharT, int ChunkCapacity, typename HandlePolicy>
+PersistentRopeX::PersistentRope(const CharT* chars, int length) {
+    std::vector<Chunk> chunks;
+    for (int start = 0; start < length; start += ChunkCapacity) {
+        chunks.push_back(make_chunk(chars + start, std::min(ChunkCapacity, length - start)));
+    }
+    root = Tree::construct_from_vector(chunks);
+}
+
+// (instance method)
+template<typename CharT, int ChunkCapacity, typename HandlePolicy>
+typename PersistentRopeX::String
+PersistentRopeX::to_string() const {
+    String ret;
+    ret.reserve(length());
+    for (const Chunk& chunk : chunks()) {
+        ret.append(chunk.chars, chunk.length);
+    }
+    return ret;
+}
+
+// (instance method)
+template<typename CharT, int ChunkCapacity, typename HandlePolicy>
+CharT PersistentRopeX::at(int pos) const {
+    if (pos < 0 || length() <= pos) {
+        throw std::runtime_error("at(): Position out of bounds.");
+    }
+    int pos_in_chunk = 0;
+    const TreePtr chunk_node = Tree::find(root, PosFinder{pos, &pos_in_chunk});
+    return chunk_node->get_content().chars[pos_in_chunk];
+}
+
+// (instance method)
+template<typename CharT, int ChunkCapacity, typename HandlePolicy>
+std::pair<PersistentRopeX, PersistentRopeX> PersistentRopeX::split_at(int pos) const {
+    if (pos < 0 || length() < pos) {
+        throw std::runtime_error("split_at(): Position out of bounds.");
+    }
+    const std::pair<TreePtr, TreePtr> parts = split_trees(root, pos);
+    return std::make_pair(PersistentRope(parts.first), PersistentRope(parts.second));
+}
+
+// (instance method)
+template<typename CharT, int ChunkCapacity, typename HandlePolicy>
+PersistentRopeX PersistentRopeX::slice(int start_pos, int end_pos) const {
+    if (start_pos < 0 || end_pos < start_pos || length() < end_pos) {
+        throw std::runtime_error("slice(): Range out of bounds.");
+    }
+    return PersistentRope(split_trees(split_trees(root, end_pos).first, start_pos).second);
+}
+
+// (instance method)
+template<typename CharT, int ChunkCapacity, typename HandlePolicy>
+PersistentRopeX PersistentRopeX::insert_range_at(int pos, const PersistentRope& rope) const {
+    if (pos < 0 || length() < pos) {
+        throw std::runtime_error("insert_range_at(): Position out of bounds.");
+    }
+    const std::pair<TreePtr, TreePtr> parts = split_trees(root, pos);
+    return PersistentRope(concat_trees(concat_trees(parts.first, rope.root), parts.second));
+}
+
+// (instance method)
+template<typename CharT, int ChunkCapacity, typename HandlePolicy>
+PersistentRopeX PersistentRopeX::erase_range(int start_pos, int end_pos) const {
+    if (start_pos < 0 || end_pos < start_pos || length() < end_pos) {
+        throw std::runtime_error("erase_range(): Range out of bounds.");
+    }
+    const std::pair<TreePtr, TreePtr> before_and_rest = split_trees(root, start_pos);
+    const TreePtr after = split_trees(before_and_rest.second, end_pos - start_pos).second;
+    return PersistentRope(concat_trees(before_and_rest.first, after));
+}
+
+// (static method)
+template<typename CharT, int ChunkCapacity, typename HandlePolicy>
+typename PersistentRopeX::TreePtr
+PersistentRopeX::concat_trees(const TreePtr& left, const TreePtr& right) {
+    if (left == nullptr || right == nullptr) {
+        return (left != nullptr) ? left : right;
+    }
+    const Chunk& last_chunk = Tree::find(left, Tree::furthest_finder(1))->get_content();
+    const Chunk& first_chunk = Tree::find(right, Tree::furthest_finder(-1))->get_content();
+    if (last_chunk.length + first_chunk.length > ChunkCapacity) {
+        return Tree::join2(left, right);
+    }
+
+    // Merge the chunks at the seam.
+    Chunk merged = last_chunk;
+    std::copy(first_chunk.chars, first_chunk.chars + first_chunk.length, merged.chars + merged.length);
+    merged.length += first_chunk.length;
+    return Tree::join(Tree::remove(left, Tree::furthest_finder(1)), merged, Tree::remove(right, Tree::furthest_finder(-1)));
+}
+
+// (static method)
+template<typename CharT, int ChunkCapacity, typename HandlePolicy>
+std::pair<typename PersistentRopeX::TreePtr, typename PersistentRopeX::TreePtr>
+PersistentRopeX::split_trees(const TreePtr& tree, int pos) {
+    int pos_in_chunk = 0;
+    TreePtr found;
+    const std::pair<TreePtr, TreePtr> parts = Tree::split(tree, PosFinder{pos, &pos_in_chunk}, 0, &found);
+    if (found == nullptr) {
+        return parts; // pos == length().
+    }
+    const Chunk& chunk = found->get_content();
+    if (pos_in_chunk == 0) {
+        return std::make_pair(parts.first, Tree::join(nullptr, chunk, parts.second));
+    }
+
+    // pos is inside the chunk: split it in two.
+    return std::make_pair(
+        Tree::join(parts.first, make_chunk(chunk.chars, pos_in_chunk), nullptr),
+        Tree::join(nullptr, make_chunk(chunk.chars + pos_in_chunk, chunk.length - pos_in_chunk), parts.second)
+    );
+}
+
+#undef PersistentRopeX
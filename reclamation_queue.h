@@ -0,0 +1,172 @@
+#pragma once
+
+#include "node_handles.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+
+/*
+ * Deferred destruction: dropping the last handle to a node only queues it, and the queue is worked off later,
+ * a bounded number of nodes at a time, by whoever calls reclaim() or by a BackgroundReclaimer thread.
+ *
+ * With the other handle policies, dropping the last handle to a big version destroys all the nodes only it
+ * held, right there and recursively (each node's destructor releases its children). So that request pays time
+ * proportional to the number of nodes, and a deep (hand-built, unbalanced) tree can overflow the stack. Here,
+ * deleting a queued node just queues its children whose last handle it held, so no destructor ever recurses
+ * into another, and each call to reclaim() does at most the work it is asked to.
+ *
+ *     ReclamationQueue<Node> -- The dropped nodes of one Node type, not yet deleted.
+ *     DeferredHandles        -- A handle policy whose dropped nodes go to their ReclamationQueue.
+ *     BackgroundReclaimer    -- A thread that works off a ReclamationQueue as nodes arrive.
+ *
+ * Until they are reclaimed, dropped nodes still take up memory, so something has to keep up with the drops.
+ */
+
+
+/*
+ * A lock-free stack of dropped nodes, linked through the nodes themselves (DeferredHandles::NodeBase).
+ * Any thread may push(); reclaim() is serialized by a mutex, so only one thread pops at a time (which is also
+ * what keeps a popped node from coming back to the top at the same address while someone is still popping it).
+ */
+template<typename Node>
+class ReclamationQueue {
+    public:
+        static void push(Node* node) {
+            std::atomic<Node*>& head = get_shared().head;
+            node->next_dropped = head.load(std::memory_order_relaxed);
+            while (!head.compare_exchange_weak(node->next_dropped, node, std::memory_order_release, std::memory_order_relaxed)) {}
+        }
+
+        /*
+         * Deletes up to max_nodes queued nodes, including children queued by deleting their parents.
+         * Returns how many it deleted (fewer than max_nodes only if the queue ran empty).
+         */
+        static std::size_t reclaim(std::size_t max_nodes = std::size_t(-1)) {
+            Shared& shared = get_shared();
+            std::lock_guard<std::mutex> lock(shared.mutex);
+            std::size_t num_deleted = 0;
+            while (num_deleted < max_nodes) {
+                Node* node = shared.head.load(std::memory_order_acquire);
+                while (node != nullptr && !shared.head.compare_exchange_weak(node, node->next_dropped, std::memory_order_acquire)) {}
+                if (node == nullptr) {
+                    break;
+                }
+                delete node; // Only pushes its children, if this was their last handle.
+                num_deleted++;
+            }
+            return num_deleted;
+        }
+
+        static bool empty() { return get_shared().head.load(std::memory_order_acquire) == nullptr; }
+
+    private:
+        struct Shared {
+            std::atomic<Node*> head{nullptr};
+            std::mutex mutex;
+        };
+
+        static Shared& get_shared() {
+            // Never destroyed: nodes may still be dropped by other static objects' destructors.
+            static Shared* shared = new Shared();
+            return *shared;
+        }
+};
+
+
+/*
+ * Nodes carry their own atomic refcount (like IntrusiveHandles<true>) plus a link for their ReclamationQueue,
+ * and the last handle to a node queues it there instead of deleting it.
+ */
+struct DeferredHandles {
+    template<typename Node>
+    using Ptr = IntrusivePtr<Node>;
+
+    template<typename Node>
+    class NodeBase : public IntrusiveRefCount<true> {
+        public:
+            NodeBase(): next_dropped(nullptr) {}
+            NodeBase(const NodeBase& other): IntrusiveRefCount<true>(other), next_dropped(nullptr) {}
+
+            static void intrusive_destroy(Node* node) { ReclamationQueue<Node>::push(node); }
+
+        private:
+            friend class ReclamationQueue<Node>;
+
+            Node* next_dropped; // Only used once the node is dropped.
+    };
+
+    static constexpr bool thread_safe = true;
+    static constexpr bool concurrent_make = true;
+
+    template<typename Node, typename... Args>
+    static Ptr<Node> make(Args&&... args) {
+        return Ptr<Node>(new Node(std::forward<Args>(args)...));
+    }
+};
+
+
+/*
+ * A thread that works off ReclamationQueue<TreeType>, batch_size nodes at a time, checking again every
+ * idle_wait while the queue is empty. Destroying it stops the thread, once it has emptied the queue.
+ */
+template<typename TreeType>
+class BackgroundReclaimer {
+    public:
+        explicit BackgroundReclaimer(
+            std::size_t batch_size = 4096,
+            std::chrono::microseconds idle_wait = std::chrono::microseconds(1000)
+        ):
+            batch_size(batch_size),
+            idle_wait(idle_wait),
+            stopping(false),
+            num_deleted(0),
+            thread([this]() { run(); })
+        {}
+
+        ~BackgroundReclaimer() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wake_up.notify_one();
+            thread.join();
+        }
+
+        BackgroundReclaimer(const BackgroundReclaimer&) = delete;
+        BackgroundReclaimer& operator=(const BackgroundReclaimer&) = delete;
+
+        std::size_t get_num_deleted() const { return num_deleted.load(std::memory_order_relaxed); }
+
+    private:
+        void run() {
+            while (true) {
+                const std::size_t n = ReclamationQueue<TreeType>::reclaim(batch_size);
+                num_deleted.fetch_add(n, std::memory_order_relaxed);
+                if (n == batch_size) {
+                    continue;
+                }
+                std::unique_lock<std::mutex> lock(mutex);
+                if (stopping) {
+                    if (ReclamationQueue<TreeType>::empty()) {
+                        return;
+                    }
+                    continue;
+                }
+                wake_up.wait_for(lock, idle_wait);
+            }
+        }
+
+        const std::size_t batch_size;
+        const std::chrono::microseconds idle_wait;
+        std::mutex mutex;
+        std::condition_variable wake_up;
+        bool stopping;
+        std::atomic<std::size_t> num_deleted;
+        std::thread thread; // Last, so that it starts after everything it uses.
+};
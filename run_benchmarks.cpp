@@ -0,0 +1,223 @@
+// g++ -O2 -o run_benchmarks run_benchmarks.cpp -std=c++11 -pthread && echo && ./run_benchmarks
+
+#include "atomic_root.h"
+#include "epoch_reclamation.h"
+#include "mapped_tree.h"
+#include "persistent_avl_tree.h"
+#include "persistent_btree.h"
+#include "reclamation_queue.h"
+#include "tree_iterator.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace TreeOps;
+
+
+class IntTree : public AvlTree<int, IntTree> {
+    public:
+        using AvlTree<int, IntTree>::AvlTree;
+};
+
+class MappedIntTree : public AvlTree<int, MappedIntTree, MappedHandles<>> {
+    public:
+        using AvlTree<int, MappedIntTree, MappedHandles<>>::AvlTree;
+};
+
+class EpochIntTree : public AvlTree<int, EpochIntTree, EpochHandles> {
+    public:
+        using AvlTree<int, EpochIntTree, EpochHandles>::AvlTree;
+};
+
+class DeferredIntTree : public AvlTree<int, DeferredIntTree, DeferredHandles> {
+    public:
+        using AvlTree<int, DeferredIntTree, DeferredHandles>::AvlTree;
+};
+
+typedef PersistentBTree<int> IntBTree;
+
+
+template<typename Func>
+double time_ns_per_op(int num_ops, Func&& func) {
+    const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    func();
+    const chrono::steady_clock::time_point end = chrono::steady_clock::now();
+    return chrono::duration<double, nano>(end - start).count() / num_ops;
+}
+
+void print_result(const char* name, double avl_ns, double btree_ns) {
+    cout << name << ": AvlTree " << avl_ns << " ns/op, PersistentBTree " << btree_ns << " ns/op" << endl;
+}
+
+
+int main() {
+    const int num_entries = 1 << 20;
+    const int num_ops = 1 << 20;
+
+    // Even keys are in the trees, so odd keys can be inserted.
+    vector<int> keys(num_entries);
+    for (int i = 0; i < num_entries; i++) {
+        keys[i] = 2 * i;
+    }
+    vector<int> lookups(num_ops);
+    for (int i = 0; i < num_ops; i++) {
+        lookups[i] = 2 * (rand() % num_entries);
+    }
+
+    IntTree::TreePtr avl_tree;
+    IntBTree::TreePtr btree;
+    const double avl_build_ns = time_ns_per_op(num_entries, [&]() {
+        avl_tree = IntTree::construct_from_vector(keys);
+    });
+    const double btree_build_ns = time_ns_per_op(num_entries, [&]() {
+        btree = IntBTree::construct_from_vector(keys);
+    });
+    print_result("construct_from_vector", avl_build_ns, btree_build_ns);
+
+    long checksum = 0;
+    const double avl_find_ns = time_ns_per_op(num_ops, [&]() {
+        for (int key : lookups) {
+            checksum += find(avl_tree, IntTree::cmp_finder(key))->get_content();
+        }
+    });
+    const double btree_find_ns = time_ns_per_op(num_ops, [&]() {
+        for (int key : lookups) {
+            checksum += *IntBTree::find(btree, key);
+        }
+    });
+    print_result("find", avl_find_ns, btree_find_ns);
+
+    // A full in-order scan of the AvlTree: one find() per index, vs. one TreeIterator.
+    const double find_scan_ns = time_ns_per_op(num_entries, [&]() {
+        for (int i = 0; i < num_entries; i++) {
+            checksum += find(avl_tree, IntTree::index_finder(i))->get_content();
+        }
+    });
+    const double iterator_scan_ns = time_ns_per_op(num_entries, [&]() {
+        for (int x : in_order(avl_tree)) {
+            checksum += x;
+        }
+    });
+    cout << "scan: find(index_finder(i)) " << find_scan_ns << " ns/node, TreeIterator " << iterator_scan_ns << " ns/node" << endl;
+
+    const int num_inserts = num_ops / 8;
+    const double avl_insert_ns = time_ns_per_op(num_inserts, [&]() {
+        IntTree::TreePtr tree = avl_tree;
+        for (int i = 0; i < num_inserts; i++) {
+            tree = insert_or_replace(tree, IntTree::cmp_finder(lookups[i] + 1), lookups[i] + 1);
+        }
+        checksum += get_size(tree);
+    });
+    const double btree_insert_ns = time_ns_per_op(num_inserts, [&]() {
+        IntBTree::TreePtr tree = btree;
+        for (int i = 0; i < num_inserts; i++) {
+            tree = IntBTree::insert_or_replace(tree, lookups[i] + 1);
+        }
+        checksum += IntBTree::get_size(tree);
+    });
+    print_result("insert_or_replace", avl_insert_ns, btree_insert_ns);
+
+    // Reading the current version from several threads: a mutex and a TreePtr copy (a refcount bump on the
+    // root that every reader shares) vs. an AtomicRoot::Reader (no writes while the version is unchanged)
+    // vs. an EpochRoot read in an EpochGuard per lookup, with find_node() (one write to the thread's own record).
+    const EpochIntTree::TreePtr epoch_tree = EpochIntTree::construct_from_vector(keys);
+    const int reads_per_thread = num_ops / 4;
+    for (int num_threads = 1; num_threads <= 8; num_threads *= 2) {
+        std::mutex mutex;
+        const IntTree::TreePtr locked_root = avl_tree;
+        AtomicRoot<IntTree> cell(avl_tree);
+        std::atomic<long> thread_checksum(0);
+        const auto run_threads = [&](const std::function<void()>& body) {
+            vector<std::thread> threads;
+            for (int t = 0; t < num_threads; t++) {
+                threads.emplace_back(body);
+            }
+            for (std::thread& thread : threads) {
+                thread.join();
+            }
+        };
+        const double mutex_ns = time_ns_per_op(num_threads * reads_per_thread, [&]() {
+            run_threads([&]() {
+                long sum = 0;
+                for (int i = 0; i < reads_per_thread; i++) {
+                    IntTree::TreePtr root;
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        root = locked_root;
+                    }
+                    sum += root->get_content();
+                }
+                thread_checksum += sum;
+            });
+        });
+        const double reader_ns = time_ns_per_op(num_threads * reads_per_thread, [&]() {
+            run_threads([&]() {
+                AtomicRoot<IntTree>::Reader reader(cell);
+                long sum = 0;
+                for (int i = 0; i < reads_per_thread; i++) {
+                    sum += reader.get()->get_content();
+                }
+                thread_checksum += sum;
+            });
+        });
+        EpochRoot<EpochIntTree> epoch_cell(epoch_tree);
+        const double epoch_ns = time_ns_per_op(num_threads * reads_per_thread, [&]() {
+            run_threads([&]() {
+                long sum = 0;
+                for (int i = 0; i < reads_per_thread; i++) {
+                    EpochGuard guard;
+                    sum += find_node(epoch_cell.get(), EpochIntTree::cmp_finder(lookups[i]))->get_content();
+                }
+                thread_checksum += sum;
+            });
+        });
+        checksum += thread_checksum;
+        cout << "current root, " << num_threads << " threads: mutex + TreePtr " << mutex_ns
+            << " ns/read, AtomicRoot::Reader " << reader_ns << " ns/read, EpochRoot + find_node() "
+            << epoch_ns << " ns/lookup" << endl;
+    }
+
+    // Dropping the last handle to a big version: destroyed on the spot vs. queued, then freed in slices.
+    {
+        IntTree::TreePtr shared_version = IntTree::construct_from_vector(keys);
+        DeferredIntTree::TreePtr deferred_version = DeferredIntTree::construct_from_vector(keys);
+        const double shared_drop_ns = time_ns_per_op(1, [&]() { shared_version = nullptr; });
+        const double deferred_drop_ns = time_ns_per_op(1, [&]() { deferred_version = nullptr; });
+        double max_slice_ns = 0;
+        int num_slices = 0;
+        while (!ReclamationQueue<DeferredIntTree>::empty()) {
+            max_slice_ns = std::max(max_slice_ns, time_ns_per_op(1, [&]() { ReclamationQueue<DeferredIntTree>::reclaim(4096); }));
+            num_slices++;
+        }
+        cout << "drop last handle to " << num_entries << " nodes: SharedHandles " << shared_drop_ns / 1e6
+            << " ms, DeferredHandles " << deferred_drop_ns / 1e3 << " us (then " << num_slices
+            << " reclaim(4096) slices of at most " << max_slice_ns / 1e3 << " us)" << endl;
+    }
+
+    // Cold start: building the tree again vs. mapping a file of it.
+    const char* map_path = "/tmp/run_benchmarks.map";
+    MappedTreeFile<MappedIntTree>::write(map_path, MappedIntTree::construct_from_vector(keys));
+    const double rebuild_ns = time_ns_per_op(1, [&]() {
+        checksum += get_size(MappedIntTree::construct_from_vector(keys));
+    });
+    const double map_ns = time_ns_per_op(1, [&]() {
+        MappedTreeFile<MappedIntTree> file(map_path);
+        checksum += find(file.get_root(), MappedIntTree::cmp_finder(keys[num_entries / 2]))->get_content();
+    });
+    cout << "cold start: construct_from_vector " << rebuild_ns / 1e6 << " ms, MappedTreeFile " << map_ns / 1e6 << " ms" << endl;
+    std::remove(map_path);
+
+    cout << "AvlTree height = " << get_height(avl_tree)
+        << ", PersistentBTree height = " << IntBTree::get_height(btree) << endl;
+    cout << "(checksum " << checksum << ")" << endl;
+    return 0;
+}
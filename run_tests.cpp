@@ -1,6 +1,33 @@
-// g++ -o run_tests run_tests.cpp -std=c++11 && echo && ./run_tests
+// g++ -o run_tests run_tests.cpp -std=c++11 -pthread && echo && ./run_tests
 
+#include "atomic_root.h"
+#include "epoch_reclamation.h"
+#include "mapped_tree.h"
 #include "persistent_avl_tree.h"
+#include "persistent_btree.h"
+#include "persistent_map.h"
+#include "persistent_sequence.h"
+#include "reclamation_queue.h"
+#include "set_operations.h"
+#include "transient_tree.h"
+#include "tree_diff.h"
+#include "tree_log.h"
+#include "tree_serialization.h"
+#include "tree_iterator.h"
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <type_traits>
 
 using namespace std;
 using namespace TreeOps;
@@ -22,7 +49,7 @@ class UsableTree : public AvlTree<NodeContent, UsableTree<NodeContent>> {
         //     Base(content, left, right)
         // {}
 
-        virtual std::string get_label() {
+        std::string get_label() {
             std::ostringstream oss;
             oss << this->get_content();
             return oss.str();
@@ -43,6 +70,161 @@ class CustomTree : public AvlTree<int, CustomTree> {
 };
 
 
+// Counts its live nodes, so we can check that every node is destroyed exactly once.
+template<typename HandlePolicy>
+class CountedTree : public AvlTree<int, CountedTree<HandlePolicy>, HandlePolicy> {
+    public:
+        typedef AvlTree<int, CountedTree, HandlePolicy> Base;
+
+        static int num_alive;
+        static int num_made; // Including ones since destroyed.
+
+        CountedTree(
+            const int& content,
+            const typename Base::TreePtr& left,
+            const typename Base::TreePtr& right
+        ):
+            Base(content, left, right)
+        {
+            num_alive++;
+            num_made++;
+        }
+
+        CountedTree(const CountedTree& other): Base(other) { num_alive++; num_made++; }
+
+        ~CountedTree() { num_alive--; }
+};
+
+template<typename HandlePolicy>
+int CountedTree<HandlePolicy>::num_alive = 0;
+
+template<typename HandlePolicy>
+int CountedTree<HandlePolicy>::num_made = 0;
+
+
+// An order-sensitive summary (a polynomial hash of the contents, in order), plus a sum and a min.
+struct HashSumMin {
+    struct Summary {
+        unsigned long long hash;
+        unsigned long long power;
+        long long sum;
+        int min;
+    };
+
+    static constexpr bool keeps_size = true;
+
+    static Summary identity() { return Summary{0, 1, 0, INT_MAX}; }
+    static Summary of(int content) { return Summary{(unsigned long long)content, 1000003, content, content}; }
+    static Summary combine(const Summary& a, const Summary& b) {
+        return Summary{a.hash * b.power + b.hash, a.power * b.power, a.sum + b.sum, min(a.min, b.min)};
+    }
+};
+
+bool operator==(const HashSumMin::Summary& a, const HashSumMin::Summary& b) {
+    return a.hash == b.hash && a.power == b.power && a.sum == b.sum && a.min == b.min;
+}
+
+class SummaryTree : public AvlTree<int, SummaryTree, SharedHandles, HashSumMin> {
+    public:
+        using AvlTree::AvlTree;
+};
+
+class NoSizeTree : public AvlTree<int, NoSizeTree, SharedHandles, WithoutSize<>> {
+    public:
+        using AvlTree::AvlTree;
+};
+
+// Range adds, with a sum, min and max.
+struct AddSumMinMax {
+    struct Summary {
+        long long sum;
+        int count;
+        int min;
+        int max;
+    };
+    typedef int Tag; // Add this.
+
+    static constexpr bool keeps_size = true;
+
+    static Summary identity() { return Summary{0, 0, INT_MAX, INT_MIN}; }
+    static Summary of(int content) { return Summary{content, 1, content, content}; }
+    static Summary combine(const Summary& a, const Summary& b) {
+        return Summary{a.sum + b.sum, a.count + b.count, min(a.min, b.min), max(a.max, b.max)};
+    }
+
+    static int apply_to_content(int tag, int content) { return content + tag; }
+    static Summary apply_to_summary(int tag, const Summary& s) {
+        return (s.count == 0) ? s : Summary{s.sum + (long long)tag * s.count, s.count, s.min + tag, s.max + tag};
+    }
+    static int compose(int first, int second) { return first + second; }
+};
+
+bool operator==(const AddSumMinMax::Summary& a, const AddSumMinMax::Summary& b) {
+    return a.sum == b.sum && a.count == b.count && a.min == b.min && a.max == b.max;
+}
+
+// Counts the nodes it makes (atomically, as pushdowns may happen on any thread that reads it).
+class LazyTree : public AvlTree<int, LazyTree, SharedHandles, AddSumMinMax> {
+    public:
+        static std::atomic<int> num_made;
+
+        LazyTree(const int& content, const TreePtr& left, const TreePtr& right): AvlTree(content, left, right) { num_made++; }
+        LazyTree(int&& content, const TreePtr& left, const TreePtr& right): AvlTree(std::move(content), left, right) { num_made++; }
+};
+
+std::atomic<int> LazyTree::num_made(0);
+
+template<typename TreePtr>
+static void append_in_order(const TreePtr& tree, vector<int>* out) {
+    if (tree == nullptr) {
+        return;
+    }
+    append_in_order(tree->get_left(), out);
+    out->push_back(tree->get_content());
+    append_in_order(tree->get_right(), out);
+}
+
+
+// Not counted, so that it can be made and dropped on several threads at once.
+class CompactTree : public AvlTree<int, CompactTree, CompactHandles<true>> {
+    public:
+        using AvlTree::AvlTree;
+};
+class PooledTree : public AvlTree<int, PooledTree, PooledHandles<true>> {
+    public:
+        using AvlTree::AvlTree;
+};
+
+// Counts its live nodes atomically, for handle policies that free nodes on other threads than they are dropped on.
+template<typename HandlePolicy>
+class AtomicCountedTree : public AvlTree<int, AtomicCountedTree<HandlePolicy>, HandlePolicy> {
+    public:
+        typedef AvlTree<int, AtomicCountedTree, HandlePolicy> Base;
+
+        static std::atomic<int> num_alive;
+
+        AtomicCountedTree(
+            const int& content,
+            const typename Base::TreePtr& left,
+            const typename Base::TreePtr& right
+        ):
+            Base(content, left, right)
+        {
+            num_alive++;
+        }
+
+        AtomicCountedTree(const AtomicCountedTree& other): Base(other) { num_alive++; }
+
+        ~AtomicCountedTree() { num_alive--; }
+};
+
+template<typename HandlePolicy>
+std::atomic<int> AtomicCountedTree<HandlePolicy>::num_alive(0);
+
+typedef AtomicCountedTree<EpochHandles> EpochTree;
+typedef AtomicCountedTree<DeferredHandles> DeferredTree;
+
+
 static string strip_prefix(const string& s, char prefix_char) {
     // Find the first non-prefix character.
     int i;
@@ -66,6 +248,139 @@ static string strip_margin(const string& s) {
 }
 
 
+static string read_file(const string& path) {
+    ifstream in(path, ios::binary);
+    return string(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+}
+
+static void write_file(const string& path, const string& bytes) {
+    ofstream out(path, ios::binary | ios::trunc);
+    out.write(bytes.data(), bytes.size());
+}
+
+template<typename TreePtr>
+static vector<int> to_vector(const TreePtr& tree) {
+    vector<int> ret;
+    for (int i = 0; i < get_size(tree); i++) {
+        ret.push_back(find(tree, TreePtr::element_type::index_finder(i))->get_content());
+    }
+    return ret;
+}
+
+
+template<typename TreeType>
+static void test_set_operations(int grain_size) {
+    srand(34567);
+    for (int trial = 0; trial < 20; trial++) {
+        set<int> a_set;
+        set<int> b_set;
+        for (int i = 0; i < 500; i++) {
+            a_set.insert(rand() % 1000);
+            b_set.insert(rand() % 1000);
+        }
+        const vector<int> a_vec(a_set.begin(), a_set.end());
+        const vector<int> b_vec(b_set.begin(), b_set.end());
+        const auto a = TreeType::construct_from_vector(a_vec);
+        const auto b = TreeType::construct_from_vector(b_vec);
+
+        vector<int> expected;
+        const auto check = [&](const typename TreeType::TreePtr& result) {
+            assert(is_balanced_recursively(result));
+            assert(to_vector(result) == expected);
+            expected.clear();
+        };
+
+        std::set_union(a_vec.begin(), a_vec.end(), b_vec.begin(), b_vec.end(), back_inserter(expected));
+        check(set_union(a, b, ThreeWayLess(), grain_size));
+        std::set_intersection(a_vec.begin(), a_vec.end(), b_vec.begin(), b_vec.end(), back_inserter(expected));
+        check(set_intersection(a, b, ThreeWayLess(), grain_size));
+        std::set_difference(a_vec.begin(), a_vec.end(), b_vec.begin(), b_vec.end(), back_inserter(expected));
+        check(set_difference(a, b, ThreeWayLess(), grain_size));
+        std::set_symmetric_difference(a_vec.begin(), a_vec.end(), b_vec.begin(), b_vec.end(), back_inserter(expected));
+        check(set_symmetric_difference(a, b, ThreeWayLess(), grain_size));
+
+        // Identical trees are recognised without walking them.
+        assert(set_union(a, a) == a);
+        assert(set_intersection(a, a) == a);
+        assert(set_difference(a, a) == nullptr);
+    }
+}
+
+
+template<typename TreeType>
+static void test_handle_policy(const string& name) {
+    typedef typename TreeType::TreePtr TreePtr;
+
+    cout << "handle policy " << name << ":" << endl;
+    {
+        TreePtr tree = nullptr;
+        for (int i = 0; i < 100; i++) {
+            tree = insert_or_replace(tree, TreeType::index_finder(-1, 1), i, THROW_IF_FOUND);
+        }
+        const TreePtr older = tree;
+        for (int i = 0; i < 50; i++) {
+            tree = remove(tree, TreeType::index_finder(0));
+        }
+        assert(get_size(older) == 100);
+        assert(get_size(tree) == 50);
+        assert(is_balanced_recursively(tree));
+        for (int i = 0; i < 50; i++) {
+            assert(find(tree, TreeType::index_finder(i))->get_content() == 50 + i);
+        }
+        cout << "num_alive with two versions = " << TreeType::num_alive << endl;
+        assert(TreeType::num_alive > 100);
+    }
+    cout << "num_alive after dropping them = " << TreeType::num_alive << endl;
+    cout << endl;
+    assert(TreeType::num_alive == 0);
+}
+
+
+// One thread builds versions and another drops them: the blocks must go back to the builder's slabs.
+template<typename TreeType, typename NumSlabs>
+static void test_producer_consumer(const string& name, NumSlabs num_slabs) {
+    typedef typename TreeType::TreePtr TreePtr;
+    const int num_rounds = 50;
+    std::mutex mutex;
+    std::condition_variable handed_over;
+    TreePtr in_flight;
+    bool done = false;
+    vector<int> slabs_after_round(num_rounds);
+    std::thread consumer([&]() {
+        while (true) {
+            std::unique_lock<std::mutex> lock(mutex);
+            handed_over.wait(lock, [&]() { return in_flight != nullptr || done; });
+            if (in_flight == nullptr) {
+                return;
+            }
+            in_flight = nullptr; // Frees the whole version on this thread.
+            handed_over.notify_all();
+        }
+    });
+    std::thread producer([&]() {
+        for (int round = 0; round < num_rounds; round++) {
+            TreePtr tree;
+            for (int i = 0; i < 5000; i++) {
+                tree = insert_or_replace(tree, TreeType::cmp_finder(i), i);
+            }
+            std::unique_lock<std::mutex> lock(mutex);
+            in_flight = std::move(tree);
+            handed_over.notify_all();
+            handed_over.wait(lock, [&]() { return in_flight == nullptr; });
+            slabs_after_round[round] = num_slabs();
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+        handed_over.notify_all();
+    });
+    producer.join();
+    consumer.join();
+    cout << name << " producer/consumer: " << slabs_after_round[0] << " slabs after the first round, "
+        << slabs_after_round[num_rounds - 1] << " after " << num_rounds << endl << endl;
+    assert(slabs_after_round[num_rounds - 1] <= slabs_after_round[0] + 2);
+}
+
+
 int main() {
     cout << "Hello world" << endl;
     cout << endl;
@@ -464,6 +779,1555 @@ int main() {
     assert(is_balanced_recursively(tree11));
 
 
+    {
+        // Sorted by value, so we can search by comparison.
+        const auto tree12 = CustomTree::construct_from_vector({0, 10, 20, 30, 40, 50, 60});
+        for (int i = 0; i < 7; i++) {
+            int num_to_left = 0;
+            assert(find(tree12, CustomTree::cmp_finder(i * 10), &num_to_left)->get_content() == i * 10);
+            assert(num_to_left == i);
+        }
+        assert(find(tree12, CustomTree::cmp_finder(35)) == nullptr);
+
+        // A custom comparator: search in reverse order, from the right.
+        const auto reversed = [](int a, int b) { return (a > b) ? -1 : (a < b) ? 1 : 0; };
+        const auto tree13 = CustomTree::construct_from_vector({60, 50, 40, 30, 20, 10, 0});
+        assert(find(tree13, CustomTree::cmp_finder(20, reversed))->get_content() == 20);
+
+        const auto tree14 = insert_or_replace(tree12, CustomTree::cmp_finder(35), 35, THROW_IF_FOUND);
+        assert(find(tree14, CustomTree::index_finder(4))->get_content() == 35);
+        assert(get_size(remove(tree14, CustomTree::cmp_finder(10))) == 7);
+
+        // A FinderFunc still works, and so does passing a finder as an lvalue.
+        CustomTree::FinderFunc finder_func = CustomTree::cmp_finder(50);
+        assert(find(tree12, finder_func)->get_content() == 50);
+        assert(find(tree12, std::move(finder_func))->get_content() == 50);
+    }
+
+
+    {
+        // Random inserts and removes by index, checked against a vector.
+        srand(12345);
+        vector<int> expected;
+        CustomTree::TreePtr tree15 = nullptr;
+        for (int i = 0; i < 2000; i++) {
+            if (expected.empty() || rand() % 3 != 0) {
+                const int index = rand() % (expected.size() + 1);
+                tree15 = insert_or_replace(tree15, CustomTree::index_finder(index), i, INSERT_LEFT_IF_FOUND);
+                expected.insert(expected.begin() + index, i);
+            } else {
+                const int index = rand() % expected.size();
+                CustomTree::TreePtr removed_node;
+                tree15 = remove(tree15, CustomTree::index_finder(index), &removed_node);
+                assert(removed_node->get_content() == expected[index]);
+                expected.erase(expected.begin() + index);
+            }
+        }
+        assert(get_size(tree15) == int(expected.size()));
+        assert(is_balanced_recursively(tree15));
+        for (int i = 0; i < int(expected.size()); i++) {
+            assert(find(tree15, CustomTree::index_finder(i))->get_content() == expected[i]);
+        }
+        cout << "tree15: size = " << get_size(tree15) << ", height = " << get_height(tree15) << endl;
+        cout << endl;
+    }
+
+
+    {
+        // join(), split() and erase_range(), checked against vectors.
+        srand(23456);
+        for (int trial = 0; trial < 200; trial++) {
+            const int left_size = rand() % 100;
+            const int right_size = (trial % 2) ? rand() % 100 : rand() % 5;
+            vector<int> expected;
+            vector<int> left_vec;
+            vector<int> right_vec;
+            for (int i = 0; i < left_size; i++) { left_vec.push_back(i); expected.push_back(i); }
+            expected.push_back(left_size);
+            for (int i = 0; i < right_size; i++) { right_vec.push_back(left_size + 1 + i); expected.push_back(left_size + 1 + i); }
+
+            const auto joined = CustomTree::join(
+                CustomTree::construct_from_vector(left_vec),
+                left_size,
+                CustomTree::construct_from_vector(right_vec)
+            );
+            assert(get_size(joined) == int(expected.size()));
+            assert(is_balanced_recursively(joined));
+
+            const int cut = rand() % (expected.size() + 1);
+            CustomTree::TreePtr found_node;
+            const auto parts = split(joined, CustomTree::cmp_finder(cut), 0, &found_node);
+            assert(is_balanced_recursively(parts.first));
+            assert(is_balanced_recursively(parts.second));
+            assert(get_size(parts.first) == std::min(cut, int(expected.size())));
+            assert((found_node != nullptr) == (cut < int(expected.size())));
+
+            const auto rejoined = join2(parts.first, parts.second);
+            assert(is_balanced_recursively(rejoined));
+            assert(get_size(rejoined) == get_size(joined) - int(found_node != nullptr));
+
+            const int start_index = rand() % (expected.size() + 1);
+            const int end_index = start_index + rand() % (expected.size() + 1 - start_index);
+            CustomTree::TreePtr erased_range;
+            const auto erased = erase_range(joined, start_index, end_index, &erased_range);
+            assert(is_balanced_recursively(erased));
+            assert(is_balanced_recursively(erased_range));
+            assert(get_size(erased_range) == end_index - start_index);
+            assert(draw_as_text(erased_range) == draw_as_text(extract_range(joined, start_index, end_index)));
+            expected.erase(expected.begin() + start_index, expected.begin() + end_index);
+            assert(get_size(erased) == int(expected.size()));
+            for (int i = 0; i < int(expected.size()); i++) {
+                assert(find(erased, CustomTree::index_finder(i))->get_content() == expected[i]);
+            }
+        }
+
+        bool threw = false;
+        try {
+            erase_range(CustomTree::construct_from_vector({1, 2, 3}), 2, 4);
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        assert(threw);
+    }
+    {
+        // Erasing a range only makes new nodes along the two cut paths.
+        typedef CountedTree<SharedHandles> Tree;
+        vector<int> vec;
+        for (int i = 0; i < 10000; i++) {
+            vec.push_back(i);
+        }
+        const auto tree16 = Tree::construct_from_vector(vec);
+        const int num_alive_before = Tree::num_alive;
+        const auto tree17 = erase_range(tree16, 1234, 8765);
+        const int num_new_nodes = Tree::num_alive - num_alive_before;
+        cout << "erase_range() of 10000 nodes made " << num_new_nodes << " new nodes" << endl;
+        cout << endl;
+        assert(get_size(tree17) == 10000 - (8765 - 1234));
+        assert(num_new_nodes < 200);
+    }
+
+
+    test_set_operations<CustomTree>(DEFAULT_SET_OP_GRAIN_SIZE);
+    test_set_operations<CustomTree>(16); // Lots of forking.
+    test_set_operations<CompactTree>(16); // Nodes made and dropped on many threads.
+    {
+        NodeArena arena;
+        NodeArena::Scope scope(arena);
+        test_set_operations<CountedTree<ArenaHandles<false>>>(16); // Never forks.
+    }
+
+
+    {
+        // apply_batch(), checked against a std::map.
+        typedef CountedTree<SharedHandles> Tree;
+        srand(45678);
+        map<int, int> expected; // Content -> number of copies.
+        vector<int> vec;
+        for (int i = 0; i < 10000; i++) {
+            vec.push_back(i * 2);
+            expected[i * 2] = 1;
+        }
+        Tree::TreePtr tree18 = Tree::construct_from_vector(vec);
+        Tree::TreePtr tree19 = tree18;
+
+        vector<Tree::BatchOp> ops;
+        for (int key = 0; key < 20000; key += 1 + rand() % 20) {
+            const bool present = expected.count(key) != 0;
+            if (present && rand() % 2) {
+                ops.push_back(Tree::remove_op(key));
+                expected.erase(key);
+            } else if (present) {
+                ops.push_back(Tree::insert_or_replace_op(key, INSERT_RIGHT_IF_FOUND));
+                expected[key]++;
+            } else {
+                ops.push_back(Tree::insert_or_replace_op(key, THROW_IF_FOUND));
+                expected[key] = 1;
+            }
+        }
+
+        const int num_made_before_batch = Tree::num_made;
+        tree18 = apply_batch(tree18, ops);
+        const int num_made_by_batch = Tree::num_made - num_made_before_batch;
+
+        for (const Tree::BatchOp& op : ops) {
+            if (op.remove) {
+                tree19 = remove(tree19, Tree::cmp_finder(op.content));
+            } else {
+                tree19 = insert_or_replace(tree19, Tree::cmp_finder(op.content), op.content, op.mode);
+            }
+        }
+        const int num_made_one_by_one = Tree::num_made - num_made_before_batch - num_made_by_batch;
+
+        cout << "apply_batch() of " << ops.size() << " ops made " << num_made_by_batch << " nodes"
+             << " (vs " << num_made_one_by_one << " one by one)" << endl;
+        cout << endl;
+        assert(num_made_by_batch < num_made_one_by_one);
+
+        vector<int> expected_vec;
+        for (const auto& key_and_count : expected) {
+            for (int i = 0; i < key_and_count.second; i++) {
+                expected_vec.push_back(key_and_count.first);
+            }
+        }
+        assert(is_balanced_recursively(tree18));
+        assert(to_vector(tree18) == expected_vec);
+        assert(to_vector(tree19) == expected_vec);
+
+        // Unsorted ops, and ops that fail.
+        const auto throws = [](const Tree::TreePtr& tree, const vector<Tree::BatchOp>& ops) {
+            try {
+                apply_batch(tree, ops);
+            } catch (const std::runtime_error&) {
+                return true;
+            }
+            return false;
+        };
+        assert(throws(tree18, {Tree::remove_op(4), Tree::remove_op(2)}));
+        assert(throws(tree18, {Tree::remove_op(-1)}));
+        assert(throws(tree18, {Tree::insert_or_replace_op(expected_vec[0], THROW_IF_FOUND)}));
+        assert(throws(tree18, {Tree::insert_or_replace_op(-1, REPLACE_ONLY)}));
+        assert(apply_batch(tree18, {}) == tree18);
+    }
+
+
+    {
+        // A transient session, checked against a vector and against the same edits made persistently.
+        typedef CountedTree<SharedHandles> Tree;
+        srand(56789);
+        const Tree::TreePtr base = Tree::construct_from_vector({1, 2, 3, 4, 5});
+        const string base_drawing = draw_as_text(base);
+
+        vector<int> expected = {1, 2, 3, 4, 5};
+        Tree::TreePtr persistent_tree = base;
+        TransientTree<Tree> transient(base);
+
+        int num_made = 0; // By the transient session.
+        int num_made_persistently = 0;
+        Tree::TreePtr snapshot;
+        vector<int> snapshot_expected;
+        for (int i = 0; i < 3000; i++) {
+            if (expected.empty() || rand() % 3 != 0) {
+                const int index = rand() % (expected.size() + 1);
+                const InsertOrReplaceMode mode = (rand() % 2) ? INSERT_LEFT_IF_FOUND : INSERT_RIGHT_IF_FOUND;
+                const int num_made_before = Tree::num_made;
+                transient.insert_or_replace(Tree::index_finder(index), i, mode);
+                num_made += Tree::num_made - num_made_before;
+                const int num_made_before_persistent = Tree::num_made;
+                persistent_tree = insert_or_replace(persistent_tree, Tree::index_finder(index), i, mode);
+                num_made_persistently += Tree::num_made - num_made_before_persistent;
+                expected.insert(expected.begin() + ((mode == INSERT_LEFT_IF_FOUND || index == int(expected.size())) ? index : index + 1), i);
+            } else if (rand() % 2) {
+                const int index = rand() % expected.size();
+                int removed_content = -1;
+                const int num_made_before = Tree::num_made;
+                transient.remove(Tree::index_finder(index), &removed_content);
+                num_made += Tree::num_made - num_made_before;
+                const int num_made_before_persistent = Tree::num_made;
+                persistent_tree = remove(persistent_tree, Tree::index_finder(index));
+                num_made_persistently += Tree::num_made - num_made_before_persistent;
+                assert(removed_content == expected[index]);
+                expected.erase(expected.begin() + index);
+            } else {
+                const int index = rand() % expected.size();
+                const int num_made_before = Tree::num_made;
+                transient.insert_or_replace(Tree::index_finder(index), -i, REPLACE_ONLY);
+                num_made += Tree::num_made - num_made_before;
+                const int num_made_before_persistent = Tree::num_made;
+                persistent_tree = insert_or_replace(persistent_tree, Tree::index_finder(index), -i, REPLACE_ONLY);
+                num_made_persistently += Tree::num_made - num_made_before_persistent;
+                expected[index] = -i;
+            }
+            if (i == 1500) {
+                snapshot = transient.freeze();
+                snapshot_expected = expected;
+            }
+        }
+        cout << "TransientTree made " << num_made << " nodes for 3000 edits, persistent updates made "
+            << num_made_persistently << endl;
+        assert(to_vector(persistent_tree) == expected);
+        assert(num_made * 4 < num_made_persistently);
+
+        // Every node is owned once a replace has gone through it, and then replacing makes nothing at all.
+        for (int index = 0; index < int(expected.size()); index++) {
+            transient.insert_or_replace(Tree::index_finder(index), index, REPLACE_ONLY);
+            expected[index] = index;
+        }
+        const int num_made_before = Tree::num_made;
+        for (int index = 0; index < int(expected.size()); index++) {
+            transient.insert_or_replace(Tree::index_finder(index), -index, REPLACE_ONLY);
+            expected[index] = -index;
+        }
+        cout << "Replacing all " << expected.size() << " owned nodes made " << Tree::num_made - num_made_before << " nodes" << endl;
+        cout << endl;
+        assert(Tree::num_made == num_made_before);
+
+        const Tree::TreePtr frozen = transient.freeze();
+        assert(is_balanced_recursively(frozen));
+        assert(to_vector(frozen) == expected);
+
+        // Frozen nodes are shared again: editing on copies them.
+        transient.insert_or_replace(Tree::index_finder(0), 12345, REPLACE_ONLY);
+        assert(Tree::num_made > num_made_before);
+        assert(to_vector(frozen) == expected);
+        expected[0] = 12345;
+        assert(to_vector(transient.freeze()) == expected);
+
+        // Versions from before and during the session are unchanged.
+        assert(draw_as_text(base) == base_drawing);
+        assert(to_vector(snapshot) == snapshot_expected);
+        assert(is_balanced_recursively(snapshot));
+    }
+
+
+    {
+        // Summaries, kept up to date through inserts, removes, joins, splits and transient edits.
+        SummaryTree::TreePtr tree = SummaryTree::construct_from_vector({5, 10, 15});
+        for (int i = 0; i < 1500; i++) {
+            const int key = rand() % 1000;
+            if (rand() % 3 == 0 && find(tree, SummaryTree::cmp_finder(key)) != nullptr) {
+                tree = remove(tree, SummaryTree::cmp_finder(key));
+            } else {
+                tree = insert_or_replace(tree, SummaryTree::cmp_finder(key), key);
+            }
+        }
+        std::pair<SummaryTree::TreePtr, SummaryTree::TreePtr> parts = split(tree, SummaryTree::cmp_finder(500));
+        tree = join2(parts.second, parts.first); // Out of key order, but folds by index don't mind.
+        TransientTree<SummaryTree> transient(tree);
+        for (int i = 0; i < 200; i++) {
+            transient.insert_or_replace(SummaryTree::index_finder(rand() % (transient.get_size() + 1)), rand() % 1000, INSERT_RIGHT_IF_FOUND);
+        }
+        tree = transient.freeze();
+
+        const vector<int> contents = to_vector(tree);
+        const int size = int(contents.size());
+        for (int trial = 0; trial < 300; trial++) {
+            const int start = rand() % (size + 1);
+            const int end = start + rand() % (size - start + 1);
+            HashSumMin::Summary expected = HashSumMin::identity();
+            for (int i = start; i < end; i++) {
+                expected = HashSumMin::combine(expected, HashSumMin::of(contents[i]));
+            }
+            assert(fold_range(tree, start, end) == expected);
+        }
+        assert(get_summary(tree) == fold_range(tree, 0, size));
+
+        // Folds by key, on a sorted tree.
+        const SummaryTree::TreePtr sorted = parts.first;
+        const vector<int> sorted_contents = to_vector(sorted);
+        for (int trial = 0; trial < 300; trial++) {
+            const int lo = rand() % 600 - 50;
+            const int hi = lo + rand() % 200;
+            HashSumMin::Summary expected = HashSumMin::identity();
+            for (int x : sorted_contents) {
+                if (lo <= x && x < hi) {
+                    expected = HashSumMin::combine(expected, HashSumMin::of(x));
+                }
+            }
+            assert(fold_keys(sorted, lo, hi) == expected);
+        }
+        cout << "sum of " << size << " nodes = " << get_summary(tree).sum << ", min = " << get_summary(tree).min << endl;
+
+        bool threw = false;
+        try { fold_range(tree, 0, size + 1); } catch (const std::runtime_error&) { threw = true; }
+        assert(threw);
+    }
+    {
+        // Lazy range adds, mixed with inserts, removes and folds, against a plain vector.
+        LazyTree::TreePtr tree;
+        vector<int> expected;
+        vector<std::pair<LazyTree::TreePtr, vector<int>>> versions;
+        for (int i = 0; i < 3000; i++) {
+            const int op = rand() % 4;
+            const int size = int(expected.size());
+            if (op == 0 && size > 0) {
+                const int index = rand() % size;
+                tree = remove(tree, LazyTree::index_finder(index));
+                expected.erase(expected.begin() + index);
+            } else if (op == 1) {
+                const int start = rand() % (size + 1);
+                const int end = start + rand() % (size - start + 1);
+                const int addend = rand() % 21 - 10;
+                tree = apply_to_range(tree, start, end, addend);
+                for (int j = start; j < end; j++) {
+                    expected[j] += addend;
+                }
+            } else {
+                const int index = rand() % (size + 1);
+                const int content = rand() % 1000;
+                tree = insert_or_replace(tree, LazyTree::index_finder(index), content, INSERT_LEFT_IF_FOUND);
+                expected.insert(expected.begin() + index, content);
+            }
+            if (i % 100 == 0) {
+                versions.push_back(std::make_pair(tree, expected));
+                const int start = rand() % (expected.size() + 1);
+                const int end = start + rand() % (expected.size() - start + 1);
+                AddSumMinMax::Summary expected_fold = AddSumMinMax::identity();
+                for (int j = start; j < end; j++) {
+                    expected_fold = AddSumMinMax::combine(expected_fold, AddSumMinMax::of(expected[j]));
+                }
+                assert(fold_range(tree, start, end) == expected_fold);
+            }
+        }
+        assert(to_vector(tree) == expected);
+        assert(is_balanced_recursively(tree));
+        for (const auto& version : versions) {
+            assert(to_vector(version.first) == version.second); // Later adds never show up in earlier versions.
+        }
+
+        // A range add only copies O(log n) nodes; the rest are copied as they're walked into.
+        vector<int> sorted(1 << 16);
+        for (int i = 0; i < int(sorted.size()); i++) {
+            sorted[i] = 2 * i;
+        }
+        const LazyTree::TreePtr big = LazyTree::construct_from_vector(sorted);
+        int made_before = LazyTree::num_made;
+        LazyTree::TreePtr added = apply_to_range(big, 1000, 60000, 1);
+        const int num_made_by_range = LazyTree::num_made - made_before;
+        cout << "apply_to_range() of 59000 nodes made " << num_made_by_range << " new nodes" << endl;
+        assert(num_made_by_range <= 4 * get_height(big));
+        assert(get_summary(added).sum == get_summary(big).sum + 59000);
+        assert(fold_range(added, 1000, 60000).min == 2001);
+
+        // By key: only keys in [lo, hi) change, and the tree stays sorted.
+        made_before = LazyTree::num_made;
+        added = apply_to_keys(big, 1001, 3001, 1);
+        assert(LazyTree::num_made - made_before <= 4 * get_height(big));
+        assert(fold_keys(added, 0, 1000) == fold_keys(big, 0, 1000));
+        assert(fold_keys(added, 1001, 3002).sum == fold_keys(big, 1001, 3001).sum + 1000);
+        assert(find(added, LazyTree::cmp_finder(3001)) != nullptr);
+        assert(find(added, LazyTree::cmp_finder(3000)) == nullptr);
+        assert(find(added, LazyTree::cmp_finder(3002)) != nullptr);
+
+        // Several threads reading one tagged version push its tags down concurrently.
+        const LazyTree::TreePtr shared = apply_to_range(apply_to_range(big, 0, 40000, 3), 20000, 65536, -1);
+        vector<int> shared_expected = sorted;
+        for (int j = 0; j < 40000; j++) { shared_expected[j] += 3; }
+        for (int j = 20000; j < 65536; j++) { shared_expected[j] -= 1; }
+        vector<std::thread> threads;
+        vector<int> matched(4);
+        for (int t = 0; t < 4; t++) {
+            threads.emplace_back([&, t]() {
+                matched[t] = (to_vector(shared) == shared_expected);
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        for (int t = 0; t < 4; t++) {
+            assert(matched[t]);
+        }
+        assert(to_vector(big) == sorted);
+
+        bool threw = false;
+        try { apply_to_range(big, 0, int(sorted.size()) + 1, 1); } catch (const std::runtime_error&) { threw = true; }
+        assert(threw);
+        cout << endl;
+    }
+    {
+        // AtomicRoot: writers racing to insert while readers take snapshots.
+        typedef UsableTree<int> Tree;
+        AtomicRoot<Tree> cell;
+        const int num_writers = 4;
+        const int inserts_per_writer = 2000;
+        std::atomic<int> num_writers_done(0);
+        vector<int> readers_ok(4, 1);
+        vector<std::thread> threads;
+        for (int t = 0; t < num_writers; t++) {
+            threads.emplace_back([&, t]() {
+                for (int i = 0; i < inserts_per_writer; i++) {
+                    const int key = i * num_writers + t;
+                    cell.update([key](const Tree::TreePtr& root) {
+                        return insert_or_replace(root, Tree::cmp_finder(key), key);
+                    });
+                }
+                num_writers_done++;
+            });
+        }
+        for (int t = 0; t < int(readers_ok.size()); t++) {
+            threads.emplace_back([&, t]() {
+                AtomicRoot<Tree>::Reader reader(cell);
+                std::uint64_t last_version = 0;
+                while (num_writers_done < num_writers) {
+                    // Every version is one more insert than the last, and versions only move forward.
+                    const Tree::TreePtr& root = reader.get();
+                    if (std::uint64_t(get_size(root)) != reader.get_version() || reader.get_version() < last_version) {
+                        readers_ok[t] = 0;
+                    }
+                    last_version = reader.get_version();
+                }
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        for (int ok : readers_ok) {
+            assert(ok);
+        }
+        const Tree::TreePtr final_root = cell.load();
+        assert(get_size(final_root) == num_writers * inserts_per_writer);
+        assert(cell.get_version() == std::uint64_t(num_writers * inserts_per_writer));
+        assert(is_balanced_recursively(final_root));
+
+        // One writer, publishing with plain stores; old versions are freed once no reader holds them.
+        CompactTree::TreePtr tree;
+        {
+            AtomicRoot<CompactTree> single(CompactTree::TreePtr(), true);
+            AtomicRoot<CompactTree>::Reader reader(single);
+            assert(reader.get() == nullptr);
+            for (int i = 0; i < 100; i++) {
+                tree = insert_or_replace(tree, CompactTree::cmp_finder(i), i);
+                assert(single.store(tree) == std::uint64_t(i + 1));
+            }
+            const CompactTree::TreePtr held = reader.get();
+            assert(held == tree && reader.get_version() == 100);
+            assert(tree.use_count() == 3); // tree, held and the current Slot.
+            CompactTree::TreePtr published;
+            single.update([](const CompactTree::TreePtr& root) { return remove(root, CompactTree::cmp_finder(0)); }, &published);
+            assert(get_size(published) == 99 && tree.use_count() == 3); // The reader still has version 100.
+            reader.get();
+            single.store(published);
+            assert(tree.use_count() == 2); // Version 100 is released.
+        }
+        assert(tree.use_count() == 1);
+        cout << "AtomicRoot ok" << endl << endl;
+    }
+    {
+        // EpochHandles: a dropped version stays readable through raw pointers until the guards that saw it end.
+        EpochTree::TreePtr tree;
+        for (int i = 0; i < 1000; i++) {
+            tree = insert_or_replace(tree, EpochTree::cmp_finder(i), i);
+        }
+        EpochDomain::reclaim();
+        const int num_alive = EpochTree::num_alive;
+        assert(num_alive == 1000);
+        {
+            EpochGuard guard;
+            EpochTree* node = find_node(tree, EpochTree::cmp_finder(500));
+            int num_to_left = 0;
+            assert(find_node(tree, EpochTree::index_finder(500), &num_to_left) == node && num_to_left == 500);
+            assert(find_node(tree, EpochTree::cmp_finder(1000)) == nullptr);
+            tree = nullptr;
+            EpochDomain::reclaim();
+            assert(node->get_content() == 500);
+            assert(EpochTree::num_alive == 1000); // Not even the root is freed yet.
+        }
+        // Freed iteratively: every node is retired as its parent is freed, and reclaim() keeps going.
+        EpochDomain::reclaim();
+        assert(EpochTree::num_alive == 0);
+        assert(EpochDomain::get_num_pending() == 0);
+
+        // EpochRoot: writers racing to insert while readers look up keys inside guards, with no refcount traffic.
+        {
+            // Every version holds key -1, which the cell starts with (so version v has v + 1 keys).
+            EpochRoot<EpochTree> cell(EpochTree::construct_from_vector({-1}));
+            const int num_writers = 2;
+            const int inserts_per_writer = 3000;
+            std::atomic<int> num_writers_done(0);
+            vector<int> readers_ok(3, 1);
+            vector<std::thread> threads;
+            for (int t = 0; t < num_writers; t++) {
+                threads.emplace_back([&, t]() {
+                    for (int i = 0; i < inserts_per_writer; i++) {
+                        const int key = i * num_writers + t;
+                        cell.update([key](const EpochTree::TreePtr& root) {
+                            return insert_or_replace(root, EpochTree::cmp_finder(key), key);
+                        });
+                    }
+                    num_writers_done++;
+                });
+            }
+            for (int t = 0; t < int(readers_ok.size()); t++) {
+                threads.emplace_back([&, t]() {
+                    while (num_writers_done < num_writers) {
+                        EpochGuard guard;
+                        const EpochTree::TreePtr& root = cell.get();
+                        const int size = get_size(root);
+                        // Every version is one more insert than the last.
+                        if (std::uint64_t(size) != cell.get_version() + 1 && cell.get() == root) {
+                            readers_ok[t] = 0;
+                        }
+                        if (find_node(root, EpochTree::cmp_finder(-1)) == nullptr) {
+                            readers_ok[t] = 0;
+                        }
+                    }
+                });
+            }
+            for (std::thread& thread : threads) {
+                thread.join();
+            }
+            for (int ok : readers_ok) {
+                assert(ok);
+            }
+            const EpochTree::TreePtr final_root = cell.load();
+            assert(get_size(final_root) == num_writers * inserts_per_writer + 1);
+            assert(is_balanced_recursively(final_root));
+        }
+        EpochDomain::reclaim(); // Including what the exited threads left behind.
+        cout << "EpochHandles: num_alive after dropping everything = " << EpochTree::num_alive << endl << endl;
+        assert(EpochTree::num_alive == 0);
+    }
+    {
+        // DeferredHandles: dropping a version only queues its root, and reclaim() frees it in bounded slices.
+        DeferredTree::TreePtr tree;
+        for (int i = 0; i < 1000; i++) {
+            tree = insert_or_replace(tree, DeferredTree::cmp_finder(i), i);
+        }
+        ReclamationQueue<DeferredTree>::reclaim();
+        assert(DeferredTree::num_alive == 1000);
+        tree = nullptr;
+        assert(DeferredTree::num_alive == 1000 && !ReclamationQueue<DeferredTree>::empty());
+        while (!ReclamationQueue<DeferredTree>::empty()) {
+            const int num_alive = DeferredTree::num_alive;
+            const std::size_t num_deleted = ReclamationQueue<DeferredTree>::reclaim(100);
+            assert(num_deleted <= 100 && DeferredTree::num_alive == num_alive - int(num_deleted));
+        }
+        assert(DeferredTree::num_alive == 0);
+
+        // A hand-built chain far deeper than recursive destruction could handle, freed without recursion.
+        const int chain_length = 1000000;
+        for (int i = 0; i < chain_length; i++) {
+            tree = make_tree<DeferredTree>(i, tree, nullptr);
+        }
+        tree = nullptr;
+        assert(ReclamationQueue<DeferredTree>::reclaim() == std::size_t(chain_length));
+        assert(DeferredTree::num_alive == 0);
+
+        // With a BackgroundReclaimer, versions dropped on several threads are freed on its thread.
+        {
+            BackgroundReclaimer<DeferredTree> reclaimer(256);
+            vector<std::thread> threads;
+            for (int t = 0; t < 4; t++) {
+                threads.emplace_back([t]() {
+                    DeferredTree::TreePtr tree;
+                    for (int i = 0; i < 5000; i++) {
+                        const int key = (i * 7919 + t) % 5000;
+                        tree = insert_or_replace(tree, DeferredTree::cmp_finder(key), key);
+                    }
+                    assert(get_size(tree) == 5000 && is_balanced_recursively(tree));
+                });
+            }
+            for (std::thread& thread : threads) {
+                thread.join();
+            }
+            assert(reclaimer.get_num_deleted() > 0 || !ReclamationQueue<DeferredTree>::empty());
+        }
+        cout << "DeferredHandles: num_alive after stopping the reclaimer = " << DeferredTree::num_alive << endl << endl;
+        assert(DeferredTree::num_alive == 0);
+    }
+    {
+        // A tree without sizes: everything but index-based operations still works.
+        NoSizeTree::TreePtr a;
+        NoSizeTree::TreePtr b;
+        set<int> expected_a;
+        set<int> expected_b;
+        for (int i = 0; i < 1000; i++) {
+            const int key = rand() % 1000;
+            a = insert_or_replace(a, NoSizeTree::cmp_finder(key), key);
+            expected_a.insert(key);
+            b = insert_or_replace(b, NoSizeTree::cmp_finder(key + 1), key + 1);
+            expected_b.insert(key + 1);
+        }
+        for (int key = 0; key < 1000; key += 3) {
+            if (expected_a.erase(key)) {
+                a = remove(a, NoSizeTree::cmp_finder(key));
+            }
+        }
+        assert(is_balanced_recursively(a));
+        vector<int> in_order_a;
+        append_in_order(a, &in_order_a);
+        assert(in_order_a == vector<int>(expected_a.begin(), expected_a.end()));
+        assert(NoSizeTree::lower_bound(a, 500)->get_content() == *expected_a.lower_bound(500));
+
+        set<int> expected_union = expected_a;
+        expected_union.insert(expected_b.begin(), expected_b.end());
+        vector<int> in_order_union;
+        append_in_order(set_union(a, b, ThreeWayLess(), 16), &in_order_union);
+        assert(in_order_union == vector<int>(expected_union.begin(), expected_union.end()));
+
+        bool threw = false;
+        try { get_size(a); } catch (const std::runtime_error&) { threw = true; }
+        assert(threw);
+        cout << "sizeof(NoSizeTree) = " << sizeof(NoSizeTree) << ", sizeof(CustomTree) = " << sizeof(CustomTree) << endl << endl;
+        assert(sizeof(NoSizeTree) < sizeof(CustomTree));
+    }
+
+
+    {
+        // Key queries, with duplicates, checked against a std::multiset.
+        CustomTree::TreePtr tree;
+        multiset<int> expected;
+        for (int i = 0; i < 1000; i++) {
+            const int key = rand() % 300;
+            tree = insert_or_replace(tree, CustomTree::cmp_finder(key), key, INSERT_RIGHT_IF_FOUND);
+            expected.insert(key);
+        }
+        for (int key = -2; key <= 302; key++) {
+            const int expected_lower = int(std::distance(expected.begin(), expected.lower_bound(key)));
+            const int expected_upper = int(std::distance(expected.begin(), expected.upper_bound(key)));
+
+            int index = -1;
+            const CustomTree::TreePtr lower = CustomTree::lower_bound(tree, key, &index);
+            assert(index == expected_lower);
+            assert((lower == nullptr) == (expected_lower == int(expected.size())));
+            assert(lower == nullptr || lower->get_content() == *expected.lower_bound(key));
+
+            const CustomTree::TreePtr upper = upper_bound(tree, key, &index);
+            assert(index == expected_upper);
+            assert(upper == nullptr || upper->get_content() == *expected.upper_bound(key));
+
+            assert(CustomTree::equal_range(tree, key) == std::make_pair(expected_lower, expected_upper));
+            assert(rank_of(tree, key) == expected_lower);
+
+            const int hi = key + rand() % 20 - 5;
+            const int expected_count = (hi < key) ? 0 : int(std::distance(expected.lower_bound(key), expected.lower_bound(hi)));
+            assert(count_range(tree, key, hi) == expected_count);
+        }
+
+        // A comparator that orders in reverse, on a tree built with it.
+        struct ReverseCmp {
+            int operator()(int a, int b) const { return (a > b) ? -1 : (a < b) ? 1 : 0; }
+        };
+        const CustomTree::TreePtr reversed = CustomTree::construct_from_vector({9, 7, 7, 5, 3, 1});
+        assert(CustomTree::rank_of(reversed, 7, ReverseCmp()) == 1);
+        assert(CustomTree::equal_range(reversed, 7, ReverseCmp()) == std::make_pair(1, 3));
+        assert(CustomTree::count_range(reversed, 8, 2, ReverseCmp()) == 4);
+        assert(CustomTree::lower_bound(reversed, 6, nullptr, ReverseCmp())->get_content() == 5);
+        cout << "key queries checked against a multiset of " << expected.size() << endl << endl;
+    }
+
+
+    {
+        // In-order iteration, checked against a std::set.
+        typedef TreeIterator<CustomTree> Iterator;
+        CustomTree::TreePtr tree;
+        set<int> expected;
+        for (int i = 0; i < 1000; i++) {
+            const int key = rand() % 2000;
+            tree = insert_or_replace(tree, CustomTree::cmp_finder(key), key);
+            expected.insert(key);
+        }
+        const std::vector<int> expected_vec(expected.begin(), expected.end());
+
+        std::vector<int> forward;
+        for (int x : in_order(tree)) {
+            forward.push_back(x);
+        }
+        assert(forward == expected_vec);
+
+        const TreeRange<CustomTree> range = in_order(tree);
+        assert(std::distance(range.begin(), range.end()) == int(expected.size()));
+        assert(std::vector<int>(range.begin(), range.end()) == expected_vec);
+        assert(std::vector<int>(
+            std::reverse_iterator<Iterator>(range.end()),
+            std::reverse_iterator<Iterator>(range.begin())
+        ) == std::vector<int>(expected.rbegin(), expected.rend()));
+        assert(std::is_sorted(range.begin(), range.end()));
+        assert(*std::find(range.begin(), range.end(), expected_vec[10]) == expected_vec[10]);
+
+        // Seeking by index and by finder, then walking both ways.
+        for (int i = 0; i <= int(expected_vec.size()); i += 37) {
+            Iterator it = Iterator::at_index(tree, i);
+            assert(it.get_index() == i);
+            if (i < int(expected_vec.size())) {
+                assert(*it == expected_vec[i]);
+            }
+            if (i > 0) {
+                --it;
+                assert(*it == expected_vec[i - 1] && it.get_index() == i - 1);
+                ++it;
+            }
+            assert(it == Iterator::at_index(tree, i));
+        }
+        for (int key = -1; key <= 2001; key += 13) {
+            const Iterator it = Iterator::seek(tree, CustomTree::cmp_finder(key));
+            const set<int>::iterator expected_it = expected.lower_bound(key);
+            assert(it.get_index() == int(std::distance(expected.begin(), expected_it)));
+            assert((it == range.end()) == (expected_it == expected.end()));
+            if (expected_it != expected.end()) {
+                assert(*it == *expected_it);
+                Iterator next = it;
+                ++next;
+                std::vector<int> rest(next, range.end());
+                assert(rest == std::vector<int>(std::next(expected_it), expected.end()));
+            }
+        }
+        assert(in_order(CustomTree::TreePtr()).begin() == in_order(CustomTree::TreePtr()).end());
+
+        // A node whose left and right are the same subtree: climbing back up must go by the path, not by pointers.
+        const CustomTree::TreePtr small = CustomTree::construct_from_vector(std::vector<int>{1, 2, 3});
+        const CustomTree::TreePtr twice = join(small, 99, small);
+        assert(twice->get_left() == twice->get_right() && get_size(twice) == 7);
+        const std::vector<int> twice_expected{1, 2, 3, 99, 1, 2, 3};
+        assert(std::vector<int>(in_order(twice).begin(), in_order(twice).end()) == twice_expected);
+        assert(std::vector<int>(
+            std::reverse_iterator<Iterator>(in_order(twice).end()),
+            std::reverse_iterator<Iterator>(in_order(twice).begin())
+        ) == std::vector<int>(twice_expected.rbegin(), twice_expected.rend()));
+        Iterator twice_it = Iterator::seek(twice, CustomTree::index_finder(2));
+        ++twice_it;
+        assert(*twice_it == 99 && twice_it.get_index() == 3);
+
+        // The iterator keeps its version alive.
+        Iterator it = Iterator::begin(tree);
+        tree = nullptr;
+        assert(*it == expected_vec[0]);
+        cout << "iterated " << expected.size() << " nodes in order" << endl << endl;
+    }
+
+
+    {
+        // Diffs between versions, checked against a diff of two std::maps; shared subtrees are skipped.
+        typedef PersistentMap<int, int> Map;
+        typedef Map::Tree::TreePtr TreePtr;
+        Map base;
+        std::map<int, int> base_expected;
+        for (int i = 0; i < 20000; i++) {
+            const int key = rand() % 100000;
+            base = base.insert_or_replace(key, i);
+            base_expected[key] = i;
+        }
+        for (int num_edits : {0, 1, 10, 100}) {
+            Map edited = base;
+            std::map<int, int> edited_expected = base_expected;
+            for (int i = 0; i < num_edits; i++) {
+                const int key = rand() % 100000;
+                if (rand() % 3 == 0 && edited.contains(key)) {
+                    edited = edited.remove(key);
+                    edited_expected.erase(key);
+                } else {
+                    edited = edited.insert_or_replace(key, -i);
+                    edited_expected[key] = -i;
+                }
+            }
+
+            vector<string> expected;
+            for (const auto& entry : base_expected) {
+                const auto found = edited_expected.find(entry.first);
+                if (found == edited_expected.end()) {
+                    expected.push_back("-" + to_string(entry.first));
+                } else if (found->second != entry.second) {
+                    expected.push_back("~" + to_string(entry.first));
+                }
+            }
+            for (const auto& entry : edited_expected) {
+                if (base_expected.count(entry.first) == 0) {
+                    expected.push_back("+" + to_string(entry.first));
+                }
+            }
+            sort(expected.begin(), expected.end());
+
+            vector<string> actual;
+            vector<int> actual_keys;
+            int num_visited = 0;
+            const auto key_cmp = [](const Map::Entry& a, const Map::Entry& b) { return (a.first < b.first) ? -1 : (a.first > b.first) ? 1 : 0; };
+            diff(base.get_tree(), edited.get_tree(), [&](DiffKind kind, const Map::Entry* old_entry, const Map::Entry* new_entry) {
+                const int key = (old_entry != nullptr) ? old_entry->first : new_entry->first;
+                actual.push_back(string((kind == ENTRY_ADDED) ? "+" : (kind == ENTRY_REMOVED) ? "-" : "~") + to_string(key));
+                actual_keys.push_back(key);
+            }, key_cmp, std::equal_to<Map::Entry>(), &num_visited);
+            assert(is_sorted(actual_keys.begin(), actual_keys.end()));
+            sort(actual.begin(), actual.end());
+            assert(actual == expected);
+
+            cout << "diff after " << num_edits << " edits: " << actual.size() << " differences, looked at "
+                << num_visited << " of " << base.size() << " nodes" << endl;
+            assert(num_visited <= (num_edits + 1) * 8 * get_height(base.get_tree()));
+        }
+
+        int num_changes = 0;
+        diff(TreePtr(), base.get_tree(), [&](DiffKind kind, const Map::Entry*, const Map::Entry*) {
+            assert(kind == ENTRY_ADDED);
+            num_changes++;
+        });
+        assert(num_changes == base.size());
+        cout << endl;
+    }
+    {
+        // Three-way merges, checked against merging two std::maps entry by entry.
+        typedef PersistentMap<int, int> Map;
+        typedef Map::Tree::TreePtr TreePtr;
+        const auto key_cmp = [](const Map::Entry& a, const Map::Entry& b) { return (a.first < b.first) ? -1 : (a.first > b.first) ? 1 : 0; };
+        // On a conflict: the sum if both sides have the entry, else leave it out.
+        std::atomic<int> num_conflicts(0);
+        const auto conflict_func = [&](const Map::Entry* base, const Map::Entry* ours, const Map::Entry* theirs, Map::Entry* merged) {
+            (void)base;
+            num_conflicts++;
+            if (ours == nullptr || theirs == nullptr) {
+                return false;
+            }
+            *merged = Map::Entry(ours->first, ours->second + theirs->second);
+            return true;
+        };
+
+        Map base;
+        for (int i = 0; i < 20000; i++) {
+            base = base.insert_or_replace(rand() % 50000, i);
+        }
+        for (int trial = 0; trial < 20; trial++) {
+            Map ours = base;
+            Map theirs = base;
+            const int num_edits = (trial < 10) ? 20 : 2000;
+            for (int i = 0; i < num_edits; i++) {
+                Map& side = (i % 2 == 0) ? ours : theirs;
+                const int key = rand() % 50000;
+                if (rand() % 3 == 0 && side.contains(key)) {
+                    side = side.remove(key);
+                } else {
+                    side = side.insert_or_replace(key, rand() % 3); // Often the same value on both sides.
+                }
+            }
+
+            // The expected result and number of conflicts, entry by entry.
+            std::map<int, int> base_entries(base.begin(), base.end());
+            std::map<int, int> ours_entries(ours.begin(), ours.end());
+            std::map<int, int> theirs_entries(theirs.begin(), theirs.end());
+            set<int> keys;
+            for (const auto* entries : {&base_entries, &ours_entries, &theirs_entries}) {
+                for (const auto& entry : *entries) {
+                    keys.insert(entry.first);
+                }
+            }
+            vector<Map::Entry> expected;
+            int expected_conflicts = 0;
+            for (int key : keys) {
+                const auto get = [&](const std::map<int, int>& entries) {
+                    const auto found = entries.find(key);
+                    return (found != entries.end()) ? found->second : INT_MIN;
+                };
+                const int b = get(base_entries), o = get(ours_entries), t = get(theirs_entries);
+                int merged;
+                if (o == b) { merged = t; }
+                else if (t == b || o == t) { merged = o; }
+                else {
+                    expected_conflicts++;
+                    merged = (o != INT_MIN && t != INT_MIN) ? o + t : INT_MIN;
+                }
+                if (merged != INT_MIN) {
+                    expected.push_back(Map::Entry(key, merged));
+                }
+            }
+
+            num_conflicts = 0;
+            const TreePtr merged = merge3(base.get_tree(), ours.get_tree(), theirs.get_tree(), conflict_func, key_cmp, 64);
+            const Map merged_map(merged);
+            assert(vector<Map::Entry>(merged_map.begin(), merged_map.end()) == expected);
+            assert(num_conflicts == expected_conflicts);
+            assert(is_balanced_recursively(merged));
+            if (trial == 0 || trial == 10) {
+                cout << "merge3 of " << num_edits << " edits: " << expected_conflicts << " conflicts" << endl;
+            }
+        }
+
+        // If only one side changed, that side is the result.
+        const Map ours = base.insert_or_replace(-1, -1);
+        assert(merge3(base.get_tree(), ours.get_tree(), base.get_tree(), conflict_func, key_cmp) == ours.get_tree());
+        assert(merge3(base.get_tree(), base.get_tree(), ours.get_tree(), conflict_func, key_cmp) == ours.get_tree());
+        cout << endl;
+    }
+    {
+        // PersistentMap, checked against a std::map.
+        typedef PersistentMap<string, int> Map;
+        Map map;
+        std::map<string, int> expected;
+        std::vector<Map> versions;
+        for (int i = 0; i < 500; i++) {
+            const string key = to_string(rand() % 200);
+            if (rand() % 4 == 0 && expected.count(key)) {
+                map = map.remove(key);
+                expected.erase(key);
+            } else {
+                map = map.insert_or_replace(key, i);
+                expected[key] = i;
+            }
+            versions.push_back(map);
+        }
+        assert(map.size() == int(expected.size()));
+        assert(std::vector<Map::Entry>(map.begin(), map.end()) == std::vector<Map::Entry>(expected.begin(), expected.end()));
+        assert(is_balanced_recursively(map.get_tree()));
+
+        // Lookups by const char*, compared directly with the keys (ThreeWayLess is transparent).
+        const string some_key = expected.begin()->first;
+        assert(map.find(some_key.c_str()) != nullptr && *map.find(some_key.c_str()) == expected.begin()->second);
+        assert(map.contains(some_key.c_str()));
+        assert(!map.contains("not a key"));
+        assert(map.at(some_key) == expected.begin()->second);
+        assert(map.lower_bound("1")->first == expected.lower_bound("1")->first);
+
+        bool threw = false;
+        try { map.at("not a key"); } catch (const std::runtime_error&) { threw = true; }
+        assert(threw);
+        threw = false;
+        try { map.insert_or_replace(some_key, 0, THROW_IF_FOUND); } catch (const std::runtime_error&) { threw = true; }
+        assert(threw);
+        threw = false;
+        try { map.update("not a key", 0); } catch (const std::runtime_error&) { threw = true; }
+        assert(threw);
+
+        // A key type that can't be made from the lookup type, so only the heterogeneous path compiles.
+        struct ById {
+            typedef void is_transparent;
+            int operator()(const pair<int, string>& a, const pair<int, string>& b) const { return (a.first > b.first) - (a.first < b.first); }
+            int operator()(int a, const pair<int, string>& b) const { return (a > b.first) - (a < b.first); }
+        };
+        PersistentMap<pair<int, string>, double, ById> by_id;
+        by_id = by_id.insert_or_replace(make_pair(7, string("seven")), 7.5);
+        by_id = by_id.insert_or_replace(make_pair(3, string("three")), 3.5);
+        assert(*by_id.find(7) == 7.5);
+        assert(by_id.find(5) == nullptr);
+        assert(by_id.lower_bound(5)->first.second == "seven");
+
+        // update() moves the value in, copies only the path, and keeps the shape.
+        typedef PersistentMap<int, std::vector<int>> VectorMap;
+        VectorMap vectors;
+        for (int i = 0; i < 100; i++) {
+            vectors = vectors.insert_or_replace(i, std::vector<int>(3, i));
+        }
+        std::vector<int> big_value(1000, 42);
+        const int* big_data = big_value.data();
+        const VectorMap updated = vectors.update(37, std::move(big_value));
+        assert(updated.find(37)->data() == big_data);
+        assert(*vectors.find(37) == std::vector<int>(3, 37));
+        assert(get_height(updated.get_tree()) == get_height(vectors.get_tree()));
+        assert(updated.get_tree()->get_left() == vectors.get_tree()->get_left()
+            || updated.get_tree()->get_right() == vectors.get_tree()->get_right());
+        cout << "map size = " << map.size() << ", versions = " << versions.size() << endl << endl;
+    }
+    {
+        // Snapshots of many versions: each distinct node is written once, and sharing survives a reload.
+        vector<CustomTree::TreePtr> versions;
+        CustomTree::TreePtr tree;
+        for (int i = 0; i < 2000; i++) {
+            tree = insert_or_replace(tree, CustomTree::cmp_finder(rand() % 5000), i);
+            if (i % 20 == 0) {
+                versions.push_back(tree);
+            }
+        }
+        versions.push_back(nullptr);
+
+        ostringstream out;
+        SnapshotWriter<CustomTree> writer(out);
+        for (const CustomTree::TreePtr& version : versions) {
+            writer.add_version(version);
+        }
+        writer.finish();
+        const string bytes = out.str();
+
+        // Distinct nodes across all versions, by pointer identity.
+        set<CustomTree*> distinct;
+        std::function<void (CustomTree*)> collect = [&](CustomTree* node) {
+            if (node != nullptr && distinct.insert(node).second) {
+                collect(node->get_left().get());
+                collect(node->get_right().get());
+            }
+        };
+        for (const CustomTree::TreePtr& version : versions) {
+            collect(version.get());
+        }
+        int total_nodes = 0;
+        for (const CustomTree::TreePtr& version : versions) {
+            total_nodes += get_size(version);
+        }
+        cout << "snapshot of " << versions.size() << " versions (" << total_nodes << " nodes in all): "
+            << writer.get_num_nodes() << " distinct nodes in " << bytes.size() << " bytes" << endl;
+        assert(writer.get_num_nodes() == distinct.size());
+        assert(bytes.size() < distinct.size() * (sizeof(int) + 8) + 1000);
+
+        istringstream in(bytes);
+        const vector<CustomTree::TreePtr> reloaded = read_snapshot<CustomTree>(in);
+        assert(reloaded.size() == versions.size());
+        for (size_t i = 0; i < versions.size(); i++) {
+            assert(to_vector(reloaded[i]) == to_vector(versions[i]));
+            assert(get_height(reloaded[i]) == get_height(versions[i]));
+        }
+        distinct.clear();
+        for (const CustomTree::TreePtr& version : reloaded) {
+            collect(version.get());
+        }
+        assert(writer.get_num_nodes() == distinct.size());
+
+        // Contents with a codec of their own.
+        typedef UsableTree<string> StringTree;
+        StringTree::TreePtr words = StringTree::construct_from_vector({"apple", "banana", "cherry", ""});
+        ostringstream string_out;
+        write_snapshot(string_out, vector<StringTree::TreePtr>{words, remove(words, StringTree::index_finder(1))}, StringCodec());
+        istringstream string_in(string_out.str());
+        const vector<StringTree::TreePtr> reloaded_words = read_snapshot<StringTree>(string_in, StringCodec());
+        assert(find(reloaded_words[0], StringTree::index_finder(1))->get_content() == "banana");
+        assert(get_size(reloaded_words[1]) == 3);
+
+        // A corrupt string length throws instead of allocating whatever it says.
+        string huge_length = string(SerializationDetail::SNAPSHOT_MAGIC, sizeof(SerializationDetail::SNAPSHOT_MAGIC));
+        huge_length += char(SerializationDetail::NODE_RECORD);
+        huge_length += string(2, '\0'); // No children.
+        huge_length += "\xff\xff\xff\xff\xff\xff\xff\x01hello"; // A length of about 2^56.
+        bool threw_on_length = false;
+        try {
+            istringstream in(huge_length);
+            read_snapshot<StringTree>(in, StringCodec());
+        } catch (const std::runtime_error&) {
+            threw_on_length = true;
+        }
+        assert(threw_on_length);
+
+        bool threw = false;
+        try {
+            istringstream truncated(bytes.substr(0, bytes.size() / 2));
+            read_snapshot<CustomTree>(truncated);
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        assert(threw);
+
+        // Writing to a full disk throws, at the latest when finish() flushes.
+        threw = false;
+        try {
+            ofstream full("/dev/full", ios::binary);
+            write_snapshot(full, vector<CustomTree::TreePtr>{tree});
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        assert(threw);
+        cout << endl;
+    }
+    {
+        // An append-only log: each commit appends only the nodes that are new, even across reopens.
+        const string path = "/tmp/persistent_avl_tree_test.log";
+        const string compacted_path = path + ".compacted";
+        std::remove(path.c_str());
+        vector<vector<int>> expected;
+        {
+            TreeLog<CustomTree> log(path, false);
+            assert(log.get_num_versions() == 0);
+            vector<int> keys;
+            for (int i = 0; i < 4096; i++) {
+                keys.push_back(2 * i);
+            }
+            log.commit(CustomTree::construct_from_vector(keys));
+            expected.push_back(keys);
+            const std::uint64_t base_size = log.get_file_size();
+
+            CustomTree::TreePtr tree = log.get_version(0);
+            for (int i = 0; i < 50; i++) {
+                const std::uint64_t size_before = log.get_file_size();
+                tree = insert_or_replace(tree, CustomTree::cmp_finder(2 * (rand() % 4096) + 1), i);
+                assert(log.commit(tree) == i + 1);
+                expected.push_back(to_vector(tree));
+                assert(log.get_file_size() - size_before < std::uint64_t(16 * get_height(tree)));
+            }
+            cout << "log: base of 4096 nodes = " << base_size << " bytes, 50 commits of one insert = "
+                << log.get_file_size() - base_size << " bytes" << endl;
+        }
+        {
+            TreeLog<CustomTree> log(path, false);
+            assert(log.get_num_versions() == int(expected.size()));
+            for (int i = 0; i < log.get_num_versions(); i++) {
+                assert(to_vector(log.get_version(i)) == expected[i]);
+            }
+            // Built from nodes read back from the log, so only the new path is appended.
+            const std::uint64_t size_before = log.get_file_size();
+            const CustomTree::TreePtr tree = remove(log.get_version(log.get_num_versions() - 1), CustomTree::cmp_finder(0));
+            log.commit(tree);
+            expected.push_back(to_vector(tree));
+            assert(log.get_file_size() - size_before < std::uint64_t(16 * get_height(tree)));
+        }
+        {
+            // A commit cut short (e.g. by a crash) is dropped on reopen.
+            TreeLog<CustomTree> log(path, false);
+            log.commit(insert_or_replace(log.get_version(0), CustomTree::cmp_finder(-1), -1));
+            assert(truncate(path.c_str(), off_t(log.get_file_size() - 3)) == 0);
+        }
+        {
+            TreeLog<CustomTree> log(path, false);
+            assert(log.get_num_versions() == int(expected.size()));
+            const std::uint64_t committed_size = log.get_file_size();
+            struct stat st;
+            assert(stat(path.c_str(), &st) == 0 && std::uint64_t(st.st_size) == committed_size);
+            log.commit(log.get_version(3));
+            expected.push_back(expected[3]);
+        }
+        {
+            // Compaction keeps only the nodes of the versions kept, and leaves the log it reads as it was (even a
+            // commit cut short at its end).
+            {
+                TreeLog<CustomTree> log(path, false);
+                log.commit(insert_or_replace(log.get_version(0), CustomTree::cmp_finder(-1), -1));
+                assert(truncate(path.c_str(), off_t(log.get_file_size() - 3)) == 0);
+            }
+            const string log_bytes = read_file(path);
+            write_file(compacted_path, "an older file, replaced whole");
+            TreeLog<CustomTree>::compact(path, compacted_path, {int(expected.size()) - 1, 0});
+            assert(read_file(path) == log_bytes);
+
+            // Not into the log itself, by whatever name.
+            const string link_path = path + ".link";
+            for (int use_symlink = 0; use_symlink < 2; use_symlink++) {
+                std::remove(link_path.c_str());
+                assert((use_symlink ? symlink(path.c_str(), link_path.c_str()) : link(path.c_str(), link_path.c_str())) == 0);
+                bool threw = false;
+                try {
+                    TreeLog<CustomTree>::compact(path, link_path, {0});
+                } catch (const std::runtime_error&) {
+                    threw = true;
+                }
+                assert(threw);
+                assert(read_file(path) == log_bytes);
+            }
+            std::remove(link_path.c_str());
+            TreeLog<CustomTree> full(path, false);
+            TreeLog<CustomTree> compacted(compacted_path, false);
+            assert(compacted.get_num_versions() == 2);
+            assert(to_vector(compacted.get_version(0)) == expected.back());
+            assert(to_vector(compacted.get_version(1)) == expected[0]);
+            cout << "log: " << full.get_num_nodes() << " nodes, " << full.get_file_size() << " bytes; compacted to 2 versions: "
+                << compacted.get_num_nodes() << " nodes, " << compacted.get_file_size() << " bytes" << endl << endl;
+            assert(compacted.get_num_nodes() < full.get_num_nodes());
+        }
+        {
+            // Damage anywhere before the last commit is not mistaken for a commit cut short.
+            string log_bytes = read_file(path);
+            log_bytes[log_bytes.size() / 2] ^= 0x10;
+            write_file(path, log_bytes);
+            bool threw = false;
+            try {
+                TreeLog<CustomTree> log(path, false);
+            } catch (const std::runtime_error&) {
+                threw = true;
+            }
+            assert(threw);
+            assert(read_file(path) == log_bytes);
+        }
+        std::remove(path.c_str());
+        std::remove(compacted_path.c_str());
+    }
+    {
+        // A log only keeps the last version committed (and the last one read) in memory, not every version.
+        typedef CountedTree<SharedHandles> Tree;
+        const string path = "/tmp/persistent_avl_tree_test_memory.log";
+        std::remove(path.c_str());
+        {
+            TreeLog<Tree> log(path, false);
+            for (int i = 0; i < 100; i++) {
+                vector<int> keys;
+                for (int j = 0; j < 100; j++) {
+                    keys.push_back(i * 100 + j);
+                }
+                log.commit(Tree::construct_from_vector(keys));
+            }
+        }
+        assert(Tree::num_alive == 0);
+        {
+            TreeLog<Tree> log(path, false);
+            assert(log.get_num_versions() == 100 && log.get_num_nodes() == 100 * 100);
+            assert(Tree::num_alive == 100);
+            const Tree::TreePtr first = log.get_version(0);
+            assert(Tree::num_alive == 200);
+            assert(to_vector(first).front() == 0 && to_vector(log.get_version(99)).back() == 9999);
+            log.commit(first); // Now first is the last version committed, and the one before it can go.
+            cout << "log: " << log.get_num_nodes() << " nodes on disk, " << Tree::num_alive << " in memory" << endl << endl;
+            assert(Tree::num_alive == 100);
+        }
+        assert(Tree::num_alive == 0);
+        std::remove(path.c_str());
+    }
+    {
+        // A rollback: a version made from an older version than the last one committed only appends its new nodes.
+        const string path = "/tmp/persistent_avl_tree_test_rollback.log";
+        std::remove(path.c_str());
+        TreeLog<CustomTree> log(path, false);
+        vector<int> keys;
+        for (int i = 0; i < 10000; i++) {
+            keys.push_back(2 * i);
+        }
+        log.commit(CustomTree::construct_from_vector(keys));
+        log.commit(nullptr);
+        const std::uint64_t num_nodes_before = log.get_num_nodes();
+        const CustomTree::TreePtr tree = insert_or_replace(log.get_version(0), CustomTree::cmp_finder(1), 1);
+        log.commit(tree);
+        cout << "log: a rollback of one insert appended " << log.get_num_nodes() - num_nodes_before << " nodes" << endl << endl;
+        assert(log.get_num_nodes() - num_nodes_before < std::uint64_t(2 * get_height(tree)));
+        std::remove(path.c_str());
+    }
+    {
+        // PersistentSequence, checked against a vector.
+        typedef PersistentSequence<int> Seq;
+        Seq seq;
+        vector<int> expected;
+        vector<pair<Seq, vector<int>>> versions;
+        for (int i = 0; i < 2000; i++) {
+            const int size = seq.size();
+            const int start = rand() % (size + 1);
+            const int end = start + rand() % (size - start + 1);
+            switch (rand() % 4) {
+                case 0: {
+                    const Seq piece = seq.slice(start, end);
+                    assert(piece.to_vector() == vector<int>(expected.begin() + start, expected.begin() + end));
+                    const int at = rand() % (size + 1);
+                    seq = seq.insert_range_at(at, piece.concat(Seq(vector<int>{i})));
+                    vector<int> inserted(expected.begin() + start, expected.begin() + end);
+                    inserted.push_back(i);
+                    expected.insert(expected.begin() + at, inserted.begin(), inserted.end());
+                    break;
+                }
+                case 1:
+                    seq = seq.erase_range(start, end);
+                    expected.erase(expected.begin() + start, expected.begin() + end);
+                    break;
+                default:
+                    seq = seq.insert_at(start, i);
+                    expected.insert(expected.begin() + start, i);
+                    break;
+            }
+            if (i % 200 == 0) {
+                versions.push_back(make_pair(seq, expected));
+            }
+        }
+        assert(seq.to_vector() == expected);
+        assert(is_balanced_recursively(seq.get_tree()));
+        for (const auto& version : versions) {
+            assert(version.first.to_vector() == version.second);
+        }
+        assert(vector<int>(seq.begin(), seq.end()) == expected);
+        if (!expected.empty()) {
+            assert(seq.at(int(expected.size()) - 1) == expected.back());
+        }
+
+        // PersistentRope, checked against a string.
+        typedef PersistentRope<char, 16> Rope;
+        string text;
+        for (int i = 0; i < 1000; i++) {
+            text += char('a' + rand() % 26);
+        }
+        Rope rope(text);
+        const Rope original = rope;
+        string expected_text = text;
+        for (int i = 0; i < 2000; i++) {
+            const int length = rope.length();
+            const int start = rand() % (length + 1);
+            const int end = start + rand() % min(length - start + 1, 40);
+            switch (rand() % 3) {
+                case 0: {
+                    const int at = rand() % (length + 1);
+                    rope = rope.insert_range_at(at, rope.slice(start, end));
+                    expected_text.insert(at, expected_text.substr(start, end - start));
+                    break;
+                }
+                case 1:
+                    rope = rope.erase_range(start, end);
+                    expected_text.erase(start, end - start);
+                    break;
+                default: {
+                    const string word(1 + rand() % 5, char('A' + rand() % 26));
+                    rope = rope.insert_range_at(start, Rope(word));
+                    expected_text.insert(start, word);
+                    break;
+                }
+            }
+        }
+        assert(rope.to_string() == expected_text);
+        assert(original.to_string() == text);
+        assert(is_balanced_recursively(rope.get_tree()));
+        for (int trial = 0; trial < 100 && !expected_text.empty(); trial++) {
+            const int pos = rand() % int(expected_text.size());
+            assert(rope.at(pos) == expected_text[pos]);
+            const pair<Rope, Rope> parts = rope.split_at(pos);
+            assert(parts.first.to_string() == expected_text.substr(0, pos));
+            assert(parts.second.to_string() == expected_text.substr(pos));
+        }
+        // Seams are merged, so small edits don't leave the rope mostly tiny chunks.
+        cout << "rope length = " << rope.length() << " in " << rope.num_chunks() << " chunks" << endl << endl;
+        assert(rope.num_chunks() <= rope.length() / 4);
+
+        bool threw = false;
+        try { rope.slice(0, rope.length() + 1); } catch (const std::runtime_error&) { threw = true; }
+        assert(threw);
+    }
+
+
+    {
+        // PersistentBTree, with small nodes so that there are many levels. Checked against a std::set.
+        typedef PersistentBTree<int, ThreeWayLess, 4, 4> BTree;
+        BTree::TreePtr tree = BTree::construct_from_vector({1, 3, 5, 7, 9, 11, 13, 15, 17, 19, 21});
+        assert(BTree::is_valid(tree));
+        assert(BTree::get_height(tree) == 2);
+        set<int> expected = {1, 3, 5, 7, 9, 11, 13, 15, 17, 19, 21};
+
+        std::vector<BTree::TreePtr> versions;
+        std::vector<set<int>> expected_versions;
+        for (int i = 0; i < 3000; i++) {
+            const int key = rand() % 500;
+            if (rand() % 3 == 0 && expected.count(key)) {
+                tree = BTree::remove(tree, key);
+                expected.erase(key);
+            } else {
+                tree = BTree::insert_or_replace(tree, key);
+                expected.insert(key);
+            }
+            assert(BTree::is_valid(tree));
+            if (i % 100 == 0) {
+                versions.push_back(tree);
+                expected_versions.push_back(expected);
+            }
+        }
+        const std::vector<int> expected_vec(expected.begin(), expected.end());
+        assert(BTree::to_vector(tree) == expected_vec);
+        assert(BTree::get_size(tree) == int(expected.size()));
+        for (int i = 0; i < int(expected_vec.size()); i++) {
+            assert(BTree::at(tree, i) == expected_vec[i]);
+            int num_to_left = 0;
+            const int* found = BTree::find(tree, expected_vec[i], &num_to_left);
+            assert(found != nullptr && *found == expected_vec[i] && num_to_left == i);
+        }
+        assert(BTree::find(tree, -1) == nullptr);
+        assert(BTree::find(tree, 1000) == nullptr);
+        for (int i = 0; i < int(versions.size()); i++) {
+            assert(BTree::to_vector(versions[i]) == std::vector<int>(expected_versions[i].begin(), expected_versions[i].end()));
+        }
+        cout << "btree size = " << BTree::get_size(tree) << ", height = " << BTree::get_height(tree) << endl;
+
+        bool threw = false;
+        try { BTree::insert_or_replace(tree, expected_vec[0], THROW_IF_FOUND); } catch (const std::runtime_error&) { threw = true; }
+        assert(threw);
+        threw = false;
+        try { BTree::insert_or_replace(tree, -1, REPLACE_ONLY); } catch (const std::runtime_error&) { threw = true; }
+        assert(threw);
+        threw = false;
+        try { BTree::remove(tree, -1); } catch (const std::runtime_error&) { threw = true; }
+        assert(threw);
+        threw = false;
+        try { BTree::at(tree, BTree::get_size(tree)); } catch (const std::runtime_error&) { threw = true; }
+        assert(threw);
+
+        // Remove everything again.
+        for (int key : expected_vec) {
+            tree = BTree::remove(tree, key);
+            assert(BTree::is_valid(tree));
+        }
+        assert(tree == nullptr);
+
+        // A non-int entry type uses the generic (binary search) path.
+        typedef PersistentBTree<string> StringBTree;
+        StringBTree::TreePtr strings;
+        for (const char* s : {"pear", "apple", "fig", "kiwi", "banana"}) {
+            strings = StringBTree::insert_or_replace(strings, s);
+        }
+        assert(StringBTree::to_vector(strings) == std::vector<string>({"apple", "banana", "fig", "kiwi", "pear"}));
+        assert(StringBTree::find(strings, string("fig")) != nullptr);
+        assert(StringBTree::find(strings, string("grape")) == nullptr);
+        cout << endl;
+    }
+
+
+    // No vtable, so a node is just its content, children, size and height.
+    assert(!std::is_polymorphic<CustomTree>::value);
+    assert(!std::is_polymorphic<UsableTree<int>>::value);
+    cout << "sizeof(CustomTree) = " << sizeof(CustomTree) << endl;
+    assert(sizeof(CustomTree) <= sizeof(int) * 4 + sizeof(CustomTree::TreePtr) * 2);
+    cout << endl;
+
+
+    test_handle_policy<CountedTree<SharedHandles>>("SharedHandles");
+    test_handle_policy<CountedTree<IntrusiveHandles<false>>>("IntrusiveHandles<false>");
+    test_handle_policy<CountedTree<IntrusiveHandles<true>>>("IntrusiveHandles<true>");
+    assert(sizeof(CountedTree<IntrusiveHandles<false>>::TreePtr) == sizeof(void*));
+
+    test_handle_policy<CountedTree<PooledHandles<false>>>("PooledHandles<false>");
+    test_handle_policy<CountedTree<PooledHandles<true>>>("PooledHandles<true>");
+    {
+        // Freed nodes are reused, so building the same tree again doesn't need new slabs.
+        typedef PooledHandles<false>::Pool<CountedTree<PooledHandles<false>>> Pool;
+        const int num_slabs = Pool::num_slabs();
+        test_handle_policy<CountedTree<PooledHandles<false>>>("PooledHandles<false> (again)");
+        assert(Pool::num_slabs() == num_slabs);
+    }
+    test_producer_consumer<PooledTree>("PooledHandles", []() { return PooledHandles<true>::Pool<PooledTree>::num_slabs(); });
+    test_producer_consumer<CompactTree>("CompactHandles", []() { return IndexedNodePool<CompactTree>::num_slabs(); });
+    test_handle_policy<CountedTree<CompactHandles<false>>>("CompactHandles<false>");
+    test_handle_policy<CountedTree<CompactHandles<true>>>("CompactHandles<true>");
+    {
+        // 32-bit handles, and a 24-byte node for int content.
+        typedef CountedTree<CompactHandles<false>> CountedCompactTree;
+        assert(sizeof(CountedCompactTree::TreePtr) == 4);
+        cout << "sizeof(CountedTree<CompactHandles<false>>) = " << sizeof(CountedCompactTree) << endl;
+        assert(sizeof(CountedCompactTree) <= 24);
+
+        const int num_slabs = IndexedNodePool<CountedCompactTree>::num_slabs();
+        test_handle_policy<CountedCompactTree>("CompactHandles<false> (again)");
+        assert(IndexedNodePool<CountedCompactTree>::num_slabs() == num_slabs);
+    }
+    test_handle_policy<CountedTree<MappedHandles<false>>>("MappedHandles<false>");
+    test_handle_policy<CountedTree<MappedHandles<true>>>("MappedHandles<true>");
+    {
+        // A tree written to a file, mapped back and queried in place, with new versions on top of it.
+        typedef CountedTree<MappedHandles<false>> MappedTree;
+        const string path = "/tmp/persistent_avl_tree_test.map";
+        vector<int> keys;
+        for (int i = 0; i < 5000; i++) {
+            keys.push_back(3 * i);
+        }
+        MappedTreeFile<MappedTree>::write(path, MappedTree::construct_from_vector(keys));
+        const int num_alive_after_write = MappedTree::num_alive; // Including the image's nodes, never destroyed.
+        {
+            MappedTreeFile<MappedTree> file(path);
+            const MappedTree::TreePtr base = file.get_root();
+            assert(file.get_num_nodes() == keys.size());
+            assert(base->is_mapped());
+            assert(to_vector(base) == keys);
+            assert(is_balanced_recursively(base));
+            assert(find(base, MappedTree::cmp_finder(2997))->get_content() == 2997);
+            assert(MappedTree::lower_bound(base, 2998)->get_content() == 3000);
+
+            MappedTree::TreePtr tree = base;
+            for (int i = 0; i < 200; i++) {
+                tree = insert_or_replace(tree, MappedTree::cmp_finder(3 * i + 1), 3 * i + 1);
+                tree = remove(tree, MappedTree::cmp_finder(3 * (4999 - i)));
+            }
+            assert(!tree->is_mapped());
+            assert(get_size(tree) == 5000);
+            assert(to_vector(base) == keys); // The mapping is read-only, and was never written.
+            cout << "mapped " << file.get_num_nodes() << " nodes; 400 edits on top made "
+                << MappedTree::num_alive - num_alive_after_write << " heap nodes" << endl;
+            assert(MappedTree::num_alive - num_alive_after_write < 400 * 2 * get_height(base));
+        }
+        assert(MappedTree::num_alive == num_alive_after_write);
+
+        bool threw = false;
+        try { MappedTreeFile<MappedTree> missing(path + ".missing"); } catch (const std::runtime_error&) { threw = true; }
+        assert(threw);
+        std::remove(path.c_str());
+        cout << endl;
+    }
+    {
+        NodeArena arena;
+        {
+            NodeArena::Scope scope(arena);
+            test_handle_policy<CountedTree<ArenaHandles<false>>>("ArenaHandles<false>");
+            assert(arena.get_num_live() == 0);
+
+            // The arena counts the nodes made in it, so that release() can check that none are left.
+            CountedTree<ArenaHandles<false>>::TreePtr tree;
+            for (int i = 0; i < 100; i++) {
+                tree = insert_or_replace(tree, CountedTree<ArenaHandles<false>>::cmp_finder(i), i);
+            }
+            assert(arena.get_num_live() == 100);
+            tree = nullptr;
+            assert(arena.get_num_live() == 0);
+        }
+        cout << "arena num_slabs = " << arena.num_slabs() << endl;
+        assert(arena.num_slabs() > 0);
+        arena.release();
+        assert(arena.num_slabs() == 0);
+
+        bool threw = false;
+        try {
+            make_tree<CountedTree<ArenaHandles<false>>>(1, nullptr, nullptr);
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        assert(threw);
+        cout << endl;
+    }
+
+
     cout << "Done" << endl;
     return 0;
 }
@@ -0,0 +1,304 @@
+#pragma once
+
+#include "persistent_avl_tree.h"
+
+#include <algorithm>
+#include <future>
+#include <thread>
+#include <utility>
+
+
+/*
+ * Bulk set operations on trees sorted by cmp (a three-way comparator, as for cmp_finder()).
+ *
+ * Each one splits one tree by the root of the other and recurses on both sides, then joins the
+ * results back together: O(m log(n/m + 1)) work for trees of sizes m <= n. The two sides run
+ * in parallel when there are at least grain_size nodes between them, and whole subtrees that
+ * are pointer-identical in both trees are handled without walking them.
+ *
+ * Trees whose HandlePolicy doesn't allow concurrent_make are always done on the calling thread.
+ */
+
+namespace TreeOps {
+
+    constexpr int DEFAULT_SET_OP_GRAIN_SIZE = 4096;
+
+    namespace detail {
+
+        template<typename Compare>
+        struct SetOpContext {
+            Compare cmp;
+            int grain_size;
+        };
+
+        // How many levels of the recursion may still fork: about twice as many tasks as cores.
+        inline int max_fork_depth() {
+            int depth = 1;
+            for (unsigned n = std::thread::hardware_concurrency(); n > 1; n /= 2) {
+                depth++;
+            }
+            return depth;
+        }
+
+        // For trees that don't keep sizes, a balanced tree of height h has somewhere between 1.6^h and 2^h nodes.
+        template<typename TreePtr>
+        int approx_size(const TreePtr& tree) {
+            if (TreePtr::element_type::keeps_size) {
+                return TreeOps::get_size(tree);
+            }
+            return (1 << std::min(30, TreeOps::get_height(tree))) / 2;
+        }
+
+        template<typename TreePtr, typename Compare>
+        bool should_fork(const SetOpContext<Compare>& context, const TreePtr& a, const TreePtr& b, int fork_depth) {
+            return TreePtr::element_type::HandlePolicyT::concurrent_make
+                && fork_depth > 0
+                && approx_size(a) + approx_size(b) >= context.grain_size;
+        }
+
+        // Runs both functions, the second one on another thread if fork is true.
+        template<typename Func1, typename Func2>
+        void fork_join(bool fork, Func1&& func1, Func2&& func2) {
+            if (!fork) {
+                func1();
+                func2();
+                return;
+            }
+            std::future<void> other = std::async(std::launch::async, std::forward<Func2>(func2));
+            func1();
+            other.get();
+        }
+
+        template<typename TreePtr, typename Compare>
+        std::pair<TreePtr, TreePtr> split_by(
+            const SetOpContext<Compare>& context,
+            const TreePtr& tree,
+            const TreePtr& pivot_node,
+            TreePtr* found_node = nullptr
+        ) {
+            typedef typename TreePtr::element_type Tree;
+            return Tree::split(tree, Tree::cmp_finder(pivot_node->get_content(), context.cmp), 0, found_node);
+        }
+
+        template<typename TreePtr, typename Compare>
+        TreePtr set_union(const SetOpContext<Compare>& context, const TreePtr& a, const TreePtr& b, int fork_depth) {
+            typedef typename TreePtr::element_type Tree;
+            if (a == nullptr) { return b; }
+            if (b == nullptr) { return a; }
+            if (a == b) { return a; }
+
+            TreePtr found_node;
+            const std::pair<TreePtr, TreePtr> b_parts = split_by(context, b, a, &found_node);
+
+            TreePtr left;
+            TreePtr right;
+            fork_join(
+                should_fork(context, a, b, fork_depth),
+                [&]() { left = set_union(context, a->get_left(), b_parts.first, fork_depth - 1); },
+                [&]() { right = set_union(context, a->get_right(), b_parts.second, fork_depth - 1); }
+            );
+            return Tree::join(left, (found_node != nullptr) ? found_node->get_content() : a->get_content(), right);
+        }
+
+        template<typename TreePtr, typename Compare>
+        TreePtr set_intersection(const SetOpContext<Compare>& context, const TreePtr& a, const TreePtr& b, int fork_depth) {
+            typedef typename TreePtr::element_type Tree;
+            if (a == nullptr || b == nullptr) { return nullptr; }
+            if (a == b) { return a; }
+
+            TreePtr found_node;
+            const std::pair<TreePtr, TreePtr> b_parts = split_by(context, b, a, &found_node);
+
+            TreePtr left;
+            TreePtr right;
+            fork_join(
+                should_fork(context, a, b, fork_depth),
+                [&]() { left = set_intersection(context, a->get_left(), b_parts.first, fork_depth - 1); },
+                [&]() { right = set_intersection(context, a->get_right(), b_parts.second, fork_depth - 1); }
+            );
+            if (found_node != nullptr) {
+                return Tree::join(left, a->get_content(), right);
+            } else {
+                return Tree::join2(left, right);
+            }
+        }
+
+        template<typename TreePtr, typename Compare>
+        TreePtr set_difference(const SetOpContext<Compare>& context, const TreePtr& a, const TreePtr& b, int fork_depth) {
+            typedef typename TreePtr::element_type Tree;
+            if (a == nullptr || a == b) { return nullptr; }
+            if (b == nullptr) { return a; }
+
+            // Split a by the root of b, which is never in the result.
+            const std::pair<TreePtr, TreePtr> a_parts = split_by(context, a, b);
+
+            TreePtr left;
+            TreePtr right;
+            fork_join(
+                should_fork(context, a, b, fork_depth),
+                [&]() { left = set_difference(context, a_parts.first, b->get_left(), fork_depth - 1); },
+                [&]() { right = set_difference(context, a_parts.second, b->get_right(), fork_depth - 1); }
+            );
+            return Tree::join2(left, right);
+        }
+
+        template<typename TreePtr, typename Compare>
+        TreePtr set_symmetric_difference(const SetOpContext<Compare>& context, const TreePtr& a, const TreePtr& b, int fork_depth) {
+            typedef typename TreePtr::element_type Tree;
+            if (a == b) { return nullptr; }
+            if (a == nullptr) { return b; }
+            if (b == nullptr) { return a; }
+
+            TreePtr found_node;
+            const std::pair<TreePtr, TreePtr> b_parts = split_by(context, b, a, &found_node);
+
+            TreePtr left;
+            TreePtr right;
+            fork_join(
+                should_fork(context, a, b, fork_depth),
+                [&]() { left = set_symmetric_difference(context, a->get_left(), b_parts.first, fork_depth - 1); },
+                [&]() { right = set_symmetric_difference(context, a->get_right(), b_parts.second, fork_depth - 1); }
+            );
+            if (found_node != nullptr) {
+                return Tree::join2(left, right);
+            } else {
+                return Tree::join(left, a->get_content(), right);
+            }
+        }
+
+        // Whether two versions of one entry (nullptr if absent) are the same.
+        template<typename NodeContent>
+        bool same_entry(const NodeContent* a, const NodeContent* b) {
+            return (a == nullptr || b == nullptr) ? (a == b) : (*a == *b);
+        }
+
+        template<typename TreePtr, typename Compare, typename ConflictFunc>
+        TreePtr merge3(
+            const SetOpContext<Compare>& context,
+            ConflictFunc& conflict_func,
+            const TreePtr& base,
+            const TreePtr& ours,
+            const TreePtr& theirs,
+            int fork_depth
+        ) {
+            typedef typename TreePtr::element_type Tree;
+            typedef typename Tree::NodeContentT NodeContent;
+            // Whole subtrees only one side changed (or both changed the same way) are taken as they are.
+            if (ours == theirs || theirs == base) { return ours; }
+            if (ours == base) { return theirs; }
+
+            // Split the other two trees by the root of ours (or of theirs, if ours is empty here).
+            const bool pivot_is_ours = (ours != nullptr);
+            const TreePtr& pivot_node = pivot_is_ours ? ours : theirs;
+            TreePtr base_found;
+            TreePtr ours_found = ours;
+            TreePtr theirs_found = theirs;
+            const std::pair<TreePtr, TreePtr> base_parts = split_by(context, base, pivot_node, &base_found);
+            const std::pair<TreePtr, TreePtr> ours_parts = pivot_is_ours
+                ? std::make_pair(ours->get_left(), ours->get_right())
+                : split_by(context, ours, pivot_node, &ours_found);
+            const std::pair<TreePtr, TreePtr> theirs_parts = pivot_is_ours
+                ? split_by(context, theirs, pivot_node, &theirs_found)
+                : std::make_pair(theirs->get_left(), theirs->get_right());
+
+            TreePtr left;
+            TreePtr right;
+            fork_join(
+                should_fork(context, ours, theirs, fork_depth),
+                [&]() { left = merge3(context, conflict_func, base_parts.first, ours_parts.first, theirs_parts.first, fork_depth - 1); },
+                [&]() { right = merge3(context, conflict_func, base_parts.second, ours_parts.second, theirs_parts.second, fork_depth - 1); }
+            );
+
+            // Now the entry at the pivot itself.
+            const NodeContent* base_content = (base_found != nullptr) ? &base_found->get_content() : nullptr;
+            const NodeContent* ours_content = (ours_found != nullptr) ? &ours_found->get_content() : nullptr;
+            const NodeContent* theirs_content = (theirs_found != nullptr) ? &theirs_found->get_content() : nullptr;
+            const NodeContent* merged_content;
+            NodeContent resolved;
+            if (same_entry(base_content, ours_content)) {
+                merged_content = theirs_content;
+            } else if (same_entry(base_content, theirs_content) || same_entry(ours_content, theirs_content)) {
+                merged_content = ours_content;
+            } else {
+                merged_content = conflict_func(base_content, ours_content, theirs_content, &resolved) ? &resolved : nullptr;
+            }
+            return (merged_content != nullptr) ? Tree::join(left, *merged_content, right) : Tree::join2(left, right);
+        }
+
+    }
+
+    /*
+     * Three-way merge of two versions, ours and theirs, that were both edited from base.
+     *
+     * For each entry (by cmp), a change made on only one side is kept, as is one made the same way on both
+     * (an entry is changed if it was added, removed, or is no longer == to the one in base). Where they made
+     * different changes, conflict_func(base, ours, theirs, merged) decides: each is nullptr if the entry isn't
+     * there, and it returns true to keep *merged (which it must set), or false to leave the entry out.
+     * conflict_func may be called from several threads at once (see grain_size).
+     *
+     * All three trees are descended together, splitting and joining as for set_union(), and any subtree that
+     * is the same node in base and one side (or in both sides) is taken whole, so the work is about
+     * O(d log^2 n) for d changed entries. The result is balanced, and shares every untouched subtree.
+     */
+    template<typename TreePtr, typename ConflictFunc, typename Compare = ThreeWayLess>
+    TreePtr merge3(
+        const TreePtr& base,
+        const TreePtr& ours,
+        const TreePtr& theirs,
+        ConflictFunc conflict_func,
+        Compare cmp = Compare(),
+        int grain_size = DEFAULT_SET_OP_GRAIN_SIZE
+    ) {
+        const detail::SetOpContext<Compare> context{cmp, grain_size};
+        return detail::merge3(context, conflict_func, base, ours, theirs, detail::max_fork_depth());
+    }
+
+    // Every node in a or b. Where both have an equal node, the one from b is kept.
+    template<typename TreePtr, typename Compare = ThreeWayLess>
+    TreePtr set_union(
+        const TreePtr& a,
+        const TreePtr& b,
+        Compare cmp = Compare(),
+        int grain_size = DEFAULT_SET_OP_GRAIN_SIZE
+    ) {
+        const detail::SetOpContext<Compare> context{cmp, grain_size};
+        return detail::set_union(context, a, b, detail::max_fork_depth());
+    }
+
+    // Every node in a that has an equal node in b.
+    template<typename TreePtr, typename Compare = ThreeWayLess>
+    TreePtr set_intersection(
+        const TreePtr& a,
+        const TreePtr& b,
+        Compare cmp = Compare(),
+        int grain_size = DEFAULT_SET_OP_GRAIN_SIZE
+    ) {
+        const detail::SetOpContext<Compare> context{cmp, grain_size};
+        return detail::set_intersection(context, a, b, detail::max_fork_depth());
+    }
+
+    // Every node in a that has no equal node in b.
+    template<typename TreePtr, typename Compare = ThreeWayLess>
+    TreePtr set_difference(
+        const TreePtr& a,
+        const TreePtr& b,
+        Compare cmp = Compare(),
+        int grain_size = DEFAULT_SET_OP_GRAIN_SIZE
+    ) {
+        const detail::SetOpContext<Compare> context{cmp, grain_size};
+        return detail::set_difference(context, a, b, detail::max_fork_depth());
+    }
+
+    // Every node in exactly one of a and b.
+    template<typename TreePtr, typename Compare = ThreeWayLess>
+    TreePtr set_symmetric_difference(
+        const TreePtr& a,
+        const TreePtr& b,
+        Compare cmp = Compare(),
+        int grain_size = DEFAULT_SET_OP_GRAIN_SIZE
+    ) {
+        const detail::SetOpContext<Compare> context{cmp, grain_size};
+        return detail::set_symmetric_difference(context, a, b, detail::max_fork_depth());
+    }
+
+}
@@ -0,0 +1,289 @@
+#pragma once
+
+#include "persistent_avl_tree.h"
+
+#include <atomic>
+#include <cassert>
+#include <stdexcept>
+#include <utility>
+
+
+/*
+ * An editing session on a tree, for long runs of updates (e.g. bulk construction).
+ *
+ * The session owns every node it creates, and until freeze() nobody else can see them, so it
+ * updates them in place instead of copying them again. Nodes it didn't create (i.e. nodes of the
+ * tree it started from, which other versions may share) are copied the first time they change,
+ * exactly as in persistent updates. So every version outside the session stays unchanged.
+ *
+ * Ownership is marked in the nodes themselves: each session has an edit token (a byte), and the
+ * nodes it creates carry it, so checking a node is one compare. Nodes outside any session carry 0.
+ *
+ * freeze() hands out the current tree as an ordinary TreePtr. The session then gives up ownership
+ * of its nodes (setting their tokens back to 0), so editing on afterwards copies them like any
+ * other shared node. Owned nodes only ever hang under other owned nodes, so this visits only them.
+ * Since no session can reach another's nodes before they are frozen, tokens may repeat across
+ * sessions.
+ *
+ * Not thread-safe. NodeContent must be copy-assignable.
+ */
+template<typename TreeType>
+class TransientTree {
+    public:
+        typedef typename TreeType::TreePtr TreePtr;
+        typedef typename TreeType::NodeContentT NodeContent;
+
+        explicit TransientTree(const TreePtr& root = nullptr): root(root), token(new_token()) {}
+
+        TransientTree(const TransientTree&) = delete;
+        TransientTree& operator=(const TransientTree&) = delete;
+
+        int get_size() const { return TreeOps::get_size(root); }
+
+        // Returns the current tree. Later edits in this session won't change it.
+        TreePtr freeze() {
+            disown(root);
+            return root;
+        }
+
+        // Like AvlTree::insert_or_replace().
+        template<typename Finder>
+        void insert_or_replace(
+            Finder&& finder_func,
+            const NodeContent& new_content,
+            InsertOrReplaceMode mode = REPLACE_IF_FOUND
+        );
+
+        // Like AvlTree::remove(). Throws if item does not exist.
+        template<typename Finder>
+        void remove(
+            Finder&& finder_func,
+            NodeContent* removed_content = nullptr // If non-null, will be set to the content of the node that was removed.
+        );
+
+    private:
+        // One step of a path: the handle we went through (in root or in an owned node), and which child we went to next.
+        struct PathStep {
+            TreePtr* slot;
+            int direction;
+        };
+
+        static unsigned char new_token() {
+            static std::atomic<unsigned> num_sessions(0);
+            return (unsigned char)(num_sessions.fetch_add(1, std::memory_order_relaxed) % 255 + 1); // Never 0.
+        }
+
+        bool is_owned(const TreePtr& node) const { return node->edit_token == token; }
+
+        TreePtr make_owned(const NodeContent& content, const TreePtr& left, const TreePtr& right) {
+            TreePtr node = TreeOps::make_tree<TreeType>(content, left, right);
+            node->edit_token = token;
+            return node;
+        }
+
+        // Gives up node and every owned node below it.
+        void disown(const TreePtr& node) {
+            if (node == nullptr || !is_owned(node)) {
+                return;
+            }
+            node->edit_token = 0;
+            disown(node->left);
+            disown(node->right);
+        }
+
+        // Makes sure *slot is a node we own, copying it if it isn't.
+        void own(TreePtr* slot) {
+            if (!is_owned(*slot)) {
+                *slot = make_owned((*slot)->get_content(), (*slot)->get_left(), (*slot)->get_right());
+            }
+        }
+
+        void rotate(TreePtr* slot, int left_or_right);
+        void balance(TreePtr* slot);
+        void rebuild_path(PathStep* path, int path_length);
+
+        TreePtr root;
+        const unsigned char token;
+};
+
+
+// Class method implementations defined here:
+// --------------------------------------------------
+
+// (instance method)
+template<typename TreeType>
+void TransientTree<TreeType>::rotate(TreePtr* slot, int left_or_right) {
+    assert(left_or_right != 0);
+
+    // Written assuming RIGHT rotation, i.e. that left_or_right == 1. Same shape as AvlTree::rotate().
+    const int left = -left_or_right;
+    const int right = left_or_right;
+
+    TreePtr node4 = std::move(*slot);
+    assert(is_owned(node4));
+    TreePtr& node4_left = node4->get_mutable_child(left);
+    assert(node4_left != nullptr);
+    own(&node4_left);
+
+    TreePtr node2 = std::move(node4_left);
+    node4_left = std::move(node2->get_mutable_child(right)); // subtree3
+    node4->update_augmentation();
+    node2->get_mutable_child(right) = std::move(node4);
+    node2->update_augmentation();
+    *slot = std::move(node2);
+}
+
+// (instance method)
+template<typename TreeType>
+void TransientTree<TreeType>::balance(TreePtr* slot) {
+    const TreePtr& self = *slot;
+    if (self == nullptr || TreeOps::is_balanced(self)) {
+        return;
+    }
+
+    // Same choice of rotations as AvlTree::balance().
+    const int lh = TreeOps::get_height(self->get_left());
+    const int rh = TreeOps::get_height(self->get_right());
+
+    const int direction = (lh > rh) ? 1 : -1; // Direction of rotation.
+    TreePtr& taller_child = self->get_mutable_child(-direction);
+    assert(taller_child != nullptr);
+
+    const int inner_h = TreeOps::get_height(taller_child->get_child(direction));
+    const int outer_h = TreeOps::get_height(taller_child->get_child(-direction));
+
+    if (inner_h > outer_h) {
+        own(&taller_child);
+        rotate(&taller_child, -direction);
+        self->update_augmentation();
+    }
+    rotate(slot, direction);
+}
+
+// (instance method)
+template<typename TreeType>
+void TransientTree<TreeType>::rebuild_path(PathStep* path, int path_length) {
+    // Every node on the path is already owned, and already points to the (owned) node below it.
+    for (int i = path_length - 1; i >= 0; i--) {
+        (*path[i].slot)->update_augmentation();
+        balance(path[i].slot);
+    }
+}
+
+// (instance method)
+template<typename TreeType>
+template<typename Finder>
+void TransientTree<TreeType>::insert_or_replace(
+    Finder&& finder_func,
+    const NodeContent& new_content,
+    InsertOrReplaceMode mode /* = REPLACE_IF_FOUND */
+) {
+    PathStep path[TreeType::MAX_PATH_LENGTH];
+    int path_length = 0;
+
+    TreePtr* slot = &root;
+
+    // Once we have found a node and are inserting next to it, we keep going this way (like furthest_inserter()).
+    int furthest_direction = 0;
+
+    while (*slot != nullptr) {
+        int direction = (furthest_direction != 0) ? furthest_direction : finder_func(*slot);
+
+        if (direction == 0) {
+            // Node found.
+            if (mode == THROW_IF_FOUND) {
+                throw std::runtime_error("insert_or_replace(): Node found (and mode is THROW_IF_FOUND).");
+            } else if (mode == INSERT_LEFT_IF_FOUND || mode == INSERT_RIGHT_IF_FOUND) {
+                direction = (mode == INSERT_LEFT_IF_FOUND) ? -1 : 1;
+                furthest_direction = -direction;
+            } else if (mode == REPLACE_IF_FOUND || mode == REPLACE_ONLY) {
+                own(slot);
+                (*slot)->content = new_content;
+                rebuild_path(path, path_length);
+                return;
+            } else {
+                assert(false); // Should not get here.
+            }
+        }
+
+        if (path_length == TreeType::MAX_PATH_LENGTH) {
+            throw std::runtime_error("insert_or_replace(): Tree is too tall.");
+        }
+        own(slot);
+        path[path_length++] = PathStep{slot, direction};
+        slot = &(*slot)->get_mutable_child(direction);
+    }
+
+    // Reached an empty spot: new node, unless mode == REPLACE_ONLY.
+    if (mode == REPLACE_ONLY) {
+        throw std::runtime_error("insert_or_replace(): Node not found (and mode is REPLACE_ONLY).");
+    }
+    *slot = make_owned(new_content, nullptr, nullptr);
+    rebuild_path(path, path_length);
+}
+
+// (instance method)
+template<typename TreeType>
+template<typename Finder>
+void TransientTree<TreeType>::remove(
+    Finder&& finder_func,
+    NodeContent* removed_content /* = nullptr */ // If non-null, will be set to the content of the node that was removed.
+) {
+    PathStep path[TreeType::MAX_PATH_LENGTH];
+    int path_length = 0;
+
+    TreePtr* slot = &root;
+
+    while (true) {
+        if (*slot == nullptr) {
+            throw std::runtime_error("remove(): Node not found.");
+        }
+        const int direction = finder_func(*slot);
+        if (direction == 0) {
+            break;
+        }
+        if (path_length == TreeType::MAX_PATH_LENGTH) {
+            throw std::runtime_error("remove(): Tree is too tall.");
+        }
+        own(slot);
+        path[path_length++] = PathStep{slot, direction};
+        slot = &(*slot)->get_mutable_child(direction);
+    }
+
+    // Node found.
+    if (removed_content != nullptr) {
+        *removed_content = (*slot)->get_content();
+    }
+
+    if ((*slot)->get_left() == nullptr || (*slot)->get_right() == nullptr) {
+        TreePtr only_child = ((*slot)->get_left() != nullptr) ? (*slot)->get_left() : (*slot)->get_right();
+        *slot = std::move(only_child);
+        rebuild_path(path, path_length);
+        return;
+    }
+
+    // Remove the rightmost node on the left or the leftmost node on the right. Then move its content into the found node.
+    const int sub_direction = TreeType::bigger_side(*slot);
+
+    TreePtr* found_slot = slot;
+    if (path_length == TreeType::MAX_PATH_LENGTH) {
+        throw std::runtime_error("remove(): Tree is too tall.");
+    }
+    own(slot);
+    path[path_length++] = PathStep{slot, sub_direction};
+    slot = &(*slot)->get_mutable_child(sub_direction);
+
+    while ((*slot)->get_child(-sub_direction) != nullptr) {
+        if (path_length == TreeType::MAX_PATH_LENGTH) {
+            throw std::runtime_error("remove(): Tree is too tall.");
+        }
+        own(slot);
+        path[path_length++] = PathStep{slot, -sub_direction};
+        slot = &(*slot)->get_mutable_child(-sub_direction);
+    }
+
+    (*found_slot)->content = (*slot)->get_content();
+    TreePtr other_child = (*slot)->get_child(sub_direction);
+    *slot = std::move(other_child);
+    rebuild_path(path, path_length);
+}
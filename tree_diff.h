@@ -0,0 +1,146 @@
+#pragma once
+
+#include "persistent_avl_tree.h"
+
+#include <functional>
+#include <vector>
+
+
+enum DiffKind {
+    ENTRY_ADDED,   // Only in the new version.
+    ENTRY_REMOVED, // Only in the old version.
+    ENTRY_CHANGED  // In both (cmp says equal), but with different content (equal says not equal).
+};
+
+
+namespace TreeOps {
+
+    namespace detail {
+
+        // Either a whole subtree still to be walked, or just its root node (its children already pushed).
+        template<typename TreeType>
+        struct DiffFrontierItem {
+            TreeType* node;
+            bool just_node;
+        };
+
+        // The rest of a tree, in order, as a stack whose top is the next thing in order.
+        template<typename TreeType>
+        class DiffFrontier {
+            public:
+                explicit DiffFrontier(TreeType* root) {
+                    if (root != nullptr) {
+                        items.push_back(DiffFrontierItem<TreeType>{root, false});
+                    }
+                }
+
+                bool empty() const { return items.empty(); }
+                const DiffFrontierItem<TreeType>& top() const { return items.back(); }
+                void pop() { items.pop_back(); }
+
+                // Replaces the subtree on top by its left subtree, then its root, then its right subtree.
+                void expand() {
+                    TreeType* node = items.back().node;
+                    items.pop_back();
+                    if (node->get_right() != nullptr) {
+                        items.push_back(DiffFrontierItem<TreeType>{node->get_right().get(), false});
+                    }
+                    items.push_back(DiffFrontierItem<TreeType>{node, true});
+                    if (node->get_left() != nullptr) {
+                        items.push_back(DiffFrontierItem<TreeType>{node->get_left().get(), false});
+                    }
+                }
+
+                // Height of the top for choosing which side to expand: a lone node counts as 0.
+                int top_height() const { return top().just_node ? 0 : top().node->get_height(); }
+
+            private:
+                std::vector<DiffFrontierItem<TreeType>> items;
+        };
+
+    }
+
+    /*
+     * Calls callback(kind, old_content, new_content) for every entry that differs between two versions of a tree
+     * sorted by cmp, in order (old_content is nullptr for ENTRY_ADDED, new_content for ENTRY_REMOVED).
+     *
+     * Both trees are walked in order together, a subtree at a time, and a subtree that is the very same node in
+     * both (as is most of two versions derived from one another) is skipped without looking inside. So the cost
+     * is about O(d log n) for d differences, not O(n). Nothing is allocated but two stacks.
+     */
+    template<typename TreePtr, typename Callback, typename Compare = ThreeWayLess, typename Equal = std::equal_to<typename TreePtr::element_type::NodeContentT>>
+    void diff(
+        const TreePtr& old_tree,
+        const TreePtr& new_tree,
+        Callback&& callback,
+        Compare cmp = Compare(),
+        Equal equal = Equal(),
+        int* num_visited = nullptr // If non-null, will be set to how many nodes were looked at (the rest were shared).
+    ) {
+        typedef typename TreePtr::element_type Tree;
+        detail::DiffFrontier<Tree> old_frontier(old_tree.get());
+        detail::DiffFrontier<Tree> new_frontier(new_tree.get());
+        int visited = 0;
+
+        while (!old_frontier.empty() && !new_frontier.empty()) {
+            const detail::DiffFrontierItem<Tree>& old_top = old_frontier.top();
+            const detail::DiffFrontierItem<Tree>& new_top = new_frontier.top();
+            if (old_top.node == new_top.node && old_top.just_node == new_top.just_node) {
+                // The same subtree (or node) next in both: nothing in it differs.
+                old_frontier.pop();
+                new_frontier.pop();
+                continue;
+            }
+            if (!old_top.just_node || !new_top.just_node) {
+                // Open up the taller side, hoping to line up a shared subtree.
+                visited++;
+                if (old_frontier.top_height() >= new_frontier.top_height()) {
+                    old_frontier.expand();
+                } else {
+                    new_frontier.expand();
+                }
+                continue;
+            }
+
+            const int c = cmp(old_top.node->get_content(), new_top.node->get_content());
+            if (c < 0) {
+                callback(ENTRY_REMOVED, &old_top.node->get_content(), nullptr);
+                old_frontier.pop();
+            } else if (c > 0) {
+                callback(ENTRY_ADDED, nullptr, &new_top.node->get_content());
+                new_frontier.pop();
+            } else {
+                if (!equal(old_top.node->get_content(), new_top.node->get_content())) {
+                    callback(ENTRY_CHANGED, &old_top.node->get_content(), &new_top.node->get_content());
+                }
+                old_frontier.pop();
+                new_frontier.pop();
+            }
+        }
+
+        // Whatever is left is only on one side.
+        while (!old_frontier.empty()) {
+            if (!old_frontier.top().just_node) {
+                visited++;
+                old_frontier.expand();
+                continue;
+            }
+            callback(ENTRY_REMOVED, &old_frontier.top().node->get_content(), nullptr);
+            old_frontier.pop();
+        }
+        while (!new_frontier.empty()) {
+            if (!new_frontier.top().just_node) {
+                visited++;
+                new_frontier.expand();
+                continue;
+            }
+            callback(ENTRY_ADDED, nullptr, &new_frontier.top().node->get_content());
+            new_frontier.pop();
+        }
+
+        if (num_visited != nullptr) {
+            *num_visited = visited;
+        }
+    }
+
+}
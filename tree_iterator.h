@@ -0,0 +1,228 @@
+#pragma once
+
+#include "persistent_avl_tree.h"
+
+#include <cassert>
+#include <cstddef>
+#include <iterator>
+#include <stdexcept>
+#include <utility>
+
+
+/*
+ * A bidirectional iterator over the nodes of one version of a tree, in order.
+ *
+ * It holds on to the version it walks, plus the path from the root to the current node in a fixed-size
+ * array (MAX_PATH_LENGTH) inside the iterator, so it never allocates. ++ and -- are amortised O(1), so a
+ * full scan is O(n) instead of the O(n log n) of a find() per index.
+ *
+ * At end, the path is empty and get_index() is the size of the tree.
+ */
+template<typename TreeType>
+class TreeIterator {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef typename TreeType::NodeContentT value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const value_type* pointer;
+        typedef const value_type& reference;
+
+        typedef typename TreeType::TreePtr TreePtr;
+
+        TreeIterator(): path_length(0), index(0) {}
+
+        static TreeIterator begin(const TreePtr& root) { return at_index(root, 0); }
+        static TreeIterator end(const TreePtr& root) { return at_index(root, TreeOps::get_size(root)); }
+
+        // Throws unless 0 <= index <= size (index == size gives end).
+        static TreeIterator at_index(const TreePtr& root, int index);
+
+        /*
+         * The node found by finder_func or, if finder_func ends at an empty spot, the first node after that spot
+         * (or end). With cmp_finder(), that is the first node not less than the key, if keys are unique.
+         */
+        template<typename Finder>
+        static TreeIterator seek(const TreePtr& root, Finder&& finder_func);
+
+        reference operator*() const { assert(path_length > 0); return path[path_length - 1].node->get_content(); }
+        pointer operator->() const { return &**this; }
+
+        // The current node. Stays valid for as long as this iterator (or any other handle to the version) does.
+        TreeType* get_node() const { assert(path_length > 0); return path[path_length - 1].node; }
+
+        int get_index() const { return index; }
+
+        TreeIterator& operator++();
+        TreeIterator& operator--();
+        TreeIterator operator++(int) { TreeIterator ret = *this; ++*this; return ret; }
+        TreeIterator operator--(int) { TreeIterator ret = *this; --*this; return ret; }
+
+        // Only meaningful between iterators over the same version.
+        friend bool operator==(const TreeIterator& a, const TreeIterator& b) { return a.index == b.index; }
+        friend bool operator!=(const TreeIterator& a, const TreeIterator& b) { return a.index != b.index; }
+
+    private:
+        /*
+         * One step of the path: a node, and which of its children the path goes on to (meaningless for the last).
+         * Climbing back up goes by direction, not by comparing pointers: a node's left and right may be the very
+         * same subtree (e.g. after join(t, k, t)).
+         */
+        struct PathStep {
+            TreeType* node;
+            int direction;
+        };
+
+        void push(TreeType* node) {
+            if (path_length == TreeType::MAX_PATH_LENGTH) {
+                throw std::runtime_error("TreeIterator: Tree is too tall.");
+            }
+            path[path_length++] = PathStep{node, 0};
+        }
+
+        // Pushes node, then keeps going to the left_or_right child until there is none.
+        void push_furthest(TreeType* node, int left_or_right) {
+            while (node != nullptr) {
+                push(node);
+                path[path_length - 1].direction = left_or_right;
+                node = node->get_child(left_or_right).get();
+            }
+        }
+
+        TreePtr root;
+        PathStep path[TreeType::MAX_PATH_LENGTH]; // Root first. Raw pointers: root keeps every node alive.
+        int path_length;
+        int index;
+};
+
+
+/*
+ * One version of a tree as a range, for range-for and <algorithm>.
+ */
+template<typename TreeType>
+class TreeRange {
+    public:
+        typedef TreeIterator<TreeType> iterator;
+        typedef TreeIterator<TreeType> const_iterator;
+
+        explicit TreeRange(const typename TreeType::TreePtr& root): root(root) {}
+
+        iterator begin() const { return iterator::begin(root); }
+        iterator end() const { return iterator::end(root); }
+
+    private:
+        typename TreeType::TreePtr root;
+};
+
+
+namespace TreeOps {
+
+    template<typename TreePtr>
+    TreeRange<typename TreePtr::element_type> in_order(const TreePtr& tree) {
+        return TreeRange<typename TreePtr::element_type>(tree);
+    }
+
+}
+
+
+// Class method implementations defined here:
+// --------------------------------------------------
+
+// (static method)
+template<typename TreeType>
+TreeIterator<TreeType> TreeIterator<TreeType>::at_index(const TreePtr& root, int index) {
+    if (index < 0 || TreeOps::get_size(root) < index) {
+        throw std::runtime_error("at_index(): Index out of bounds.");
+    }
+    TreeIterator ret;
+    ret.root = root;
+    ret.index = index;
+    if (index == TreeOps::get_size(root)) {
+        return ret;
+    }
+
+    TreeType* node = root.get();
+    while (true) {
+        ret.push(node);
+        const int left_size = TreeOps::get_size(node->get_left());
+        if (index == left_size) {
+            return ret;
+        }
+        const int direction = (index < left_size) ? -1 : 1;
+        if (direction > 0) {
+            index -= left_size + 1;
+        }
+        ret.path[ret.path_length - 1].direction = direction;
+        node = node->get_child(direction).get();
+    }
+}
+
+// (static method)
+template<typename TreeType>
+template<typename Finder>
+TreeIterator<TreeType> TreeIterator<TreeType>::seek(const TreePtr& root, Finder&& finder_func) {
+    TreeIterator ret;
+    ret.root = root;
+
+    // The path up to the last node we went left from: where we end up if the search ends at an empty spot.
+    int successor_path_length = 0;
+
+    const TreePtr* current = &root;
+    while (*current != nullptr) {
+        ret.push(current->get());
+        const int direction = finder_func(*current);
+        if (direction == 0) {
+            ret.index += TreeOps::get_size((*current)->get_left());
+            return ret;
+        }
+        if (direction < 0) {
+            successor_path_length = ret.path_length;
+        } else {
+            ret.index += TreeOps::get_size((*current)->get_left()) + 1;
+        }
+        ret.path[ret.path_length - 1].direction = direction;
+        current = &(*current)->get_child(direction);
+    }
+    ret.path_length = successor_path_length;
+    return ret;
+}
+
+// (instance method)
+template<typename TreeType>
+TreeIterator<TreeType>& TreeIterator<TreeType>::operator++() {
+    assert(path_length > 0);
+    TreeType* node = path[path_length - 1].node;
+    if (node->get_right() != nullptr) {
+        path[path_length - 1].direction = 1;
+        push_furthest(node->get_right().get(), -1);
+    } else {
+        // Go up until we come up from a left child; that parent is next. If there is none, we are at end.
+        do {
+            path_length--;
+        } while (path_length > 0 && path[path_length - 1].direction > 0);
+    }
+    index++;
+    return *this;
+}
+
+// (instance method)
+template<typename TreeType>
+TreeIterator<TreeType>& TreeIterator<TreeType>::operator--() {
+    if (path_length == 0) {
+        // From end to the last node.
+        assert(root != nullptr);
+        push_furthest(root.get(), 1);
+    } else {
+        TreeType* node = path[path_length - 1].node;
+        if (node->get_left() != nullptr) {
+            path[path_length - 1].direction = -1;
+            push_furthest(node->get_left().get(), 1);
+        } else {
+            do {
+                path_length--;
+            } while (path_length > 0 && path[path_length - 1].direction < 0);
+            assert(path_length > 0); // Otherwise we were at begin.
+        }
+    }
+    index--;
+    return *this;
+}
@@ -0,0 +1,556 @@
+#pragma once
+
+#include "tree_serialization.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <istream>
+#include <sstream>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+/*
+ * An append-only file of committed versions of a tree.
+ *
+ * The log is a magic number followed by commits. A commit is a CommitHeader, then the NODE records (as in a
+ * snapshot, see tree_serialization.h) of the nodes that aren't in the log yet: O(log n) of them after an
+ * insert_or_replace() or remove(). A child is written as the distance back in bytes to its own record, so any
+ * node can be read straight from the file, and versions are only read when asked for.
+ *
+ * A commit is one write() (then an fsync(), if sync_on_commit). Opening the log checks every commit against its
+ * checksums. The last commit is dropped if it was cut short by a crash (its header or its records run past the
+ * end of the file); any other damage throws.
+ *
+ * Memory: the log keeps the file offset of each version's root, plus the nodes of the last version committed and
+ * of the version last read, so that nodes shared with those aren't read or written twice. So a branch or rollback
+ * made from get_version() also appends only its new nodes. A committed tree's nodes that it shares only with some
+ * other older version are written again (correct, just not shared on disk).
+ *
+ * Versions can't be removed from a log in place; compact() writes a new log of just the versions to keep.
+ */
+template<typename TreeType, typename Codec = TrivialCodec<typename TreeType::NodeContentT>>
+class TreeLog {
+    public:
+        typedef typename TreeType::TreePtr TreePtr;
+
+        // Opens the log at path, creating it if there is none, and checks every committed version.
+        explicit TreeLog(const std::string& path, bool sync_on_commit = true, Codec codec = Codec()):
+            TreeLog(path, sync_on_commit, codec, false)
+        {}
+        ~TreeLog() { close(fd); }
+
+        TreeLog(const TreeLog&) = delete;
+        TreeLog& operator=(const TreeLog&) = delete;
+
+        // Appends root as a new version. Returns its version number (from 0). Throws if the write fails.
+        int commit(const TreePtr& root);
+
+        int get_num_versions() const { return int(root_offsets.size()); }
+
+        // Reads the version from the log (or not, for the last one committed). Throws if there is no such version.
+        TreePtr get_version(int version);
+
+        std::uint64_t get_file_size() const { return file_size; }
+        std::uint64_t get_num_nodes() const { return num_nodes; }
+
+        /*
+         * Offline compaction: writes a new log at compacted_path with just the given versions of the log at path,
+         * renumbered from 0 in that order, and so just the nodes reachable from them. The log at path is only read.
+         * The new log replaces any file at compacted_path at once (by rename()), and only once it is complete.
+         */
+        static void compact(
+            const std::string& path,
+            const std::string& compacted_path,
+            const std::vector<int>& versions_to_keep,
+            Codec codec = Codec()
+        );
+
+    private:
+        typedef typename TreeType::NodeContentT NodeContent;
+        typedef std::unordered_map<std::uint64_t, TreePtr> NodesByOffset;
+
+        static const char* magic() { return "PAVLLOG2"; }
+        static constexpr std::size_t MAGIC_SIZE = 8;
+        static constexpr std::size_t WINDOW_SIZE = 1 << 16;
+
+        // Written as raw bytes, like TrivialCodec (so only for reading back on the same platform).
+        struct CommitHeader {
+            std::uint64_t root_offset;      // Of the root's NODE record (maybe in an earlier commit), or 0 if empty.
+            std::uint32_t records_size;     // Bytes of NODE records after the header.
+            std::uint32_t num_records;
+            std::uint32_t records_checksum;
+            std::uint32_t header_checksum;  // Of the fields above.
+        };
+        static_assert(sizeof(CommitHeader) == 24, "TreeLog: CommitHeader must not have padding.");
+
+        // Reads a range of memory in place as an istream, so that Codec::read() can read from the window.
+        struct MemoryBuf : public std::streambuf {
+            MemoryBuf(const char* begin, const char* end) {
+                setg(const_cast<char*>(begin), const_cast<char*>(begin), const_cast<char*>(end));
+            }
+        };
+
+        // FNV-1a. Any one changed byte changes it.
+        static std::uint32_t checksum(const char* data, std::size_t size, std::uint32_t hash = 2166136261u) {
+            for (std::size_t i = 0; i < size; i++) {
+                hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+            }
+            return hash;
+        }
+
+        // With read_only, the file is never created, written to or truncated (and commit() may not be called).
+        TreeLog(const std::string& path, bool sync_on_commit, Codec codec, bool read_only);
+
+        // Checks every commit and drops a last one that was cut short. Reads the last version.
+        void read_log();
+
+        /*
+         * Writes the records of node and of the nodes below it that aren't in the log yet (post-order, so children
+         * come first), as if out started at offset records_start. Returns node's record offset (0 if empty).
+         */
+        std::uint64_t write_nodes(
+            std::ostream& out,
+            const TreePtr& node,
+            std::uint64_t records_start,
+            std::unordered_map<TreeType*, std::uint64_t>* new_offsets,
+            NodesByOffset* new_nodes,
+            std::uint32_t* num_records,
+            std::unordered_set<TreeType*>* shared // Will get the nodes of the last version committed that it reached.
+        );
+
+        // Forgets node and the nodes below it that are in written, except for the ones in shared and below them.
+        void forget(const TreePtr& node, const std::unordered_set<TreeType*>& shared);
+
+        // Reads the node whose record is at offset, and the nodes below it, unless they have been read already.
+        TreePtr read_node(std::uint64_t offset, NodesByOffset* loaded);
+
+        // Returns the content of the NODE record at offset, and sets its children's distances back.
+        NodeContent read_record(std::uint64_t offset, std::uint64_t* left_distance, std::uint64_t* right_distance);
+
+        // Reads about size bytes around offset (mostly before it: children are written before their parents).
+        void fill_window(std::uint64_t offset, std::size_t size);
+
+        void read_exactly(std::uint64_t offset, char* buf, std::size_t size) const;
+        void write_all(const std::string& bytes);
+
+        int fd;
+        const bool read_only;
+        const bool sync_on_commit;
+        bool failed; // A write failed, so the log on disk may not match written any more.
+        Codec codec;
+        std::uint64_t file_size;
+        std::uint64_t num_nodes;
+        std::vector<std::uint64_t> root_offsets; // By version.
+
+        TreePtr last_committed; // Keeps every node in written and committed_nodes alive.
+        std::unordered_map<TreeType*, std::uint64_t> written; // Nodes of last_committed (by pointer identity, as for
+                                                              // DrawMemo), and their record offsets.
+        NodesByOffset committed_nodes; // The same nodes, by record offset.
+        NodesByOffset last_loaded; // The nodes of the version last read.
+        std::unordered_map<TreeType*, std::uint64_t> loaded_offsets; // The same nodes, by pointer identity.
+
+        std::string window; // The bytes of the file from window_offset on, to read records from.
+        std::uint64_t window_offset;
+};
+
+
+// Class method implementations defined here:
+// --------------------------------------------------
+
+#define TreeLogX TreeLog<TreeType, Codec>
+
+// (constructor)
+template<typename TreeType, typename Codec>
+TreeLogX::TreeLog(const std::string& path, bool sync_on_commit, Codec codec, bool read_only):
+    fd(-1),
+    read_only(read_only),
+    sync_on_commit(sync_on_commit),
+    failed(false),
+    codec(codec),
+    file_size(0),
+    num_nodes(0),
+    window_offset(0)
+{
+    fd = read_only ? open(path.c_str(), O_RDONLY) : open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("TreeLog(): Could not open file.");
+    }
+    try {
+        read_log();
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+}
+
+// (instance method)
+template<typename TreeType, typename Codec>
+void TreeLogX::read_log() {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        throw std::runtime_error("TreeLog(): Could not read file.");
+    }
+    const std::uint64_t end = std::uint64_t(st.st_size);
+    if (end == 0) {
+        if (!read_only) {
+            write_all(std::string(magic(), MAGIC_SIZE));
+        }
+        return;
+    }
+    char magic_read[MAGIC_SIZE];
+    if (end < MAGIC_SIZE || (read_exactly(0, magic_read, MAGIC_SIZE), memcmp(magic_read, magic(), MAGIC_SIZE) != 0)) {
+        throw std::runtime_error("TreeLog(): Not a tree log.");
+    }
+
+    std::uint64_t offset = MAGIC_SIZE;
+    std::vector<char> buf(WINDOW_SIZE);
+    while (offset < end) {
+        CommitHeader header;
+        if (end - offset < sizeof(header)) {
+            break; // Cut short.
+        }
+        read_exactly(offset, reinterpret_cast<char*>(&header), sizeof(header));
+        if (header.header_checksum != checksum(reinterpret_cast<const char*>(&header), offsetof(CommitHeader, header_checksum))) {
+            throw std::runtime_error("TreeLog(): Corrupt log (bad commit header).");
+        }
+        const std::uint64_t records_start = offset + sizeof(header);
+        const std::uint64_t records_end = records_start + header.records_size;
+        if (records_end > end) {
+            break; // Cut short.
+        }
+        std::uint32_t hash = checksum(nullptr, 0);
+        for (std::uint64_t at = records_start; at < records_end; at += buf.size()) {
+            const std::size_t n = std::size_t(std::min<std::uint64_t>(buf.size(), records_end - at));
+            read_exactly(at, buf.data(), n);
+            hash = checksum(buf.data(), n, hash);
+        }
+        if (hash != header.records_checksum) {
+            throw std::runtime_error("TreeLog(): Corrupt log (bad commit).");
+        }
+        if (header.root_offset != 0 && (header.root_offset < MAGIC_SIZE || header.root_offset >= records_end)) {
+            throw std::runtime_error("TreeLog(): Corrupt log (bad root).");
+        }
+        root_offsets.push_back(header.root_offset);
+        num_nodes += header.num_records;
+        offset = records_end;
+    }
+
+    if (offset < end && !read_only && ftruncate(fd, off_t(offset)) != 0) {
+        throw std::runtime_error("TreeLog(): Could not drop an unfinished commit.");
+    }
+    file_size = offset;
+
+    if (!root_offsets.empty()) {
+        last_committed = read_node(root_offsets.back(), &committed_nodes);
+        for (const typename NodesByOffset::value_type& entry : committed_nodes) {
+            written[entry.second.get()] = entry.first;
+        }
+    }
+}
+
+// (instance method)
+template<typename TreeType, typename Codec>
+int TreeLogX::commit(const TreePtr& root) {
+    assert(!read_only);
+    if (failed) {
+        throw std::runtime_error("commit(): An earlier commit failed, so the log must be reopened.");
+    }
+    std::ostringstream out;
+    std::unordered_map<TreeType*, std::uint64_t> new_offsets;
+    NodesByOffset new_nodes;
+    std::unordered_set<TreeType*> shared;
+    CommitHeader header;
+    header.num_records = 0;
+    header.root_offset = write_nodes(out, root, file_size + sizeof(header), &new_offsets, &new_nodes, &header.num_records, &shared);
+    const std::string records = out.str();
+    if (records.size() > std::uint32_t(-1)) {
+        throw std::runtime_error("commit(): Commit too big.");
+    }
+    header.records_size = std::uint32_t(records.size());
+    header.records_checksum = checksum(records.data(), records.size());
+    header.header_checksum = checksum(reinterpret_cast<const char*>(&header), offsetof(CommitHeader, header_checksum));
+
+    write_all(std::string(reinterpret_cast<const char*>(&header), sizeof(header)) + records);
+    if (sync_on_commit && fsync(fd) != 0) {
+        failed = true;
+        throw std::runtime_error("commit(): Could not sync file.");
+    }
+    root_offsets.push_back(header.root_offset);
+    num_nodes += header.num_records;
+
+    // From now on, remember just the nodes of root.
+    forget(last_committed, shared);
+    written.insert(new_offsets.begin(), new_offsets.end());
+    committed_nodes.insert(new_nodes.begin(), new_nodes.end());
+    last_committed = root;
+    return int(root_offsets.size()) - 1;
+}
+
+// (instance method)
+template<typename TreeType, typename Codec>
+typename TreeLogX::TreePtr TreeLogX::get_version(int version) {
+    if (version < 0 || int(root_offsets.size()) <= version) {
+        throw std::runtime_error("get_version(): No such version.");
+    }
+    if (version == int(root_offsets.size()) - 1) {
+        return last_committed;
+    }
+    NodesByOffset loaded;
+    const TreePtr root = read_node(root_offsets[version], &loaded);
+    last_loaded.swap(loaded);
+    loaded_offsets.clear();
+    for (const typename NodesByOffset::value_type& entry : last_loaded) {
+        loaded_offsets[entry.second.get()] = entry.first;
+    }
+    return root;
+}
+
+// (instance method)
+template<typename TreeType, typename Codec>
+std::uint64_t TreeLogX::write_nodes(
+    std::ostream& out,
+    const TreePtr& node,
+    std::uint64_t records_start,
+    std::unordered_map<TreeType*, std::uint64_t>* new_offsets,
+    NodesByOffset* new_nodes,
+    std::uint32_t* num_records,
+    std::unordered_set<TreeType*>* shared
+) {
+    if (node == nullptr) {
+        return 0;
+    }
+    const typename std::unordered_map<TreeType*, std::uint64_t>::const_iterator found = written.find(node.get());
+    if (found != written.end()) {
+        shared->insert(node.get());
+        return found->second;
+    }
+    const typename std::unordered_map<TreeType*, std::uint64_t>::const_iterator found_loaded = loaded_offsets.find(node.get());
+    if (found_loaded != loaded_offsets.end()) {
+        return found_loaded->second; // E.g. root was made from an older version (a branch or a rollback).
+    }
+    const typename std::unordered_map<TreeType*, std::uint64_t>::const_iterator found_new = new_offsets->find(node.get());
+    if (found_new != new_offsets->end()) {
+        return found_new->second; // Reached twice in root itself.
+    }
+
+    const std::uint64_t left_offset = write_nodes(out, node->get_left(), records_start, new_offsets, new_nodes, num_records, shared);
+    const std::uint64_t right_offset = write_nodes(out, node->get_right(), records_start, new_offsets, new_nodes, num_records, shared);
+    const std::uint64_t offset = records_start + std::uint64_t(out.tellp());
+    out.put(char(SerializationDetail::NODE_RECORD));
+    SerializationDetail::write_varint(out, (left_offset != 0) ? offset - left_offset : 0);
+    SerializationDetail::write_varint(out, (right_offset != 0) ? offset - right_offset : 0);
+    codec.write(out, node->get_content());
+    (*new_offsets)[node.get()] = offset;
+    (*new_nodes)[offset] = node;
+    (*num_records)++;
+    return offset;
+}
+
+// (instance method)
+template<typename TreeType, typename Codec>
+void TreeLogX::forget(const TreePtr& node, const std::unordered_set<TreeType*>& shared) {
+    if (node == nullptr || shared.count(node.get()) != 0) {
+        return;
+    }
+    const typename std::unordered_map<TreeType*, std::uint64_t>::iterator found = written.find(node.get());
+    if (found == written.end()) {
+        return; // Already forgotten (reached through another parent).
+    }
+    committed_nodes.erase(found->second);
+    written.erase(found);
+    forget(node->get_left(), shared);
+    forget(node->get_right(), shared);
+}
+
+// (instance method)
+template<typename TreeType, typename Codec>
+typename TreeLogX::TreePtr TreeLogX::read_node(std::uint64_t offset, NodesByOffset* loaded) {
+    typedef typename TreeType::HandlePolicyT HandlePolicy;
+
+    if (offset == 0) {
+        return nullptr;
+    }
+    const NodesByOffset* const read_already[] = {loaded, &committed_nodes, &last_loaded};
+    for (const NodesByOffset* nodes : read_already) {
+        const typename NodesByOffset::const_iterator found = nodes->find(offset);
+        if (found != nodes->end()) {
+            (*loaded)[offset] = found->second;
+            return found->second;
+        }
+    }
+
+    std::uint64_t left_distance;
+    std::uint64_t right_distance;
+    NodeContent content = read_record(offset, &left_distance, &right_distance);
+    if (left_distance > offset - MAGIC_SIZE || right_distance > offset - MAGIC_SIZE) {
+        throw std::runtime_error("get_version(): Corrupt log (bad child).");
+    }
+    const TreePtr left = read_node((left_distance != 0) ? offset - left_distance : 0, loaded);
+    const TreePtr right = read_node((right_distance != 0) ? offset - right_distance : 0, loaded);
+    const TreePtr node = HandlePolicy::template make<TreeType>(std::move(content), left, right);
+    (*loaded)[offset] = node;
+    return node;
+}
+
+// (instance method)
+template<typename TreeType, typename Codec>
+typename TreeLogX::NodeContent TreeLogX::read_record(
+    std::uint64_t offset,
+    std::uint64_t* left_distance,
+    std::uint64_t* right_distance
+) {
+    std::size_t size = WINDOW_SIZE;
+    while (true) {
+        if (offset < window_offset || offset >= window_offset + window.size()) {
+            fill_window(offset, size);
+        }
+        MemoryBuf buf(window.data() + (offset - window_offset), window.data() + window.size());
+        std::istream in(&buf);
+        const int record_type = in.get();
+        if (record_type != SerializationDetail::NODE_RECORD && record_type != std::istream::traits_type::eof()) {
+            throw std::runtime_error("get_version(): Corrupt log (bad record type).");
+        }
+        try {
+            *left_distance = SerializationDetail::read_varint(in);
+            *right_distance = SerializationDetail::read_varint(in);
+            NodeContent content = codec.read(in);
+            if (in) {
+                return content;
+            }
+        } catch (const std::runtime_error&) {
+            // Ran past the end of the window.
+        }
+        if (window_offset + window.size() >= file_size) {
+            throw std::runtime_error("get_version(): Corrupt log (record cut short).");
+        }
+        size *= 2;
+        fill_window(offset, size);
+    }
+}
+
+// (instance method)
+template<typename TreeType, typename Codec>
+void TreeLogX::fill_window(std::uint64_t offset, std::size_t size) {
+    const std::uint64_t end = std::min<std::uint64_t>(file_size, offset + size / 4);
+    const std::uint64_t start = std::max(std::uint64_t(MAGIC_SIZE), (end > size) ? end - size : 0);
+    window.resize(std::size_t(end - start));
+    read_exactly(start, &window[0], window.size());
+    window_offset = start;
+}
+
+// (instance method)
+template<typename TreeType, typename Codec>
+void TreeLogX::read_exactly(std::uint64_t offset, char* buf, std::size_t size) const {
+    while (size > 0) {
+        const ssize_t n = pread(fd, buf, size, off_t(offset));
+        if (n < 0 && errno == EINTR) {
+            continue; // Interrupted by a signal before reading anything.
+        }
+        if (n <= 0) {
+            throw std::runtime_error("read_exactly(): Could not read file.");
+        }
+        buf += n;
+        offset += std::uint64_t(n);
+        size -= std::size_t(n);
+    }
+}
+
+// (instance method)
+template<typename TreeType, typename Codec>
+void TreeLogX::write_all(const std::string& bytes) {
+    std::size_t written_size = 0;
+    while (written_size < bytes.size()) {
+        const ssize_t n = write(fd, bytes.data() + written_size, bytes.size() - written_size);
+        if (n < 0 && errno == EINTR) {
+            continue; // Interrupted by a signal before writing anything.
+        }
+        if (n < 0) {
+            failed = true;
+            throw std::runtime_error("write_all(): Could not write file.");
+        }
+        written_size += std::size_t(n);
+    }
+    file_size += bytes.size();
+}
+
+// (static method)
+template<typename TreeType, typename Codec>
+void TreeLogX::compact(
+    const std::string& path,
+    const std::string& compacted_path,
+    const std::vector<int>& versions_to_keep,
+    Codec codec /* = Codec() */
+) {
+    TreeLog log(path, false, codec, true);
+    struct stat source_stat;
+    struct stat target_stat;
+    if (fstat(log.fd, &source_stat) != 0) {
+        throw std::runtime_error("compact(): Could not read file.");
+    }
+    if (stat(compacted_path.c_str(), &target_stat) == 0
+        && target_stat.st_dev == source_stat.st_dev
+        && target_stat.st_ino == source_stat.st_ino
+    ) {
+        throw std::runtime_error("compact(): Can't compact a log into itself.");
+    }
+    for (int version : versions_to_keep) {
+        if (version < 0 || log.get_num_versions() <= version) {
+            throw std::runtime_error("compact(): No such version.");
+        }
+    }
+
+    // Written next to compacted_path, then renamed over it: a crash never leaves a partial log there.
+    std::string temp_path = compacted_path + ".XXXXXX";
+    const int temp_fd = mkstemp(&temp_path[0]);
+    if (temp_fd < 0) {
+        throw std::runtime_error("compact(): Could not create file.");
+    }
+    close(temp_fd);
+    try {
+        TreeLog compacted(temp_path, false, codec);
+        for (int version : versions_to_keep) {
+            // Each version read shares its nodes with the one read just before, which is the one just committed.
+            compacted.commit(log.get_version(version));
+        }
+        if (fsync(compacted.fd) != 0) {
+            throw std::runtime_error("compact(): Could not sync file.");
+        }
+    } catch (...) {
+        unlink(temp_path.c_str());
+        throw;
+    }
+    if (rename(temp_path.c_str(), compacted_path.c_str()) != 0) {
+        unlink(temp_path.c_str());
+        throw std::runtime_error("compact(): Could not rename file.");
+    }
+
+    // So that the rename itself survives a crash.
+    const std::string::size_type slash = compacted_path.rfind('/');
+    const std::string dir_path = (slash == std::string::npos) ? "." : (slash == 0) ? "/" : compacted_path.substr(0, slash);
+    const int dir_fd = open(dir_path.c_str(), O_RDONLY);
+    if (dir_fd < 0) {
+        throw std::runtime_error("compact(): Could not open directory.");
+    }
+    const int synced = fsync(dir_fd);
+    close(dir_fd);
+    if (synced != 0) {
+        throw std::runtime_error("compact(): Could not sync directory.");
+    }
+}
+
+#undef TreeLogX
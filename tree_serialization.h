@@ -0,0 +1,294 @@
+#pragma once
+
+#include "persistent_avl_tree.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+
+/*
+ * Binary snapshots of one or many versions of a tree, written so each distinct node is written once.
+ *
+ * A snapshot is a magic number followed by a stream of records:
+ *     NODE  left, right, content -- Children as a varint distance back to an earlier node (0 for none).
+ *     ROOT  node                 -- A version, as a varint node id (1-based, 0 for an empty tree).
+ *     END
+ * Nodes are numbered in the order they are written, children before parents. A node reachable from several
+ * versions (by pointer identity, as for DrawMemo) is only written the first time, and reading it back gives
+ * one node again, so versions that shared a subtree still do. Space is O(distinct nodes), not versions x size.
+ *
+ * Heights, sizes and summaries are not written; they are recomputed as nodes are made.
+ *
+ * A Codec turns NodeContent into bytes and back:
+ *     void write(std::ostream& out, const NodeContent& content) const
+ *     NodeContent read(std::istream& in) const
+ */
+
+
+// Writes the bytes of a trivially copyable type as they are (so only for reading back on the same platform).
+template<typename T>
+struct TrivialCodec {
+    static_assert(std::is_trivially_copyable<T>::value, "TrivialCodec: T must be trivially copyable.");
+
+    void write(std::ostream& out, const T& value) const {
+        out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    T read(std::istream& in) const {
+        T value;
+        in.read(reinterpret_cast<char*>(&value), sizeof(T));
+        return value;
+    }
+};
+
+// A varint length, then the characters.
+struct StringCodec {
+    void write(std::ostream& out, const std::string& value) const;
+    std::string read(std::istream& in) const;
+};
+
+
+namespace SerializationDetail {
+
+    const char SNAPSHOT_MAGIC[8] = {'P', 'A', 'V', 'L', 'S', 'N', 'P', '1'};
+
+    enum RecordType : unsigned char { NODE_RECORD = 1, ROOT_RECORD = 2, END_RECORD = 3 };
+
+    inline void write_varint(std::ostream& out, uint64_t value) {
+        char buf[10];
+        int len = 0;
+        while (value >= 0x80) {
+            buf[len++] = char((value & 0x7f) | 0x80);
+            value >>= 7;
+        }
+        buf[len++] = char(value);
+        out.write(buf, len);
+    }
+
+    inline uint64_t read_varint(std::istream& in) {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            const int c = in.get();
+            if (c == std::istream::traits_type::eof()) {
+                throw std::runtime_error("read_varint(): Unexpected end of input.");
+            }
+            value |= uint64_t(c & 0x7f) << shift;
+            if ((c & 0x80) == 0) {
+                return value;
+            }
+        }
+        throw std::runtime_error("read_varint(): Varint too long.");
+    }
+
+}
+
+
+/*
+ * Writes versions of a tree to out, one add_version() at a time, then finish().
+ * Nodes written by an earlier add_version() are not written again.
+ * Both throw if out fails (e.g. the disk is full), so a snapshot that was cut short never passes for a whole one.
+ */
+template<typename TreeType, typename Codec = TrivialCodec<typename TreeType::NodeContentT>>
+class SnapshotWriter {
+    public:
+        typedef typename TreeType::TreePtr TreePtr;
+
+        explicit SnapshotWriter(std::ostream& out, Codec codec = Codec());
+
+        // Writes the nodes of root that aren't written yet, then a ROOT record. Returns root's node id (0 if empty).
+        uint32_t add_version(const TreePtr& root);
+
+        // Writes the END record. Nothing may be added after this.
+        void finish();
+
+        // Number of distinct nodes written so far.
+        uint32_t get_num_nodes() const { return num_nodes; }
+
+    private:
+        uint32_t write_nodes(TreeType* node);
+
+        std::ostream& out;
+        Codec codec;
+        uint32_t num_nodes;
+        bool finished;
+        std::unordered_map<TreeType*, uint32_t> node_ids; // Like DrawMemo: by pointer identity.
+        std::vector<TreePtr> roots; // Keeps every written node alive, so no address in node_ids is reused.
+};
+
+
+/*
+ * Reads a snapshot written by SnapshotWriter (with the same Codec). Returns its versions, in the order they
+ * were added. Throws if the input is not a snapshot or is cut short.
+ */
+template<typename TreeType, typename Codec = TrivialCodec<typename TreeType::NodeContentT>>
+std::vector<typename TreeType::TreePtr> read_snapshot(std::istream& in, Codec codec = Codec());
+
+
+namespace TreeOps {
+
+    // Writes a snapshot of all of roots (sharing their common nodes). Throws if out fails.
+    template<typename TreePtr, typename Codec = TrivialCodec<typename TreePtr::element_type::NodeContentT>>
+    void write_snapshot(std::ostream& out, const std::vector<TreePtr>& roots, Codec codec = Codec()) {
+        SnapshotWriter<typename TreePtr::element_type, Codec> writer(out, codec);
+        for (const TreePtr& root : roots) {
+            writer.add_version(root);
+        }
+        writer.finish();
+    }
+
+}
+
+
+// Class method implementations defined here:
+// --------------------------------------------------
+
+// (instance method)
+inline void StringCodec::write(std::ostream& out, const std::string& value) const {
+    SerializationDetail::write_varint(out, value.size());
+    out.write(value.data(), value.size());
+}
+
+// (instance method)
+inline std::string StringCodec::read(std::istream& in) const {
+    // In chunks, so that a corrupt length runs into the end of the input instead of allocating it all up front.
+    std::string value;
+    char buf[4096];
+    for (uint64_t left = SerializationDetail::read_varint(in); left > 0; ) {
+        const size_t n = size_t(std::min<uint64_t>(left, sizeof(buf)));
+        in.read(buf, n);
+        if (!in) {
+            throw std::runtime_error("read(): Corrupt input (string longer than the rest of the input).");
+        }
+        value.append(buf, n);
+        left -= n;
+    }
+    return value;
+}
+
+#define SnapshotWriterX SnapshotWriter<TreeType, Codec>
+
+// (constructor)
+template<typename TreeType, typename Codec>
+SnapshotWriterX::SnapshotWriter(std::ostream& out, Codec codec /* = Codec() */):
+    out(out),
+    codec(codec),
+    num_nodes(0),
+    finished(false)
+{
+    out.write(SerializationDetail::SNAPSHOT_MAGIC, sizeof(SerializationDetail::SNAPSHOT_MAGIC));
+}
+
+// (instance method)
+template<typename TreeType, typename Codec>
+uint32_t SnapshotWriterX::add_version(const TreePtr& root) {
+    if (finished) {
+        throw std::runtime_error("add_version(): Snapshot is already finished.");
+    }
+    const uint32_t root_id = write_nodes(root.get());
+    roots.push_back(root);
+    out.put(char(SerializationDetail::ROOT_RECORD));
+    SerializationDetail::write_varint(out, root_id);
+    if (!out) {
+        throw std::runtime_error("add_version(): Could not write snapshot.");
+    }
+    return root_id;
+}
+
+// (instance method)
+template<typename TreeType, typename Codec>
+void SnapshotWriterX::finish() {
+    if (!finished) {
+        out.put(char(SerializationDetail::END_RECORD));
+        out.flush();
+        finished = true;
+        if (!out) {
+            throw std::runtime_error("finish(): Could not write snapshot.");
+        }
+    }
+}
+
+// (instance method)
+template<typename TreeType, typename Codec>
+uint32_t SnapshotWriterX::write_nodes(TreeType* node) {
+    if (node == nullptr) {
+        return 0;
+    }
+    const typename std::unordered_map<TreeType*, uint32_t>::const_iterator found = node_ids.find(node);
+    if (found != node_ids.end()) {
+        return found->second; // Shared with something already written.
+    }
+
+    // Post-order, so children always have smaller ids than their parent.
+    const uint32_t left_id = write_nodes(node->get_left().get());
+    const uint32_t right_id = write_nodes(node->get_right().get());
+    const uint32_t id = ++num_nodes;
+    out.put(char(SerializationDetail::NODE_RECORD));
+    SerializationDetail::write_varint(out, (left_id != 0) ? id - left_id : 0);
+    SerializationDetail::write_varint(out, (right_id != 0) ? id - right_id : 0);
+    codec.write(out, node->get_content());
+    node_ids[node] = id;
+    return id;
+}
+
+#undef SnapshotWriterX
+
+
+template<typename TreeType, typename Codec>
+std::vector<typename TreeType::TreePtr> read_snapshot(std::istream& in, Codec codec /* = Codec() */) {
+    typedef typename TreeType::TreePtr TreePtr;
+    typedef typename TreeType::HandlePolicyT HandlePolicy;
+
+    char magic[sizeof(SerializationDetail::SNAPSHOT_MAGIC)];
+    in.read(magic, sizeof(magic));
+    if (!in || memcmp(magic, SerializationDetail::SNAPSHOT_MAGIC, sizeof(magic)) != 0) {
+        throw std::runtime_error("read_snapshot(): Not a snapshot.");
+    }
+
+    std::vector<TreePtr> nodes; // nodes[id - 1]
+    std::vector<TreePtr> roots;
+    // A child, as a distance back from the id of the node being read (nodes.size() + 1), or 0 for none.
+    auto child_at_distance = [&](uint64_t distance) -> TreePtr {
+        if (distance == 0) {
+            return nullptr;
+        }
+        if (distance > nodes.size()) {
+            throw std::runtime_error("read_snapshot(): Corrupt snapshot (bad child).");
+        }
+        return nodes[nodes.size() - distance];
+    };
+
+    while (true) {
+        const int record_type = in.get();
+        if (record_type == SerializationDetail::NODE_RECORD) {
+            const uint64_t left_distance = SerializationDetail::read_varint(in);
+            const uint64_t right_distance = SerializationDetail::read_varint(in);
+            const TreePtr left = child_at_distance(left_distance);
+            const TreePtr right = child_at_distance(right_distance);
+            typename TreeType::NodeContentT content = codec.read(in);
+            if (!in) {
+                throw std::runtime_error("read_snapshot(): Unexpected end of input.");
+            }
+            nodes.push_back(HandlePolicy::template make<TreeType>(std::move(content), left, right));
+        } else if (record_type == SerializationDetail::ROOT_RECORD) {
+            const uint64_t root_id = SerializationDetail::read_varint(in);
+            if (root_id > nodes.size()) {
+                throw std::runtime_error("read_snapshot(): Corrupt snapshot (bad root).");
+            }
+            roots.push_back((root_id != 0) ? nodes[root_id - 1] : nullptr);
+        } else if (record_type == SerializationDetail::END_RECORD) {
+            return roots;
+        } else if (record_type == std::istream::traits_type::eof()) {
+            throw std::runtime_error("read_snapshot(): Unexpected end of input.");
+        } else {
+            throw std::runtime_error("read_snapshot(): Corrupt snapshot (bad record type).");
+        }
+    }
+}